@@ -406,17 +406,17 @@ bool triangle_t::intersection(const ray_t& r,vec_t& I) const {
     if(k < 0.0) return false; // ray goes away from triangle
     // for a segment, also test if (r > 1.0) => no intersect
     I = r.o + r.d * k; // intersect point of ray and plane
-    // is I inside T?
-    const float uu = u.dot(u);
-    const float uv = u.dot(v);
-    const float vv = v.dot(v);
+    // is I inside T?  in double, as D cancels away to noise in float for long thin triangles
+    const double uu = (double)u.x*u.x + (double)u.y*u.y + (double)u.z*u.z;
+    const double uv = (double)u.x*v.x + (double)u.y*v.y + (double)u.z*v.z;
+    const double vv = (double)v.x*v.x + (double)v.y*v.y + (double)v.z*v.z;
     const vec_t w = I - a;
-    const float wu = w.dot(u);
-    const float wv = w.dot(v);
-    const float D = uv * uv - uu * vv;
-    const float s = (uv * wv - vv * wu) / D;
+    const double wu = (double)w.x*u.x + (double)w.y*u.y + (double)w.z*u.z;
+    const double wv = (double)w.x*v.x + (double)w.y*v.y + (double)w.z*v.z;
+    const double D = uv * uv - uu * vv;
+    const double s = (uv * wv - vv * wu) / D;
     if(s<0.0 || s>1.0) return false; // I is outside T
-    const float t = (uv * wu - uu * wv) / D;
+    const double t = (uv * wu - uu * wv) / D;
     if(t<0.0 || (s+t)>1.0) return false; // I is outside T
     return true; // I is in T
 }
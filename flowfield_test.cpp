@@ -0,0 +1,80 @@
+/*
+ flowfield_test.cpp is part of the GlestNG RTS game engine.
+ Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE version 3
+ See LICENSE for details
+ (c) William Edwards, 2011; all rights reserved
+*/
+
+#include <stdlib.h>
+#include <math.h>
+#include <iostream>
+
+#include "error.hpp"
+#include "planet.hpp"
+#include "path.hpp"
+
+/* following a flow field from every point must reach its goal having paid what the field
+says it costs, and that must be what plain A* says the cheapest path costs */
+
+static bool same_cost(float a,float b) {
+	return fabs(a-b) <= std::max(a,b)*1e-4f+1e-6f;
+}
+
+static void check_field(const pathfinder_t& pathfinder,const planet_t& planet,GLuint goal) {
+	enum { SAMPLES = 100 };
+	const pathfinder_t::flowfield_ptr_t field = pathfinder.flowfield(goal);
+	assert(field.is_set());
+	assert(field->goal == goal);
+	assert(field->reachable(goal) && (field->cost[goal] == 0));
+	size_t reachable = 0;
+	for(GLuint p=0; p<planet.points.size(); p++) {
+		if(!field->reachable(p))
+			continue;
+		reachable++;
+		GLuint at = p;
+		float paid = 0;
+		for(size_t steps=0; at!=goal; steps++) {
+			assert(steps < planet.points.size()); // else it goes round in circles
+			const GLuint next = field->step(at);
+			const float step = pathfinder.cost(at,next);
+			assert(step >= 0);
+			paid += step;
+			at = next;
+		}
+		assert(same_cost(paid,field->cost[p]));
+	}
+	for(int i=0; i<SAMPLES; i++) {
+		const GLuint start = rand()%planet.points.size();
+		pathfinder_t::path_t path;
+		const bool found = pathfinder.find_direct(start,goal,path);
+		assert(found == field->reachable(start));
+		if(found)
+			assert(same_cost(pathfinder.cost(path),field->cost[start]));
+	}
+	std::cout << "goal " << goal << ": " << reachable << " of " << planet.points.size() << " points reach it" << std::endl;
+}
+
+int main(int argc,char** args) {
+	enum { GOALS = 4 };
+	srand(1);
+	std::auto_ptr<graphics_t::mgr_t> graphics_mgr(graphics_t::create());
+	try {
+		std::auto_ptr<terrain_t> terrain(terrain_t::gen_planet(4,200,3,terrain_t::FAULT_LINES,7));
+		const planet_t& planet = *static_cast<planet_t*>(terrain.get());
+		pathfinder_t pathfinder(planet);
+		std::vector<GLuint> goals;
+		while(goals.size() < GOALS) {
+			const GLuint p = rand()%planet.points.size();
+			if(planet.types[p] != planet_t::WATER)
+				goals.push_back(p);
+		}
+		pathfinder.flowfields(goals);
+		for(size_t i=0; i<goals.size(); i++)
+			check_field(pathfinder,planet,goals[i]);
+	} catch(glest_exception_t* e) {
+		std::cerr << e << std::endl;
+		return 1;
+	}
+	std::cout << "flow fields: ok" << std::endl;
+	return 0;
+}
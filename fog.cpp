@@ -0,0 +1,230 @@
+/*
+ fog.cpp is part of the GlestNG RTS game engine.
+ Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE version 3
+ See LICENSE for details
+ (c) William Edwards, 2011; all rights reserved
+*/
+
+#include <vector>
+#include <iostream>
+#include <stdlib.h>
+
+#include "fog.hpp"
+#include "planet.hpp"
+#include "error.hpp"
+
+struct fog_t::pimpl_t {
+	pimpl_t(const planet_t& p,size_t factions);
+	const planet_t& planet;
+	struct disc_t {
+		size_t faction;
+		float radius;
+		GLuint point; // the centre, once it has been updated
+		GLuint to; // the point it is centred on next update
+		bool live, pending;
+		std::vector<GLuint> covers;
+	};
+	std::vector<disc_t> discs;
+	std::vector<sight_t> unused;
+	struct side_t { // a faction
+		std::vector<uint16_t> seen; // how many discs cover each point
+		bits_t visible, explored;
+		std::vector<sight_t> pending; // discs added or moved since the last update
+		unsigned changes;
+	};
+	std::vector<side_t> sides;
+	void cover(side_t& side,const std::vector<GLuint>& points,bool on);
+	void update(size_t faction);
+	void check(size_t faction,bits_t& visible) const; // from scratch, for checking
+	static bool test(const bits_t& bits,GLuint p) { return bits[p/64] & (uint64_t(1) << (p%64)); }
+};
+
+fog_t::pimpl_t::pimpl_t(const planet_t& p,size_t factions): planet(p), sides(factions) {
+	const size_t points = planet.points.size();
+	for(size_t f=0; f<sides.size(); f++) {
+		side_t& side = sides[f];
+		side.seen.assign(points,0);
+		side.visible.assign((points+63)/64,0);
+		side.explored.assign((points+63)/64,0);
+		side.changes = 0;
+	}
+}
+
+void fog_t::pimpl_t::cover(side_t& side,const std::vector<GLuint>& points,bool on) {
+	for(std::vector<GLuint>::const_iterator p=points.begin(); p!=points.end(); p++) {
+		uint16_t& seen = side.seen[*p];
+		const uint64_t bit = uint64_t(1) << (*p%64);
+		if(on) {
+			if(!seen++) {
+				side.visible[*p/64] |= bit;
+				side.explored[*p/64] |= bit;
+				side.changes++;
+			} else if(!seen)
+				panic("too many sights on point " << *p);
+		} else if(!--seen) {
+			side.visible[*p/64] &= ~bit;
+			side.changes++;
+		}
+	}
+}
+
+void fog_t::pimpl_t::update(size_t faction) {
+	side_t& side = sides[faction];
+	for(std::vector<sight_t>::const_iterator s=side.pending.begin(); s!=side.pending.end(); s++) {
+		disc_t& disc = discs[*s];
+		if(disc.faction != faction) // removed and added again for another faction
+			continue;
+		disc.pending = false;
+		if(!disc.live || (disc.to == disc.point))
+			continue;
+		cover(side,disc.covers,false);
+		disc.covers.clear();
+		disc.point = disc.to;
+		planet.points_within(planet.points[disc.point],disc.radius,disc.covers);
+		cover(side,disc.covers,true);
+	}
+	side.pending.clear();
+}
+
+void fog_t::pimpl_t::check(size_t faction,bits_t& visible) const {
+	visible.assign(sides[faction].visible.size(),0);
+	std::vector<GLuint> covers;
+	for(std::vector<disc_t>::const_iterator d=discs.begin(); d!=discs.end(); d++) {
+		if(!d->live || (d->faction != faction) || (d->point == (GLuint)~0))
+			continue;
+		covers.clear();
+		planet.points_within(planet.points[d->point],d->radius,covers);
+		for(std::vector<GLuint>::const_iterator p=covers.begin(); p!=covers.end(); p++)
+			visible[*p/64] |= uint64_t(1) << (*p%64);
+	}
+}
+
+fog_t::fog_t(const planet_t& planet,size_t factions): pimpl(new pimpl_t(planet,factions)) {}
+
+fog_t::~fog_t() {
+	delete pimpl;
+}
+
+fog_t::sight_t fog_t::add(size_t faction,const vec_t& pos,float radius) {
+	if(faction >= pimpl->sides.size())
+		panic("there is no faction " << faction);
+	sight_t sight;
+	if(pimpl->unused.size()) {
+		sight = pimpl->unused.back();
+		pimpl->unused.pop_back();
+	} else {
+		sight = pimpl->discs.size();
+		pimpl->discs.push_back(pimpl_t::disc_t());
+		pimpl->discs.back().pending = false;
+	}
+	pimpl_t::disc_t& disc = pimpl->discs[sight];
+	disc.faction = faction;
+	disc.radius = radius;
+	disc.point = ~0;
+	disc.live = true;
+	disc.pending = false; // if it is still pending for its last faction, that is skipped
+	disc.covers.clear();
+	move(sight,pos);
+	return sight;
+}
+
+void fog_t::move(sight_t sight,const vec_t& pos) {
+	pimpl_t::disc_t& disc = pimpl->discs[sight];
+	if(!disc.live)
+		panic("sight " << sight << " has been removed");
+	disc.to = pimpl->planet.nearest_point(pos);
+	if((disc.to != disc.point) && !disc.pending) {
+		disc.pending = true;
+		pimpl->sides[disc.faction].pending.push_back(sight);
+	}
+}
+
+void fog_t::remove(sight_t sight) {
+	pimpl_t::disc_t& disc = pimpl->discs[sight];
+	if(!disc.live)
+		panic("sight " << sight << " has been removed");
+	pimpl->cover(pimpl->sides[disc.faction],disc.covers,false);
+	disc.covers.clear();
+	disc.live = false;
+	pimpl->unused.push_back(sight);
+}
+
+void fog_t::update() {
+	#pragma omp parallel for schedule(dynamic)
+	for(int f=0; f<(int)pimpl->sides.size(); f++)
+		pimpl->update(f);
+}
+
+bool fog_t::visible(size_t faction,GLuint point) const {
+	return pimpl_t::test(pimpl->sides[faction].visible,point);
+}
+
+bool fog_t::visible(size_t faction,const vec_t& pos) const {
+	return visible(faction,pimpl->planet.nearest_point(pos));
+}
+
+bool fog_t::explored(size_t faction,GLuint point) const {
+	return pimpl_t::test(pimpl->sides[faction].explored,point);
+}
+
+const fog_t::bits_t& fog_t::get_visible(size_t faction) const {
+	return pimpl->sides[faction].visible;
+}
+
+const fog_t::bits_t& fog_t::get_explored(size_t faction) const {
+	return pimpl->sides[faction].explored;
+}
+
+unsigned fog_t::get_changes(size_t faction) const {
+	return pimpl->sides[faction].changes;
+}
+
+void fog_t::benchmark() {
+	enum { UNITS = 500, TICKS = 10, MOVING = 10 }; // MOVING percent of the units each tick
+	const float SIGHT = 0.05f, STEP = 0.01f;
+	const planet_t& planet = pimpl->planet;
+	const size_t factions = pimpl->sides.size();
+	std::vector<sight_t> sights;
+	std::vector<vec_t> pos;
+	uint64_t start = high_precision_time();
+	for(size_t f=0; f<factions; f++)
+		for(int u=0; u<UNITS; u++) {
+			pos.push_back(planet.points[rand()%planet.points.size()]);
+			sights.push_back(add(f,pos.back(),SIGHT));
+		}
+	update();
+	const uint64_t first = high_precision_time()-start;
+	uint64_t ticks = 0;
+	for(int t=0; t<TICKS; t++) {
+		for(size_t i=0; i<sights.size(); i++)
+			if(rand()%100 < MOVING)
+				pos[i] = vec_t::normalise(pos[i]+vec_t(randf()-0.5f,randf()-0.5f,randf()-0.5f)*STEP);
+		start = high_precision_time();
+		for(size_t i=0; i<sights.size(); i++)
+			move(sights[i],pos[i]);
+		update();
+		ticks += high_precision_time()-start;
+	}
+	// the same bits recomputed from every disc, as a tick would without the counts
+	bits_t visible;
+	size_t disagree = 0, points = 0;
+	start = high_precision_time();
+	for(size_t f=0; f<factions; f++) {
+		pimpl->check(f,visible);
+		for(size_t w=0; w<visible.size(); w++) {
+			disagree += (visible[w] != pimpl->sides[f].visible[w]);
+			points += __builtin_popcountll(visible[w]);
+		}
+	}
+	const uint64_t scratch = high_precision_time()-start;
+	for(size_t i=0; i<sights.size(); i++)
+		remove(sights[i]);
+	bool cleared = true;
+	for(size_t f=0; f<factions; f++)
+		for(size_t w=0; w<pimpl->sides[f].visible.size(); w++)
+			cleared = cleared && !pimpl->sides[f].visible[w];
+	std::cout << "fog: " << factions << " factions of " << UNITS << " units, " << points << " points visible; " <<
+		"first update " << first << " ns, " << TICKS << " ticks with " << MOVING << "% moving " << (ticks/TICKS) <<
+		" ns each, from scratch " << scratch << " ns; " << disagree << " words disagree, " <<
+		(cleared? "cleared": "NOT CLEARED") << " when removed" << std::endl;
+}
@@ -0,0 +1,45 @@
+/*
+ fog.hpp is part of the GlestNG RTS game engine.
+ Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE version 3
+ See LICENSE for details
+ (c) William Edwards, 2011; all rights reserved
+*/
+
+#ifndef __FOG_HPP__
+#define __FOG_HPP__
+
+#include <vector>
+#include <inttypes.h>
+
+#include "graphics.hpp"
+#include "3d.hpp"
+
+struct planet_t;
+
+/* fog of war over the points of a planet, for each faction.  Every point counts the sights
+that cover it; a sight is the disc a unit sees around the point nearest it, and when the unit
+moves to another point its old disc is taken away and its new one added, so an update costs
+only the sights that moved.  A point is visible whilst its count is above 0, and explored once
+it has ever been */
+struct fog_t {
+	fog_t(const planet_t& planet,size_t factions);
+	~fog_t();
+	typedef size_t sight_t;
+	sight_t add(size_t faction,const vec_t& pos,float radius); // radius is a chord on the unit sphere
+	void move(sight_t sight,const vec_t& pos);
+	void remove(sight_t sight);
+	void update(); // applies the adds and moves since the last update, a faction per thread
+	bool visible(size_t faction,GLuint point) const;
+	bool visible(size_t faction,const vec_t& pos) const; // of the point nearest
+	bool explored(size_t faction,GLuint point) const;
+	typedef std::vector<uint64_t> bits_t; // point p is bit p%64 of word p/64
+	const bits_t& get_visible(size_t faction) const; // for the minimap and renderer
+	const bits_t& get_explored(size_t faction) const;
+	unsigned get_changes(size_t faction) const; // goes up whenever its bits change
+	void benchmark(); // prints timings to stdout
+private:
+	struct pimpl_t;
+	pimpl_t* pimpl;
+};
+
+#endif //__FOG_HPP__
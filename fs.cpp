@@ -6,6 +6,10 @@
 */
 
 #include <sys/stat.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 #include <string.h>
 #include <errno.h>
 #include <stdio.h>
@@ -27,21 +31,32 @@ public:
 	void read(void* dest,size_t bytes);
 	void write(const void* src,size_t bytes);
 	std::string read_all();
+	const uint8_t* map(size_t& bytes);
 	std::ostream& repr(std::ostream& out) const;
 private:
 	const std::string filename;
 	FILE* const f;
+	void* mapped;
+	size_t mapped_size;
+#ifdef WIN32
+	std::vector<uint8_t> slurped;
+#endif
 };
 
 FILE_stream_t::FILE_stream_t(fs_file_t& file,const char* filename_,const char* mode):
 	istream_t(file),
 	filename(filename_),
-	f(fopen(filename_,mode))
+	f(fopen(filename_,mode)),
+	mapped(NULL), mapped_size(0)
 {
 	if(!f) c_error("could not open "<<filename<<" for "<<mode);
 }
 
 FILE_stream_t::~FILE_stream_t() {
+#ifndef WIN32
+	if(mapped)
+		munmap(mapped,mapped_size);
+#endif
 	fclose(f);
 }
 
@@ -65,6 +80,36 @@ std::string FILE_stream_t::read_all() {
 	return ret;
 }
 
+const uint8_t* FILE_stream_t::map(size_t& bytes) {
+	if(!mapped) {
+		struct stat s;
+		if(fstat(fileno(f),&s))
+			c_error("could not stat "<<filename);
+		mapped_size = s.st_size;
+		if(!mapped_size) {
+			bytes = 0;
+			return NULL;
+		}
+#ifdef WIN32
+		// no mmap, so the file is read in one go instead
+		slurped.resize(mapped_size);
+		const long pos = ftell(f);
+		rewind(f);
+		read(&slurped[0],mapped_size);
+		fseek(f,pos,SEEK_SET);
+		mapped = &slurped[0];
+#else
+		mapped = mmap(NULL,mapped_size,PROT_READ,MAP_PRIVATE,fileno(f),0);
+		if(MAP_FAILED == mapped) {
+			mapped = NULL;
+			c_error("could not map "<<filename);
+		}
+#endif
+	}
+	bytes = mapped_size;
+	return (const uint8_t*)mapped;
+}
+
 void FILE_stream_t::read(void* dest,size_t bytes) {
 	const size_t ret = fread(dest,1,bytes,f);
 	if(ret < 0)
@@ -230,6 +275,57 @@ static bool _is_dir(const char* path) {
 
 bool fs_t::is_dir(const std::string& path) const { return _is_dir(canocial(path).c_str()); }
 
+uint64_t fs_t::modified(const std::string& path) const {
+	struct stat s;
+	_stat(canocial(path).c_str(),s);
+	return s.st_mtime;
+}
+
+std::string fs_t::cache_path(const std::string& path,const std::string& ext) const {
+	// a mirror of the data under cache/, so it is thrown away with the data it came from
+	return pimpl->data_directory+"cache/"+std::string(canocial(path),pimpl->data_directory.size())+ext;
+}
+
+static void _make_dirs(const std::string& path,size_t from) {
+	for(size_t sep=path.find('/',from); sep!=std::string::npos; sep=path.find('/',sep+1)) {
+		const std::string dir(path,0,sep);
+#ifdef WIN32
+		if(mkdir(dir.c_str()) && (EEXIST != errno))
+#else
+		if(mkdir(dir.c_str(),0755) && (EEXIST != errno))
+#endif
+			c_error("could not make directory "<<dir);
+	}
+}
+
+void fs_t::write(const std::string& path,const void* data,size_t bytes) {
+	const std::string target = canocial(path);
+	_make_dirs(target,pimpl->data_directory.size());
+	// written aside and renamed into place, so that readers never see a partial file
+#ifdef WIN32
+	std::string tmp = target+"~";
+	FILE* f = fopen(tmp.c_str(),"wb");
+#else
+	std::string tmp = target+"~XXXXXX";
+	const int fd = mkstemp(&tmp[0]);
+	FILE* f = (fd == -1)? NULL: fdopen(fd,"wb");
+#endif
+	if(!f)
+		c_error("could not create "<<tmp);
+	const bool written = (fwrite(data,1,bytes,f) == bytes);
+	if(fclose(f) || !written) {
+		remove(tmp.c_str());
+		c_error("could not write "<<bytes<<" bytes to "<<tmp);
+	}
+#ifdef WIN32
+	remove(target.c_str());
+#endif
+	if(rename(tmp.c_str(),target.c_str())) {
+		remove(tmp.c_str());
+		c_error("could not rename "<<tmp<<" to "<<target);
+	}
+}
+
 std::string fs_t::join(const std::string& path,const std::string& sub) const {
 	if(_starts_with(sub,pimpl->data_directory))
 		return canocial(sub);
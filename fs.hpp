@@ -37,6 +37,7 @@ public:
 	virtual void read(void* dest,size_t bytes) = 0;
 	template<int N> std::string fixed_str();
 	virtual std::string read_all() = 0;
+	virtual const uint8_t* map(size_t& bytes) = 0; // the whole stream, valid until it is closed
 	virtual std::ostream& repr(std::ostream& out) const = 0;
 	fs_file_t& file() { return _file; }
 	const fs_file_t& file() const { return _file; }
@@ -90,6 +91,9 @@ public:
 	inline std::string get_body(const std::string& parent,const std::string& rel);
 	strings_t list_dirs(const std::string& path);
 	strings_t list_files(const std::string& path);
+	uint64_t modified(const std::string& path) const; // seconds since the epoch
+	std::string cache_path(const std::string& path,const std::string& ext) const; // where to keep what is derived from path
+	void write(const std::string& path,const void* data,size_t bytes); // makes directories as needed, and replaces any file atomically
 	static fs_t* settings; // owned by auto_ptr in glestng.cpp
 private:
 	fs_t(const std::string& data_directory);
@@ -5,23 +5,377 @@
  (c) William Edwards, 2011; all rights reserved
 */
 
+#include <string.h>
+#include <math.h>
+#include <stddef.h>
+#include <float.h>
+#include <algorithm>
+#include <sstream>
+#include <map>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "g3d.hpp"
 #include "error.hpp"
 #include "graphics.hpp"
 #include "world.hpp"
+#include "techtree.hpp"
+#include "faction.hpp"
+
+struct model_g3d_t::reader_t {
+	/* a cursor over the whole file mapped in memory; arrays are handed out as pointers
+	into it, so they go to the GPU without being copied on the way */
+	reader_t(istream_t& s): stream(s), start(s.map(size)), at(start) {}
+	reader_t(istream_t& s,const uint8_t* buffer,size_t bytes): stream(s), size(bytes), start(buffer), at(start) {} // s names it in errors
+	istream_t& stream;
+	size_t size;
+	const uint8_t* const start;
+	const uint8_t* at;
+	const uint8_t* take(size_t count,size_t bytes) { // count items of bytes each
+		const size_t left = size-(at-start);
+		if(count && (bytes > left/count))
+			data_error(stream << " is truncated; wanted " << count << " of " << bytes << " bytes at " << (at-start) << " of " << size);
+		const uint8_t* ret = at;
+		at += count*bytes;
+		return ret;
+	}
+	template<typename T> T get() { // the buffer need not be aligned
+		T v;
+		memcpy(&v,take(1,sizeof(T)),sizeof(T));
+		return v;
+	}
+	uint8_t byte() { return get<uint8_t>(); }
+	uint16_t uint16() { return get<uint16_t>(); }
+	uint32_t uint32() { return get<uint32_t>(); }
+	uint64_t uint64() { return get<uint64_t>(); }
+	float float32() { return get<float>(); }
+	vec_t vec() {
+		const float x = float32(), y = float32();
+		return vec_t(x,y,float32());
+	}
+	std::string str() {
+		const uint32_t len = uint32();
+		return std::string((const char*)take(len,1),len);
+	}
+	void skip(size_t n) { take(1,n); }
+	template<int N> std::string fixed_str() {
+		const char* s = (const char*)take(1,N);
+		return std::string(s,strnlen(s,N));
+	}
+	fs_t& fs() { return stream.fs(); }
+};
+
+/* the cache a model is converted to the first time it is loaded: a header keyed on the
+source's path and modification time, then per mesh its frames of interleaved vertices, its
+texture coordinates and its indices, each ready to be copied straight to the GPU */
+static const uint32_t CACHE_MAGIC = 'G'|('3'<<8)|('D'<<16)|('C'<<24), CACHE_VERSION = 3;
+
+struct cache_writer_t { // appends what model_g3d_t::reader_t reads
+	std::vector<uint8_t> buf;
+	void put(const void* data,size_t bytes) { buf.insert(buf.end(),(const uint8_t*)data,(const uint8_t*)data+bytes); }
+	template<typename T> void put(T v) { put(&v,sizeof(T)); }
+	void vec(const vec_t& v) { put(v.x); put(v.y); put(v.z); }
+	void str(const std::string& s) {
+		put<uint32_t>(s.size());
+		put(s.data(),s.size());
+	}
+};
+
+struct cache_vertex_t { // as planet_t's vertices: positions are snorm16 in the model's scale, normals snorm8
+	enum { POS_SCALE = 32767, NORMAL_SCALE = 127 };
+	GLshort pos[3];
+	GLshort unused;
+	GLbyte normal[3];
+	GLbyte unused2;
+};
+
+static inline GLshort _snorm16(float f) {
+	return (GLshort)lrintf((f<-1.0f? -1.0f: f>1.0f? 1.0f: f)*cache_vertex_t::POS_SCALE);
+}
+
+static inline GLbyte _snorm8(float f) {
+	return (GLbyte)lrintf((f<-1.0f? -1.0f: f>1.0f? 1.0f: f)*cache_vertex_t::NORMAL_SCALE);
+}
+
+enum { LERP_ONE = 1<<14 }; // the weight of the second frame when wholly it
+
+static inline int _lerp(int a,int b,int w) {
+	return (a*(LERP_ONE-w)+b*w+LERP_ONE/2)>>14;
+}
+
+static inline int _lerp_normal(int a,int b,int w) { // to a 128th, so the sum fits in a short
+	w >>= 7;
+	return (a*(128-w)+b*w+64)>>7;
+}
+
+static void _lerp_vertices(cache_vertex_t* out,const cache_vertex_t* a,const cache_vertex_t* b,size_t count,int w) {
+	/* out = a+(b-a)*w/LERP_ONE rounded, both weights fitting in a GLshort; the normals are
+	lerped more coarsely and come out short, but GL_NORMALIZE is on.  The SSE2 path gives
+	exactly what the scalar one does */
+	size_t v = 0;
+#ifdef __SSE2__
+	/* four vertices are three vectors; each vector is lerped both as eight shorts and as
+	sixteen bytes, and the lanes that are positions taken from the one and normals the other */
+	static const uint8_t pos_lanes[48] = {
+		0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0,0,0,0, 0xff,0xff,0xff,0xff,
+		0xff,0xff,0xff,0xff,0,0,0,0, 0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
+		0,0,0,0, 0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0,0,0,0};
+	const __m128i weights = _mm_set1_epi32((w<<16)|(LERP_ONE-w)), round = _mm_set1_epi32(LERP_ONE/2),
+		byte_a = _mm_set1_epi16(128-(w>>7)), byte_b = _mm_set1_epi16(w>>7), byte_round = _mm_set1_epi16(64),
+		low_bytes = _mm_set1_epi16(0xff);
+	for(; v+4<=count; v+=4)
+		for(int k=0; k<3; k++) {
+			const __m128i x = _mm_loadu_si128((const __m128i*)(a+v)+k), y = _mm_loadu_si128((const __m128i*)(b+v)+k);
+			// shorts pair up for madd; bytes are sign-extended in place by shifts, sparing the shuffles
+			const __m128i shorts = _mm_packs_epi32(
+				_mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(x,y),weights),round),14),
+				_mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(x,y),weights),round),14));
+			#define LERP_BYTES(x,y) _mm_srai_epi16(_mm_add_epi16(_mm_add_epi16( \
+				_mm_mullo_epi16(x,byte_a),_mm_mullo_epi16(y,byte_b)),byte_round),7)
+			const __m128i even = LERP_BYTES(_mm_srai_epi16(_mm_slli_epi16(x,8),8),_mm_srai_epi16(_mm_slli_epi16(y,8),8)),
+				odd = LERP_BYTES(_mm_srai_epi16(x,8),_mm_srai_epi16(y,8));
+			#undef LERP_BYTES
+			const __m128i bytes = _mm_or_si128(_mm_and_si128(even,low_bytes),_mm_slli_epi16(odd,8));
+			const __m128i mask = _mm_loadu_si128((const __m128i*)pos_lanes+k);
+			_mm_storeu_si128((__m128i*)(out+v)+k,_mm_or_si128(_mm_and_si128(mask,shorts),_mm_andnot_si128(mask,bytes)));
+		}
+#endif
+	for(; v<count; v++) {
+		for(int i=0; i<3; i++) {
+			out[v].pos[i] = (GLshort)_lerp(a[v].pos[i],b[v].pos[i],w);
+			out[v].normal[i] = (GLbyte)_lerp_normal(a[v].normal[i],b[v].normal[i],w);
+		}
+		out[v].unused = 0;
+		out[v].unused2 = 0;
+	}
+}
+
+enum { VERTEX_CACHE_SIZE = 32 };
+
+static float _vertex_score(int cache_pos,size_t valence) {
+	// after Forsyth's linear-speed vertex cache optimisation
+	if(!valence)
+		return -1;
+	float score = 0;
+	if(cache_pos >= 0)
+		score = (cache_pos < 3)? 0.75f: powf(1.0f-(cache_pos-3)*(1.0f/(VERTEX_CACHE_SIZE-3)),1.5f);
+	return score+2.0f/sqrtf(valence);
+}
+
+static void _optimise_vertex_cache(std::vector<GLuint>& indices,size_t vertex_count) {
+	/* greedily emits the best scoring triangle of those using the vertices in a simulated
+	LRU cache, so that consecutive triangles share vertices the GPU has just transformed */
+	const size_t tri_count = indices.size()/3, NONE = ~(size_t)0;
+	std::vector<size_t> first(vertex_count+1,0), valence(vertex_count,0), tris(indices.size());
+	for(size_t i=0; i<indices.size(); i++)
+		valence[indices[i]]++;
+	for(size_t v=0; v<vertex_count; v++)
+		first[v+1] = first[v]+valence[v];
+	for(size_t i=0; i<indices.size(); i++) {
+		const GLuint v = indices[i];
+		tris[first[v]+(--valence[v])] = i/3;
+	}
+	for(size_t v=0; v<vertex_count; v++)
+		valence[v] = first[v+1]-first[v]; // the triangles not yet emitted are tris[first[v],first[v]+valence[v])
+	std::vector<int> cache_pos(vertex_count,-1);
+	std::vector<float> vertex_score(vertex_count), tri_score(tri_count,0);
+	for(size_t v=0; v<vertex_count; v++)
+		vertex_score[v] = _vertex_score(-1,valence[v]);
+	for(size_t t=0; t<tri_count; t++)
+		for(int i=0; i<3; i++)
+			tri_score[t] += vertex_score[indices[t*3+i]];
+	std::vector<bool> emitted(tri_count,false);
+	std::vector<GLuint> out, cache, next;
+	out.reserve(indices.size());
+	size_t best = NONE, scan = 0;
+	while(out.size() < indices.size()) {
+		if(best == NONE) { // nothing in the cache is left to draw
+			while(emitted[scan])
+				scan++;
+			best = scan;
+		}
+		emitted[best] = true;
+		next.clear();
+		for(int i=0; i<3; i++) {
+			const GLuint v = indices[best*3+i];
+			out.push_back(v);
+			if(std::find(next.begin(),next.end(),v) == next.end()) // degenerate triangles
+				next.push_back(v);
+			size_t* live = &tris[first[v]];
+			*std::find(live,live+valence[v],best) = live[valence[v]-1];
+			valence[v]--;
+		}
+		for(size_t i=0; i<cache.size(); i++)
+			if(std::find(next.begin(),next.end(),cache[i]) == next.end())
+				next.push_back(cache[i]);
+		// rescore all that were or are in the cache, and find the best triangle still to draw
+		for(size_t i=0; i<next.size(); i++) {
+			const GLuint v = next[i];
+			cache_pos[v] = (i < VERTEX_CACHE_SIZE)? i: -1;
+			const float score = _vertex_score(cache_pos[v],valence[v]);
+			for(size_t t=first[v]; t<first[v]+valence[v]; t++)
+				tri_score[tris[t]] += score-vertex_score[v];
+			vertex_score[v] = score;
+		}
+		if(next.size() > VERTEX_CACHE_SIZE)
+			next.resize(VERTEX_CACHE_SIZE);
+		cache.swap(next);
+		best = NONE;
+		for(size_t i=0; i<cache.size(); i++) {
+			const GLuint v = cache[i];
+			for(size_t t=first[v]; t<first[v]+valence[v]; t++)
+				if((best == NONE) || (tri_score[tris[t]] > tri_score[best]))
+					best = tris[t];
+		}
+	}
+	indices.swap(out);
+}
+
+struct vertex_fifo_t { // a post-transform vertex cache, as GPUs have
+	vertex_fifo_t(size_t size): slots(size,~(GLuint)0), head(0) {}
+	std::vector<GLuint> slots;
+	size_t head;
+	int miss(GLuint v) {
+		if(std::find(slots.begin(),slots.end(),v) != slots.end())
+			return 0;
+		slots[head] = v;
+		head = (head+1)%slots.size();
+		return 1;
+	}
+	int miss(const GLuint* tri) { return miss(tri[0])+miss(tri[1])+miss(tri[2]); }
+	void flush() { std::fill(slots.begin(),slots.end(),~(GLuint)0); }
+};
+
+struct overdraw_cluster_t { // triangles [first,first+count) of the cache order
+	size_t first, count;
+	float key;
+	bool operator<(const overdraw_cluster_t& o) const { return key > o.key; }
+};
+
+static void _optimise_overdraw(std::vector<GLuint>& indices,const uint8_t* positions) {
+	/* after Sander, Nehab and Barczak's "Fast triangle reordering for vertex locality and
+	reduced overdraw": the cache-ordered triangles are cut into clusters wherever the cache
+	starts afresh, and again wherever a cluster has done about as well for the cache as it
+	will, then the clusters facing out from the mesh's centre, which are the ones most likely
+	to hide the rest, are drawn first */
+	static const float THRESHOLD = 1.05f; // the most the ACMR may suffer
+	const size_t tri_count = indices.size()/3;
+	if(tri_count < 2)
+		return;
+	std::vector<vec_t> centres(tri_count), normals(tri_count);
+	std::vector<float> areas(tri_count);
+	vec_t centre(0,0,0);
+	float area = 0;
+	for(size_t t=0; t<tri_count; t++) {
+		vec_t v[3];
+		for(int i=0; i<3; i++) {
+			GLfloat xyz[3];
+			memcpy(xyz,positions+indices[t*3+i]*sizeof(xyz),sizeof(xyz));
+			v[i] = vec_t(xyz[0],xyz[1],xyz[2]);
+		}
+		centres[t] = (v[0]+v[1]+v[2])/3;
+		normals[t] = (v[1]-v[0]).cross(v[2]-v[0]); // its length is twice the area
+		areas[t] = normals[t].magnitude()/2;
+		centre += centres[t]*areas[t];
+		area += areas[t];
+	}
+	if(area > 0)
+		centre = centre/area;
+	std::vector<size_t> hard;
+	vertex_fifo_t fifo(16);
+	for(size_t t=0; t<tri_count; t++)
+		if((fifo.miss(&indices[t*3]) == 3) || !t)
+			hard.push_back(t);
+	hard.push_back(tri_count);
+	std::vector<overdraw_cluster_t> clusters;
+	for(size_t h=0; h+1<hard.size(); h++) {
+		const size_t first = hard[h], last = hard[h+1];
+		fifo.flush();
+		size_t misses = 0;
+		for(size_t t=first; t<last; t++)
+			misses += fifo.miss(&indices[t*3]);
+		const float threshold = THRESHOLD*misses/(last-first);
+		// cut as soon as the running ACMR is good enough; the cache starts cold after
+		fifo.flush();
+		misses = 0;
+		overdraw_cluster_t cluster = {first,0,0};
+		for(size_t t=first; t<last; t++) {
+			misses += fifo.miss(&indices[t*3]);
+			cluster.count++;
+			if(((float)misses/cluster.count <= threshold) && (t+1 < last)) {
+				clusters.push_back(cluster);
+				cluster.first = t+1;
+				cluster.count = 0;
+				misses = 0;
+				fifo.flush();
+			}
+		}
+		if(cluster.count)
+			clusters.push_back(cluster);
+	}
+	for(std::vector<overdraw_cluster_t>::iterator c=clusters.begin(); c!=clusters.end(); c++) {
+		vec_t mid(0,0,0), normal(0,0,0);
+		float a = 0;
+		for(size_t t=c->first; t<c->first+c->count; t++) {
+			mid += centres[t]*areas[t];
+			normal += normals[t];
+			a += areas[t];
+		}
+		if(a > 0)
+			mid = mid/a;
+		c->key = (mid-centre).dot(normal.magnitude_sqrd() > 0? vec_t::normalise(normal): normal);
+	}
+	std::stable_sort(clusters.begin(),clusters.end());
+	std::vector<GLuint> out;
+	out.reserve(indices.size());
+	for(std::vector<overdraw_cluster_t>::const_iterator c=clusters.begin(); c!=clusters.end(); c++)
+		out.insert(out.end(),indices.begin()+c->first*3,indices.begin()+(c->first+c->count)*3);
+	indices.swap(out);
+}
+
+struct pack_stats_t {
+	pack_stats_t(): triangles(0), misses_before(0), misses_after(0) {}
+	size_t triangles, misses_before, misses_after; // misses of a 16-entry FIFO
+};
+
+static size_t _vertex_cache_misses(const std::vector<GLuint>& indices,size_t cache_size) {
+	vertex_fifo_t fifo(cache_size);
+	size_t misses = 0;
+	for(size_t i=0; i<indices.size(); i++)
+		misses += fifo.miss(indices[i]);
+	return misses;
+}
 
 struct model_g3d_t::mesh_t {
 	mesh_t(model_g3d_t& g3d,std::string name,GLuint index_count);
 	~mesh_t();
-	void load_vn(istream_t& in,uint32_t frame_count,uint32_t vertex_count);
-	void load_t(istream_t& in,uint32_t frame_count,uint32_t vertex_count);
-	void load_i(istream_t& in,uint32_t index_count);
-	void draw(int frame);
+	// parsing the G3D and converting it, on whichever thread stages
+	void parse_vn(reader_t& in,uint32_t frame_count,uint32_t vertex_count);
+	void parse_t(reader_t& in,uint32_t frame_count);
+	void parse_i(reader_t& in);
+	void set_texture(int t,fs_file_t* file); // takes the file just for its path
+	void pack(cache_writer_t& out,pack_stats_t& stats) const;
+	// staging from the cache
+	void stage(reader_t& in);
+	void stage_textures(fs_t& fs);
+	// uploading, on the main thread
+	size_t steps() const { return TEXTURE_COUNT+frame_count+tex_frames+1; }
+	size_t upload(size_t step); // returns the bytes it uploaded
+	bool set_arrays(int frame,int blend); // blend is a slot of the model's blend_vbo; true if textured, with its coordinates enabled
+	void draw_elements() const { glDrawElements(GL_TRIANGLES,index_count,index_type,(GLvoid*)(g3d.elements.offset+i_offset)); }
+	void draw_instances(size_t count) const { glDrawElementsInstancedARB(GL_TRIANGLES,index_count,index_type,(GLvoid*)(g3d.elements.offset+i_offset),count); }
+	void draw(int frame,int blend=-1);
 	model_g3d_t& g3d;
 	const std::string name;
-	std::vector<GLuint> vertices, normals, tex_coords;
 	GLuint index_count;
-	GLuint indices;
+	GLenum index_type;
+	// where the frames of vertices, then of texture coordinates, are in the model's data and its indices in elements
+	GLintptr v_offset, t_offset, i_offset;
+	GLintptr b_offset; // and where its vertices are within a blend
+	size_t v_bytes() const { return (size_t)frame_count*vertex_count*sizeof(cache_vertex_t); }
+	size_t t_bytes() const { return (size_t)tex_frames*vertex_count*sizeof(tex_coord_t); }
+	size_t i_bytes() const { return (size_t)index_count*(index_type == GL_UNSIGNED_SHORT? sizeof(GLushort): sizeof(GLuint)); }
 	struct tex_coord_t {
 		tex_coord_t() {}
 		tex_coord_t(float x_,float y_): x(x_), y(y_) {}
@@ -36,106 +390,684 @@ struct model_g3d_t::mesh_t {
 		TEXTURE_COUNT
 	};
 	GLuint textures[TEXTURE_COUNT];
+	std::string texture_paths[TEXTURE_COUNT];
+	uint32_t frame_count, tex_frames, vertex_count;
+	// the G3D's float arrays, whilst converting; they point into its mapping
+	const uint8_t *source_vn, *source_t, *source_i;
+	// what stage() left for upload(); the arrays point into the cache
+	const uint8_t *staged_v, *staged_t, *staged_i;
+	const uint8_t* frames; // the vertices, kept in the cache after upload for blending if the model is animated
+	fs_file_t* texture_files[TEXTURE_COUNT];
+	SDL_Surface* surfaces[TEXTURE_COUNT];
 };
 
 model_g3d_t::mesh_t::mesh_t(model_g3d_t& g3d_,std::string n,GLuint i):
-	g3d(g3d_), name(n), index_count(i), indices(0) {
+	g3d(g3d_), name(n), index_count(i), index_type(GL_UNSIGNED_INT), v_offset(0), t_offset(0), i_offset(0), b_offset(0),
+	frame_count(0), tex_frames(0), vertex_count(0),
+	source_vn(NULL), source_t(NULL), source_i(NULL), staged_v(NULL), staged_t(NULL), staged_i(NULL), frames(NULL) {
 	memset(textures,0,sizeof(textures));
+	memset(texture_files,0,sizeof(texture_files));
+	memset(surfaces,0,sizeof(surfaces));
 }
 
 model_g3d_t::mesh_t::~mesh_t() {
-	//### free VBOs and release (shared) textures
-}
-
-void model_g3d_t::mesh_t::load_vn(istream_t& in,uint32_t frame_count,uint32_t vertex_count) {
-	fixed_array_t<vec_t> vec(vertex_count);
-	for(int pass=0; pass<2; pass++)
-		for(uint32_t f=0; f<frame_count; f++) {
-			vec.clear();
-			while(!vec.full())
-				vec.append(vec_t(in.float32(),in.float32(),in.float32()));
-			GLuint vbo = graphics()->alloc_vbo();
-			graphics()->load_vbo(vbo,
-				GL_ARRAY_BUFFER,
-				vertex_count*sizeof(vec_t),
-				vec.ptr(),
-				GL_STATIC_DRAW);
-			if(pass)
-				normals.push_back(vbo);
-			else {
-				for(uint32_t v=0; v<vertex_count; v++)
-					g3d.bounds.bounds_include(vec[v]);
-				vertices.push_back(vbo);
-			}
+	for(int t=0; t<TEXTURE_COUNT; t++)
+		if(textures[t])
+			graphics()->release_texture(textures[t]);
+	for(int t=0; t<TEXTURE_COUNT; t++) {
+		if(surfaces[t])
+			SDL_FreeSurface(surfaces[t]);
+		delete texture_files[t];
+	}
+}
+
+void model_g3d_t::mesh_t::parse_vn(reader_t& in,uint32_t frames,uint32_t vertices) {
+	// all the frames' vertices, then all their normals
+	const size_t bytes = sizeof(GLfloat)*3;
+	if(!frames)
+		data_error(in.stream << " has a mesh without frames");
+	frame_count = frames;
+	vertex_count = vertices;
+	source_vn = in.take((size_t)frame_count*2,vertex_count*bytes);
+	std::vector<aabb_t>& frame_bounds = g3d.staged_frame_bounds;
+	if(frame_bounds.size() < frame_count)
+		frame_bounds.resize(frame_count,aabb_t(vec_t(FLT_MAX,FLT_MAX,FLT_MAX),vec_t(-FLT_MAX,-FLT_MAX,-FLT_MAX)));
+	for(size_t v=0, count=(size_t)frame_count*vertex_count; v<count; v++) {
+		GLfloat xyz[3];
+		memcpy(xyz,source_vn+v*bytes,bytes);
+		const vec_t pt(xyz[0],xyz[1],xyz[2]);
+		g3d.staged_bounds.bounds_include(pt);
+		aabb_t& box = frame_bounds[v/vertex_count];
+		for(int i=0; i<3; i++) {
+			box.a[i] = std::min(box.a[i],pt[i]);
+			box.b[i] = std::max(box.b[i],pt[i]);
 		}
+	}
 }
 
-void model_g3d_t::mesh_t::load_t(istream_t& in,uint32_t frame_count,uint32_t vertex_count) {
-	fixed_array_t<mesh_t::tex_coord_t> tex(vertex_count);
-	for(uint32_t f=0; f<frame_count; f++) {
-		while(!tex.full())
-			tex.append(mesh_t::tex_coord_t(in.float32(),in.float32()));
-		GLuint vbo = graphics()->alloc_vbo();
-		graphics()->load_vbo(vbo,
-			GL_ARRAY_BUFFER,
-			vertex_count*sizeof(mesh_t::tex_coord_t),
-			tex.ptr(),
-			GL_STATIC_DRAW);
-		tex_coords.push_back(vbo);
+void model_g3d_t::mesh_t::parse_t(reader_t& in,uint32_t frames) {
+	tex_frames = frames;
+	source_t = in.take(tex_frames,vertex_count*sizeof(mesh_t::tex_coord_t));
+}
+
+void model_g3d_t::mesh_t::parse_i(reader_t& in) {
+	source_i = in.take(index_count,sizeof(GLuint));
+	for(uint32_t i=0; i<index_count; i++) {
+		GLuint index;
+		memcpy(&index,source_i+i*sizeof(GLuint),sizeof(GLuint));
+		if(index >= vertex_count)
+			data_error(in.stream << " index " << i << " is " << index << " but there are only " << vertex_count << " vertices");
+	}
+}
+
+void model_g3d_t::mesh_t::set_texture(int t,fs_file_t* file) {
+	texture_paths[t] = file->path();
+	delete file;
+}
+
+void model_g3d_t::mesh_t::pack(cache_writer_t& out,pack_stats_t& stats) const {
+	std::vector<GLuint> indices(index_count);
+	if(index_count)
+		memcpy(&indices[0],source_i,index_count*sizeof(GLuint));
+	stats.triangles += index_count/3;
+	stats.misses_before += _vertex_cache_misses(indices,16);
+	_optimise_vertex_cache(indices,vertex_count);
+	_optimise_overdraw(indices,source_vn); // by the first frame
+	stats.misses_after += _vertex_cache_misses(indices,16);
+	// the vertices are renumbered in the order the triangles first use them, dropping any unused
+	std::vector<GLuint> remap(vertex_count,~(GLuint)0), order;
+	for(size_t i=0; i<indices.size(); i++) {
+		GLuint& index = indices[i];
+		if(remap[index] == ~(GLuint)0) {
+			remap[index] = order.size();
+			order.push_back(index);
+		}
+		index = remap[index];
+	}
+	const uint32_t count = order.size();
+	const bool short_indices = (count < 0x10000);
+	out.str(name);
+	out.put<uint32_t>(index_count);
+	out.put<uint32_t>(frame_count);
+	out.put<uint32_t>(tex_frames);
+	out.put<uint32_t>(count);
+	out.put<uint32_t>(short_indices? sizeof(GLushort): sizeof(GLuint));
+	for(int t=0; t<TEXTURE_COUNT; t++)
+		out.str(texture_paths[t]);
+	const float scale = 1.0f/g3d.scale;
+	for(uint32_t f=0; f<frame_count; f++)
+		for(uint32_t v=0; v<count; v++) {
+			GLfloat pos[3], normal[3];
+			memcpy(pos,source_vn+((size_t)f*vertex_count+order[v])*sizeof(pos),sizeof(pos));
+			memcpy(normal,source_vn+((size_t)(frame_count+f)*vertex_count+order[v])*sizeof(normal),sizeof(normal));
+			const vec_t n = vec_t(normal[0],normal[1],normal[2]).normalise();
+			cache_vertex_t packed;
+			packed.pos[0] = _snorm16((pos[0]-g3d.origin.x)*scale);
+			packed.pos[1] = _snorm16((pos[1]-g3d.origin.y)*scale);
+			packed.pos[2] = _snorm16((pos[2]-g3d.origin.z)*scale);
+			packed.unused = 0;
+			packed.normal[0] = _snorm8(n.x);
+			packed.normal[1] = _snorm8(n.y);
+			packed.normal[2] = _snorm8(n.z);
+			packed.unused2 = 0;
+			out.put(packed);
+		}
+	for(uint32_t f=0; f<tex_frames; f++)
+		for(uint32_t v=0; v<count; v++)
+			out.put(source_t+((size_t)f*vertex_count+order[v])*sizeof(tex_coord_t),sizeof(tex_coord_t));
+	for(size_t i=0; i<indices.size(); i++)
+		if(short_indices)
+			out.put<GLushort>(indices[i]);
+		else
+			out.put<GLuint>(indices[i]);
+}
+
+void model_g3d_t::mesh_t::stage(reader_t& in) {
+	frame_count = in.uint32();
+	tex_frames = in.uint32();
+	vertex_count = in.uint32();
+	const uint32_t index_size = in.uint32();
+	if((index_size != sizeof(GLushort)) && (index_size != sizeof(GLuint)))
+		data_error(in.stream << " has indices of " << index_size << " bytes");
+	index_type = (index_size == sizeof(GLushort))? GL_UNSIGNED_SHORT: GL_UNSIGNED_INT;
+	if(!frame_count)
+		data_error(in.stream << " has a mesh without frames");
+	for(int t=0; t<TEXTURE_COUNT; t++)
+		texture_paths[t] = in.str();
+	staged_v = in.take(frame_count,vertex_count*sizeof(cache_vertex_t));
+	frames = staged_v;
+	staged_t = in.take(tex_frames,vertex_count*sizeof(tex_coord_t));
+	staged_i = in.take(index_count,index_size);
+	// out of range indices would read beyond the buffer on the GPU
+	for(uint32_t i=0; i<index_count; i++) {
+		GLuint index = 0;
+		memcpy(&index,staged_i+i*index_size,index_size); // little-endian
+		if(index >= vertex_count)
+			data_error(in.stream << " index " << i << " is " << index << " but there are only " << vertex_count << " vertices");
 	}
 }
 
-void model_g3d_t::mesh_t::load_i(istream_t& in,uint32_t index_count) {
-	fixed_array_t<face_t> faces(index_count/3);
-	while(!faces.full())
-		faces.append(face_t(in.uint32(),in.uint32(),in.uint32()));
-	indices = graphics()->alloc_vbo();
-	graphics()->load_vbo(indices,
+void model_g3d_t::mesh_t::stage_textures(fs_t& fs) {
+	for(int t=0; t<TEXTURE_COUNT; t++)
+		if(texture_paths[t].size()) {
+			texture_files[t] = fs.get(texture_paths[t]);
+			surfaces[t] = graphics()->load_surface(*texture_files[t]);
+		}
+}
+
+size_t model_g3d_t::mesh_t::upload(size_t step) {
+	if(step < TEXTURE_COUNT) {
+		SDL_Surface* surface = surfaces[step];
+		if(!surface)
+			return 0;
+		const size_t bytes = surface->w*surface->h*surface->format->BytesPerPixel;
+		surfaces[step] = NULL;
+		textures[step] = graphics()->alloc_texture(*texture_files[step],surface);
+		delete texture_files[step];
+		texture_files[step] = NULL;
+		return bytes;
+	}
+	step -= TEXTURE_COUNT;
+	// a frame at a time into the model's ranges, laid out as they were staged
+	if(step < frame_count) {
+		const size_t bytes = vertex_count*sizeof(cache_vertex_t);
+		graphics()->update_vbo_range(g3d.data,
+			GL_ARRAY_BUFFER,
+			v_offset+step*bytes,
+			bytes,
+			staged_v+step*bytes);
+		return bytes;
+	}
+	step -= frame_count;
+	if(step < tex_frames) {
+		const size_t bytes = vertex_count*sizeof(mesh_t::tex_coord_t);
+		graphics()->update_vbo_range(g3d.data,
+			GL_ARRAY_BUFFER,
+			t_offset+step*bytes,
+			bytes,
+			staged_t+step*bytes);
+		return bytes;
+	}
+	const size_t bytes = i_bytes();
+	graphics()->update_vbo_range(g3d.elements,
 		GL_ELEMENT_ARRAY_BUFFER,
-		index_count*sizeof(face_t),
-		faces.ptr(),
-		GL_STATIC_DRAW);
+		i_offset,
+		bytes,
+		staged_i);
+	staged_v = staged_t = staged_i = NULL;
+	return bytes;
 }
 
-void model_g3d_t::mesh_t::draw(int frame) {
-	glBindBuffer(GL_ARRAY_BUFFER,vertices[frame]);
-	glVertexPointer(3,GL_FLOAT,0,NULL);
-	glBindBuffer(GL_ARRAY_BUFFER,normals[frame]);
-	glNormalPointer(GL_FLOAT,0,NULL);
-	if(textures[DIFFUSE]) {
+bool model_g3d_t::mesh_t::set_arrays(int frame,int blend) {
+	// the model has bound its data and elements buffers
+	const GLintptr data = g3d.data.offset;
+	GLintptr vertices = data+v_offset+(frame%frame_count)*vertex_count*sizeof(cache_vertex_t);
+	if(blend >= 0) {
+		glBindBuffer(GL_ARRAY_BUFFER,g3d.blend_vbo);
+		vertices = blend*g3d.blend_bytes+b_offset;
+	}
+	glVertexPointer(3,GL_SHORT,sizeof(cache_vertex_t),(GLvoid*)(vertices+offsetof(cache_vertex_t,pos)));
+	glNormalPointer(GL_BYTE,sizeof(cache_vertex_t),(GLvoid*)(vertices+offsetof(cache_vertex_t,normal)));
+	if(blend >= 0)
+		glBindBuffer(GL_ARRAY_BUFFER,g3d.data.vbo);
+	const bool textured = (textures[DIFFUSE] && tex_frames);
+	if(textured) {
+		const GLintptr tex_frame = (frame<(int)tex_frames? frame: 0);
 		glEnableClientState(GL_TEXTURE_COORD_ARRAY);
-		glBindBuffer(GL_ARRAY_BUFFER,(frame<(int)tex_coords.size()? tex_coords[frame]: tex_coords[0]));
-		glTexCoordPointer(2,GL_FLOAT,0,NULL);
-		glBindTexture(GL_TEXTURE_2D,textures[DIFFUSE]);
+		glTexCoordPointer(2,GL_FLOAT,0,(GLvoid*)(data+t_offset+tex_frame*vertex_count*sizeof(tex_coord_t)));
 	}
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,indices);
-	glDrawElements(GL_TRIANGLES,index_count,GL_UNSIGNED_INT,NULL);
-	if(textures[DIFFUSE]) {
+	return textured;
+}
+
+void model_g3d_t::mesh_t::draw(int frame,int blend) {
+	const bool textured = set_arrays(frame,blend);
+	if(textured)
+		glBindTexture(GL_TEXTURE_2D,textures[DIFFUSE]);
+	draw_elements();
+	if(textured) {
 		glDisableClientState(GL_TEXTURE_COORD_ARRAY);
 		glBindTexture(GL_TEXTURE_2D,0);
 	}
 }
 
-model_g3d_t::model_g3d_t(istream_t& in) {
+struct model_g3d_t::collision_t {
+	/* a compact copy of every mesh's triangles for picking, as one mesh with its positions
+	snorm16 as packed for every frame.  The BVH's boxes hold each triangle in every frame, so
+	one tree serves every pose, and every instance once the ray is brought into the model */
+	collision_t(const model_g3d_t& g3d); // from the staged meshes
+	collision_t(const collision_t& full,unsigned cells); // simplified on a grid of cells across the model
+	enum { LEAF = 4 }; // triangles at most in a leaf
+	struct node_t {
+		node_t(): box(vec_t(0,0,0),vec_t(0,0,0)), first(0), count(0) {}
+		aabb_t box; // in packed units
+		uint32_t first, count; // a leaf's triangles are [first,first+count); else its children are first and first+1
+	};
+	uint32_t frame_count, vertex_count;
+	std::vector<GLshort> positions; // 3 per vertex per frame
+	std::vector<uint32_t> triangles; // 3 vertices each, in the order of the leaves
+	std::vector<node_t> nodes;
+	size_t bytes() const { return positions.size()*sizeof(GLshort)+triangles.size()*sizeof(uint32_t)+nodes.size()*sizeof(node_t); }
+	vec_t vertex(uint32_t v,int frame,int step) const;
+	bool intersection(const ray_t& r,int frame,int step,bool every_triangle,vec_t& I) const; // in packed units
+private:
+	void build(const std::vector<uint32_t>& tris);
+	void split(size_t node,uint32_t first,uint32_t count,std::vector<uint32_t>& order,const std::vector<aabb_t>& boxes);
+};
+
+struct _centroid_less_t { // orders triangles along an axis by the centres of their boxes
+	_centroid_less_t(const std::vector<aabb_t>& b,int a): boxes(b), axis(a) {}
+	const std::vector<aabb_t>& boxes;
+	const int axis;
+	bool operator()(uint32_t p,uint32_t q) const {
+		return boxes[p].a[axis]+boxes[p].b[axis] < boxes[q].a[axis]+boxes[q].b[axis];
+	}
+};
+
+model_g3d_t::collision_t::collision_t(const model_g3d_t& g3d):
+	frame_count(g3d.meshes[0]->frame_count), vertex_count(0)
+{
+	for(meshes_t::const_iterator m=g3d.meshes.begin(); m!=g3d.meshes.end(); m++)
+		vertex_count += (*m)->vertex_count;
+	positions.resize((size_t)frame_count*vertex_count*3);
+	std::vector<uint32_t> tris;
+	uint32_t base = 0;
+	for(meshes_t::const_iterator m=g3d.meshes.begin(); m!=g3d.meshes.end(); m++) {
+		const mesh_t& mesh = **m;
+		for(uint32_t f=0; f<frame_count; f++)
+			for(uint32_t v=0; v<mesh.vertex_count; v++) {
+				cache_vertex_t packed;
+				memcpy(&packed,mesh.staged_v+((size_t)f*mesh.vertex_count+v)*sizeof(packed),sizeof(packed));
+				memcpy(&positions[((size_t)f*vertex_count+base+v)*3],packed.pos,sizeof(packed.pos));
+			}
+		const size_t index_size = (mesh.index_type == GL_UNSIGNED_SHORT? sizeof(GLushort): sizeof(GLuint));
+		for(uint32_t i=0; i<mesh.index_count; i++) {
+			GLuint index = 0;
+			memcpy(&index,mesh.staged_i+i*index_size,index_size); // little-endian
+			tris.push_back(base+index);
+		}
+		base += mesh.vertex_count;
+	}
+	build(tris);
+}
+
+model_g3d_t::collision_t::collision_t(const collision_t& full,unsigned cells):
+	frame_count(full.frame_count), vertex_count(0)
+{
+	// vertices sharing a cell of the grid in the first frame are welded, and the triangles that collapse dropped
+	std::map<uint64_t,uint32_t> welded;
+	std::vector<uint32_t> remap(full.vertex_count), kept;
+	for(uint32_t v=0; v<full.vertex_count; v++) {
+		uint64_t key = 0;
+		for(int i=0; i<3; i++)
+			key = key*cells+((uint32_t)(full.positions[v*3+i]+32768)*cells>>16);
+		const std::map<uint64_t,uint32_t>::iterator cell = welded.find(key);
+		if(cell != welded.end())
+			remap[v] = cell->second;
+		else {
+			remap[v] = welded[key] = kept.size();
+			kept.push_back(v);
+		}
+	}
+	vertex_count = kept.size();
+	positions.resize((size_t)frame_count*vertex_count*3);
+	for(uint32_t f=0; f<frame_count; f++)
+		for(uint32_t v=0; v<vertex_count; v++)
+			memcpy(&positions[((size_t)f*vertex_count+v)*3],&full.positions[((size_t)f*full.vertex_count+kept[v])*3],sizeof(GLshort)*3);
+	std::vector<uint32_t> tris;
+	for(size_t t=0; t+3<=full.triangles.size(); t+=3) {
+		const uint32_t a = remap[full.triangles[t]], b = remap[full.triangles[t+1]], c = remap[full.triangles[t+2]];
+		if((a != b) && (b != c) && (a != c)) {
+			tris.push_back(a);
+			tris.push_back(b);
+			tris.push_back(c);
+		}
+	}
+	build(tris);
+}
+
+void model_g3d_t::collision_t::build(const std::vector<uint32_t>& tris) {
+	// each triangle's box in every frame, then the tree over them
+	std::vector<aabb_t> boxes(vertex_count,aabb_t(vec_t(FLT_MAX,FLT_MAX,FLT_MAX),vec_t(-FLT_MAX,-FLT_MAX,-FLT_MAX)));
+	for(uint32_t f=0; f<frame_count; f++)
+		for(uint32_t v=0; v<vertex_count; v++)
+			for(int i=0; i<3; i++) {
+				const float p = positions[((size_t)f*vertex_count+v)*3+i];
+				boxes[v].a[i] = std::min(boxes[v].a[i],p);
+				boxes[v].b[i] = std::max(boxes[v].b[i],p);
+			}
+	const uint32_t tri_count = tris.size()/3;
+	std::vector<aabb_t> tri_boxes;
+	tri_boxes.reserve(tri_count);
+	std::vector<uint32_t> order(tri_count);
+	for(uint32_t t=0; t<tri_count; t++) {
+		aabb_t box = boxes[tris[t*3]];
+		for(int j=1; j<3; j++)
+			for(int i=0; i<3; i++) {
+				box.a[i] = std::min(box.a[i],boxes[tris[t*3+j]].a[i]);
+				box.b[i] = std::max(box.b[i],boxes[tris[t*3+j]].b[i]);
+			}
+		tri_boxes.push_back(box);
+		order[t] = t;
+	}
+	nodes.clear();
+	triangles.clear();
+	if(!tri_count)
+		return;
+	nodes.reserve(tri_count/LEAF*2+1);
+	nodes.push_back(node_t());
+	split(0,0,tri_count,order,tri_boxes);
+	triangles.resize(tri_count*3);
+	for(uint32_t t=0; t<tri_count; t++)
+		memcpy(&triangles[t*3],&tris[order[t]*3],sizeof(uint32_t)*3);
+}
+
+void model_g3d_t::collision_t::split(size_t node,uint32_t first,uint32_t count,std::vector<uint32_t>& order,const std::vector<aabb_t>& boxes) {
+	// at the median of the triangles' centres along the longest axis they spread over
+	aabb_t box = boxes[order[first]];
+	vec_t lo(FLT_MAX,FLT_MAX,FLT_MAX), hi(-FLT_MAX,-FLT_MAX,-FLT_MAX);
+	for(uint32_t t=first; t<first+count; t++) {
+		const aabb_t& tri = boxes[order[t]];
+		for(int i=0; i<3; i++) {
+			box.a[i] = std::min(box.a[i],tri.a[i]);
+			box.b[i] = std::max(box.b[i],tri.b[i]);
+			lo[i] = std::min(lo[i],tri.a[i]+tri.b[i]);
+			hi[i] = std::max(hi[i],tri.a[i]+tri.b[i]);
+		}
+	}
+	nodes[node].box = box;
+	if(count <= LEAF) {
+		nodes[node].first = first;
+		nodes[node].count = count;
+		return;
+	}
+	const vec_t spread = hi-lo;
+	const int axis = (spread.x >= spread.y && spread.x >= spread.z)? 0: (spread.y >= spread.z)? 1: 2;
+	const uint32_t half = count/2;
+	std::nth_element(order.begin()+first,order.begin()+first+half,order.begin()+first+count,_centroid_less_t(boxes,axis));
+	const size_t child = nodes.size();
+	nodes.resize(child+2);
+	nodes[node].first = child;
+	nodes[node].count = 0;
+	split(child,first,half,order,boxes);
+	split(child+1,first+half,count-half,order,boxes);
+}
+
+vec_t model_g3d_t::collision_t::vertex(uint32_t v,int frame,int step) const {
+	const GLshort* p = &positions[((size_t)frame*vertex_count+v)*3];
+	if(!step)
+		return vec_t(p[0],p[1],p[2]);
+	const GLshort* q = &positions[((size_t)((frame+1)%frame_count)*vertex_count+v)*3];
+	const float t = (float)step/BLEND_STEPS;
+	return vec_t(p[0]+(q[0]-p[0])*t,p[1]+(q[1]-p[1])*t,p[2]+(q[2]-p[2])*t);
+}
+
+bool model_g3d_t::collision_t::intersection(const ray_t& r,int frame,int step,bool every_triangle,vec_t& I) const {
+	// the hit nearest the ray's origin, and on the segment
+	bool hit = false;
+	float nearest = 0;
+	uint32_t stack[64], depth = 0;
+	if(nodes.size())
+		stack[depth++] = 0;
+	while(depth) {
+		const node_t& node = nodes[stack[--depth]];
+		uint32_t first = node.first, count = node.count;
+		if(every_triangle) {
+			first = 0;
+			count = triangles.size()/3;
+			depth = 0;
+		} else if(!node.box.intersects(r))
+			continue;
+		else if(!count) {
+			stack[depth++] = node.first;
+			stack[depth++] = node.first+1;
+			continue;
+		}
+		for(uint32_t t=first; t<first+count; t++) {
+			const triangle_t tri(vertex(triangles[t*3],frame,step),vertex(triangles[t*3+1],frame,step),vertex(triangles[t*3+2],frame,step));
+			vec_t P;
+			if(!tri.intersection(r,P))
+				continue;
+			const float along = (P-r.o).dot(r.d);
+			if((along <= r.ddot) && (!hit || (along < nearest))) {
+				hit = true;
+				nearest = along;
+				I = P;
+			}
+		}
+	}
+	return hit;
+}
+
+model_g3d_t::model_g3d_t(istream_t& stream):
+	fs(&stream.fs()), path(stream.file().path()), size(0), memory(0), scale(1),
+	triangles(0), misses_before(0), misses_after(0), ready(false),
+	uploading(0), step(0), staging_time(0), upload_time(0), blend_vbo(0), blend_bytes(0), blend_clock(0), collision(NULL)
+{
+	const uint64_t start = high_precision_time();
+	if(!load_cache())
+		convert(stream);
+	for(meshes_t::iterator i=meshes.begin(); i!=meshes.end(); i++)
+		(*i)->stage_textures(*fs);
+	stage_collision();
+	staging_time = high_precision_time()-start;
+	size_t unlimited = ~(size_t)0;
+	while(!upload(unlimited))
+		unlimited = ~(size_t)0;
+	loaded();
+}
+
+model_g3d_t::model_g3d_t(fs_t& fs_,const std::string& path_,loader_t& loader):
+	bounds(vec_t(-0.5f,0,-0.5f),vec_t(0.5f,1,0.5f)), // until it is known
+	fs(&fs_), path(path_), size(0), memory(0), scale(1),
+	triangles(0), misses_before(0), misses_after(0), ready(false),
+	uploading(0), step(0), staging_time(0), upload_time(0), blend_vbo(0), blend_bytes(0), blend_clock(0), collision(NULL)
+{
+	loader.add(this);
+}
+
+model_g3d_t::~model_g3d_t() {
+	cancel();
+	for(meshes_t::iterator i=meshes.begin(); i!=meshes.end(); i++)
+		delete *i;
+	graphics()->free_vbo_range(data);
+	graphics()->free_vbo_range(elements);
+	if(blend_vbo)
+		graphics()->free_vbo(blend_vbo);
+	delete collision;
+}
+
+void model_g3d_t::stage() {
+	const uint64_t start = high_precision_time();
+	if(!load_cache()) {
+		fs_file_t::ptr_t source_file(fs->get(path));
+		istream_t::ptr_t source(source_file->reader());
+		convert(*source);
+	}
+	for(meshes_t::iterator i=meshes.begin(); i!=meshes.end(); i++)
+		(*i)->stage_textures(*fs);
+	stage_collision();
+	staging_time = high_precision_time()-start;
+}
+
+bool model_g3d_t::load_cache() {
+	// a cache that is missing, stale or unreadable is just made afresh
+	const std::string source = fs->canocial(path);
+	const uint64_t modified = fs->modified(source);
+	try {
+		file.reset(fs->get(fs->cache_path(source,".g3dc")));
+		stream = file->reader();
+	} catch(data_error_t* e) { // not made yet
+		delete e;
+		file.reset();
+		return false;
+	}
+	try {
+		reader_t in(*stream);
+		if(read_cache(in,source,modified))
+			return true;
+	} catch(data_error_t* e) {
+		std::cerr << "ignoring cache: " << e << std::endl;
+		delete e;
+	}
+	for(meshes_t::iterator i=meshes.begin(); i!=meshes.end(); i++)
+		delete *i;
+	meshes.clear();
+	stream.reset();
+	file.reset();
+	return false;
+}
+
+bool model_g3d_t::read_cache(reader_t& in,const std::string& source,uint64_t modified) {
+	if(in.uint32() != CACHE_MAGIC)
+		data_error(in.stream << " is not a G3D cache");
+	if((in.uint32() != CACHE_VERSION) || (in.str() != source) || (in.uint64() != modified))
+		return false;
+	const vec_t a = in.vec(), b = in.vec();
+	staged_bounds = bounds_t(a,b);
+	origin = in.vec();
+	scale = in.float32();
+	staged_frame_bounds.clear();
+	for(uint32_t f=in.uint32(); f--; ) {
+		const vec_t frame_a = in.vec(), frame_b = in.vec();
+		staged_frame_bounds.push_back(aabb_t(frame_a,frame_b));
+	}
+	triangles = in.uint32();
+	misses_before = in.uint32();
+	misses_after = in.uint32();
+	const uint32_t mesh_count = in.uint32();
+	if(!mesh_count)
+		data_error(in.stream << " has no meshes");
+	for(uint32_t m=0; m<mesh_count; m++) {
+		const std::string mesh_name = in.str();
+		mesh_t* mesh = new mesh_t(*this,mesh_name,in.uint32());
+		meshes.push_back(mesh);
+		mesh->stage(in);
+		if(mesh->frame_count != meshes[0]->frame_count)
+			data_error(in.stream << " has meshes this differing frame-counts");
+	}
+	if(staged_frame_bounds.size() != meshes[0]->frame_count)
+		data_error(in.stream << " has bounds for " << staged_frame_bounds.size() << " frames, not " << meshes[0]->frame_count);
+	name = source;
+	size = in.size;
+	return true;
+}
+
+void model_g3d_t::convert(istream_t& source) {
+	// parsed, packed and cached; then staged from the cache just like next time
+	const uint64_t modified = fs->modified(path);
+	parse(source);
+	if(meshes.empty())
+		data_error(source << " has no meshes");
+	const vec_t& a = staged_bounds.a, & b = staged_bounds.b;
+	origin = vec_t((a.x+b.x)/2,(a.y+b.y)/2,(a.z+b.z)/2);
+	scale = std::max(b.x-a.x,std::max(b.y-a.y,b.z-a.z))/2; // uniform, so the lighting is not skewed
+	if(scale <= 0)
+		scale = 1;
+	cache_writer_t out;
+	out.put(CACHE_MAGIC);
+	out.put(CACHE_VERSION);
+	out.str(source.file().path());
+	out.put<uint64_t>(modified);
+	out.vec(a);
+	out.vec(b);
+	out.vec(origin);
+	out.put(scale);
+	out.put<uint32_t>(staged_frame_bounds.size());
+	for(std::vector<aabb_t>::const_iterator f=staged_frame_bounds.begin(); f!=staged_frame_bounds.end(); f++) {
+		out.vec(f->a);
+		out.vec(f->b);
+	}
+	cache_writer_t packed_meshes;
+	pack_stats_t stats;
+	for(meshes_t::iterator i=meshes.begin(); i!=meshes.end(); i++) {
+		(*i)->pack(packed_meshes,stats);
+		delete *i;
+	}
+	out.put<uint32_t>(stats.triangles);
+	out.put<uint32_t>(stats.misses_before);
+	out.put<uint32_t>(stats.misses_after);
+	out.put<uint32_t>(meshes.size());
+	out.put(&packed_meshes.buf[0],packed_meshes.buf.size());
+	meshes.clear();
+	try {
+		fs->write(fs->cache_path(path,".g3dc"),&out.buf[0],out.buf.size());
+	} catch(data_error_t* e) {
+		std::cerr << "could not cache " << source << ": " << e << std::endl;
+		delete e;
+	}
+	std::cout << source << " converted from " << size << " to " << out.buf.size() << " bytes" << std::endl;
+	if(load_cache())
+		return;
+	// the data directory may not be writable
+	packed.swap(out.buf);
+	reader_t in(source,&packed[0],packed.size());
+	if(!read_cache(in,source.file().path(),modified))
+		panic("could not read back the cache made for " << source);
+}
+
+void model_g3d_t::parse(istream_t& stream) {
+	reader_t in(stream);
+	size = in.size;
 	const uint32_t ver = in.uint32();
 	// note the endian here is little endian
 	if(((ver&0xff)!='G')||(((ver>>8)&0xff)!='3')||(((ver>>16)&0xff)!='D'))
-		data_error(in << " (" <<std::hex << ver << ") is not a G3D model");
+		data_error(stream << " (" <<std::hex << ver << ") is not a G3D model");
 	switch(ver>>24) {
 	case 3: load_v3(in); break;
 	case 4: load_v4(in); break;
-	default: data_error(in << " is not a supported G3D model version (" << (ver&0xff) << ")");
+	default: data_error(stream << " is not a supported G3D model version (" << (ver>>24) << ")");
 	}
-	bounds.bounds_fix();
-	std::cout << in << " " << bounds << std::endl;
+	staged_bounds.bounds_fix();
 }
 
-model_g3d_t::~model_g3d_t() {
+bool model_g3d_t::upload(size_t& budget) {
+	// a step at a time, so that at least one goes up however small the budget
+	const uint64_t start = high_precision_time();
+	if(!uploading && !step) {
+		bounds = staged_bounds;
+		frame_bounds.swap(staged_frame_bounds);
+		// every frame of every mesh goes in one range, and all their indices in another
+		size_t data_bytes = 0, index_bytes = 0;
+		for(meshes_t::iterator i=meshes.begin(); i!=meshes.end(); i++) {
+			mesh_t& mesh = **i;
+			mesh.v_offset = data_bytes;
+			data_bytes += mesh.v_bytes();
+			mesh.t_offset = data_bytes;
+			data_bytes += mesh.t_bytes();
+			mesh.i_offset = index_bytes;
+			index_bytes += mesh.i_bytes();
+		}
+		data = graphics()->alloc_vbo_range(GL_ARRAY_BUFFER,data_bytes);
+		elements = graphics()->alloc_vbo_range(GL_ELEMENT_ARRAY_BUFFER,index_bytes);
+	}
+	for(; uploading<meshes.size(); uploading++, step=0)
+		for(; step<meshes[uploading]->steps(); step++) {
+			if(!budget) {
+				upload_time += high_precision_time()-start;
+				return false;
+			}
+			const size_t bytes = meshes[uploading]->upload(step);
+			budget -= (bytes < budget? bytes: budget);
+			if(step >= mesh_t::TEXTURE_COUNT) // textures are shared, so not ours to count
+				memory += bytes;
+		}
+	upload_time += high_precision_time()-start;
+	ready = true;
+	bool animated = false;
 	for(meshes_t::iterator i=meshes.begin(); i!=meshes.end(); i++)
-		delete *i;
+		animated |= ((*i)->frame_count > 1);
+	if(!animated) { // else the frames stay mapped for blending
+		for(meshes_t::iterator i=meshes.begin(); i!=meshes.end(); i++)
+			(*i)->frames = NULL;
+		stream.reset();
+		file.reset();
+		std::vector<uint8_t>().swap(packed);
+	}
+	std::cout << name << " " << bounds << ", " << size << " bytes staged in " << staging_time << " ns, uploaded in " << upload_time << " ns" << std::endl;
+	return true;
 }
 
-void model_g3d_t::load_v3(istream_t& in) {
+void model_g3d_t::load_v3(reader_t& in) {
 	const uint32_t mesh_count = in.uint32();
 	for(unsigned m=0; m<mesh_count; m++) {
 		const uint32_t frame_count = in.uint32();
@@ -145,81 +1077,613 @@ void model_g3d_t::load_v3(istream_t& in) {
 		const uint32_t vertex_count = in.uint32();
 		const uint32_t index_count = in.uint32();
 		const uint32_t properties = in.uint32();
-		const std::string texture = in.file().rel(in.fixed_str<64>());
+		const std::string texture = in.stream.file().rel(in.fixed_str<64>());
 		if(normal_count != frame_count) 
-			data_error(in << " has "<<normal_count<<" normals but "<<frame_count<<" frames");
-		if(index_count%3) data_error(in << " bad number of indices: " << index_count);
-		if(meshes.size() && (frame_count != meshes[0]->vertices.size()))
-			data_error(in << " has meshes this differing frame-counts");
+			data_error(in.stream << " has "<<normal_count<<" normals but "<<frame_count<<" frames");
+		if(index_count%3) data_error(in.stream << " bad number of indices: " << index_count);
+		if(meshes.size() && (frame_count != meshes[0]->frame_count))
+			data_error(in.stream << " has meshes this differing frame-counts");
 		mesh_t* mesh = new mesh_t(*this,"",index_count);
 		meshes.push_back(mesh);
 		const bool has_textures = (0==(properties&1)); 
 		if(has_textures) {
-			fs_file_t::ptr_t file(in.fs().get(texture));
-			mesh->textures[mesh_t::DIFFUSE] = graphics()->alloc_texture(*file);
+			mesh->set_texture(mesh_t::DIFFUSE,in.fs().get(texture));
 			if(texture.size()>4) {
 				std::string norm(texture,0,texture.size()-4);
 				norm += "_normal";
 				norm += texture.c_str()+texture.size()-4;
 				try {
-					if(in.fs().is_file(norm)) {
-						fs_file_t::ptr_t nfile(in.fs().get(in,norm));
-						mesh->textures[mesh_t::NORMAL] = graphics()->alloc_texture(*nfile);
-					}
+					if(in.fs().is_file(norm))
+						mesh->set_texture(mesh_t::NORMAL,in.fs().get(in.stream,norm));
 				} catch(data_error_t* de) {
 					delete de;
 				}
 			}
 		}
-		mesh->load_vn(in,frame_count,vertex_count);
+		mesh->parse_vn(in,frame_count,vertex_count);
 		if(has_textures) {
 			if(texCoord_count != frame_count)
-				std::cerr << in << " has "<<texCoord_count<<" text coords but "<<frame_count<<" frames" << std::endl;
-			mesh->load_t(in,texCoord_count,vertex_count);
+				std::cerr << in.stream << " has "<<texCoord_count<<" text coords but "<<frame_count<<" frames" << std::endl;
+			mesh->parse_t(in,texCoord_count);
 		}
-		in.skip(16);
-		in.skip(16*(color_count-1));
-		mesh->load_i(in,index_count);  
+		in.skip(16*(color_count? color_count: 1)); // the diffuse colour, and any more frames of it
+		mesh->parse_i(in);
 	}
 }
 
-void model_g3d_t::load_v4(istream_t& in) {
+void model_g3d_t::load_v4(reader_t& in) {
 	const uint16_t mesh_count = in.uint16();
-	if(!mesh_count) data_error(in << " has no meshes");
-	if(in.byte()) data_error(in << " is not a G3D mtMorphMesh");
+	if(!mesh_count) data_error(in.stream << " has no meshes");
+	if(in.byte()) data_error(in.stream << " is not a G3D mtMorphMesh");
 	for(int16_t i=0; i<mesh_count; i++) {
 		const std::string name = in.fixed_str<64>();
 		const uint32_t frame_count = in.uint32(),
 			vertex_count = in.uint32(),
 			index_count = in.uint32();
-		if(index_count%3) data_error(in << " bad number of indices: " << index_count);
-		if(meshes.size() && (frame_count != meshes[0]->vertices.size()))
-			data_error(in << " has meshes this differing frame-counts");
+		if(index_count%3) data_error(in.stream << " bad number of indices: " << index_count);
+		if(meshes.size() && (frame_count != meshes[0]->frame_count))
+			data_error(in.stream << " has meshes this differing frame-counts");
 		mesh_t* mesh = new mesh_t(*this,name,index_count);
 		meshes.push_back(mesh);
 		in.skip(8*4);
 		const uint32_t properties __attribute__((unused)) = in.uint32(),
 			textures = in.uint32();
 		for(int t=0; t<mesh_t::TEXTURE_COUNT; t++)
-			if((1<<t)&textures) {
-				fs_file_t::ptr_t file(in.fs().get(in,in.fixed_str<64>()));
-				mesh->textures[t] = graphics()->alloc_texture(*file);
-			}
-		mesh->load_vn(in,frame_count,vertex_count);
+			if((1<<t)&textures)
+				mesh->set_texture(t,in.fs().get(in.stream,in.fixed_str<64>()));
+		mesh->parse_vn(in,frame_count,vertex_count);
 		if(textures)
-			mesh->load_t(in,frame_count,vertex_count);
-		mesh->load_i(in,index_count);
+			mesh->parse_t(in,frame_count);
+		mesh->parse_i(in);
+	}
+}
+
+strings_t model_g3d_t::unit_models(fs_t& fs,techtree_t& techtree) {
+	strings_t paths;
+	const strings_t& factions = techtree.get_factions();
+	for(strings_t::const_iterator f=factions.begin(); f!=factions.end(); f++) {
+		const std::string units = techtree.get_faction(*f).path+"/units";
+		const strings_t unit_dirs = fs.list_dirs(units);
+		for(strings_t::const_iterator u=unit_dirs.begin(); u!=unit_dirs.end(); u++) {
+			const std::string unit = units+"/"+*u;
+			const strings_t dirs = fs.list_dirs(unit);
+			if(std::find(dirs.begin(),dirs.end(),"models") == dirs.end())
+				continue;
+			const strings_t files = fs.list_files(unit+"/models");
+			for(strings_t::const_iterator i=files.begin(); i!=files.end(); i++)
+				if((i->size() >= 4) && (i->find(".g3d") == i->size()-4))
+					paths.push_back(unit+"/models/"+*i);
+		}
+	}
+	return paths;
+}
+
+void model_g3d_t::benchmark(fs_t& fs,techtree_t& techtree) {
+	// every unit model, loaded one after another as before, then all at once through a loader
+	const strings_t paths = unit_models(fs,techtree);
+	size_t bytes = 0, triangles = 0, misses_before = 0, misses_after = 0;
+	uint64_t blocking = 0, longest = 0;
+	for(strings_t::const_iterator p=paths.begin(); p!=paths.end(); p++) {
+		fs_file_t::ptr_t file(fs.get(*p));
+		istream_t::ptr_t stream(file->reader());
+		const uint64_t start = high_precision_time();
+		{
+			model_g3d_t model(*stream);
+			bytes += model.size;
+			triangles += model.triangles;
+			misses_before += model.misses_before;
+			misses_after += model.misses_after;
+			std::cout << "g3d: " << *p << " " << model.triangles << " triangles, ACMR " << model.acmr(model.misses_before) <<
+				" reordered to " << model.acmr(model.misses_after) << std::endl;
+		}
+		const uint64_t ns = high_precision_time()-start;
+		blocking += ns;
+		longest = std::max(longest,ns);
+	}
+	uint64_t start = high_precision_time(), longest_frame = 0;
+	size_t frames = 0, buffers = 0, arenas = 0;
+	{
+		loader_t loader;
+		std::vector<model_g3d_t*> models;
+		for(strings_t::const_iterator p=paths.begin(); p!=paths.end(); p++)
+			models.push_back(new model_g3d_t(fs,*p,loader));
+		while(loader.pending()) {
+			const uint64_t frame = high_precision_time();
+			loader.upload(loader_t::FRAME_BUDGET);
+			longest_frame = std::max(longest_frame,high_precision_time()-frame);
+			frames++;
+			SDL_Delay(1);
+		}
+		for(size_t i=0; i<models.size(); i++)
+			for(meshes_t::const_iterator m=models[i]->meshes.begin(); m!=models[i]->meshes.end(); m++)
+				buffers += (*m)->frame_count*2+(*m)->tex_frames+1; // what a VBO per frame per attribute used to take
+		arenas = graphics()->vbo_arenas();
+		model_g3d_t* animated = NULL; // the most vertices to blend
+		size_t most = 0;
+		for(size_t i=0; i<models.size(); i++) {
+			size_t vertices = 0;
+			for(meshes_t::const_iterator m=models[i]->meshes.begin(); m!=models[i]->meshes.end(); m++)
+				vertices += (*m)->frames? (*m)->vertex_count: 0;
+			if(vertices > most) {
+				animated = models[i];
+				most = vertices;
+			}
+		}
+		if(animated)
+			animated->benchmark_blending(1000);
+		model_batches_t::benchmark(models,2000);
+		benchmark_bounds(models,1000);
+		benchmark_picking(models,1000);
+		for(size_t i=0; i<models.size(); i++)
+			delete models[i];
+	}
+	const uint64_t background = high_precision_time()-start;
+	std::cout << "g3d: " << paths.size() << " models of " << bytes << " bytes and " << triangles << " triangles in " << techtree <<
+		", ACMR " << acmr(triangles,misses_before) << " reordered to " << acmr(triangles,misses_after) << "; blocking " << blocking <<
+		" ns, " << (paths.size()? blocking/paths.size(): 0) << " ns each and " << longest << " ns at worst; in the background " <<
+		background << " ns over " << frames << " frames, the longest upload " << longest_frame << " ns; " << arenas <<
+		" shared VBOs rather than " << buffers << std::endl;
+}
+
+void model_g3d_t::benchmark_blending(size_t units) {
+	// every unit at a phase of its own so each is blended, then in a few phases they share
+	enum { PHASES = 10 };
+	const unsigned frame_count = meshes[0]->frame_count;
+	size_t vertices = 0;
+	for(meshes_t::const_iterator m=meshes.begin(); m!=meshes.end(); m++)
+		vertices += (*m)->vertex_count;
+	blends.assign(blends.size(),blend_t());
+	uint64_t start = high_precision_time();
+	for(size_t u=0; u<units; u++)
+		blend((u/(BLEND_STEPS-1))%frame_count,1+u%(BLEND_STEPS-1));
+	const uint64_t apart = high_precision_time()-start;
+	blends.assign(blends.size(),blend_t());
+	start = high_precision_time();
+	for(size_t u=0; u<units; u++)
+		blend((u%PHASES)%frame_count,1+(u%PHASES)*(BLEND_STEPS-1)/PHASES);
+	const uint64_t phased = high_precision_time()-start;
+	blends.assign(blends.size(),blend_t());
+#ifdef __SSE2__
+	const char* const how = "SSE2";
+#else
+	const char* const how = "scalar";
+#endif
+	std::cout << "g3d: blending " << units << " units of " << path << ", " << vertices << " vertices over " << frame_count <<
+		" frames (" << how << "): " << apart << " ns, " << (units? apart/units: 0) << " ns each, at phases of their own; " <<
+		phased << " ns in " << PHASES << " phases" << std::endl;
+}
+
+void model_g3d_t::benchmark_bounds(const std::vector<model_g3d_t*>& models,size_t units) {
+	/* units of each animated model scattered about the origin at random poses, culled against the
+	world's frustum once by the bounds of all the model's frames and then by those of their pose */
+	enum { SIZE = 5 }; // tenths of the space the units are scattered over
+	const bool frustum = world()->has_frustum();
+	size_t animated = 0, placed = 0, by_model = 0, by_pose = 0;
+	double volume = 0;
+	for(std::vector<model_g3d_t*>::const_iterator m=models.begin(); m!=models.end(); m++) {
+		const model_g3d_t& model = **m;
+		const vec_t all = model.bounds.b-model.bounds.a;
+		if(!model.ready || (model.frame_bounds.size() < 2) || !(all.x*all.y*all.z > 0))
+			continue;
+		animated++;
+		const float size = SIZE*0.1f/std::max(all.x,std::max(all.y,all.z));
+		double pose_volume = 0;
+		for(size_t u=0; u<units; u++) {
+			const bounds_t pose = model.get_bounds(randf()*model.frame_bounds.size());
+			pose_volume += (double)(pose.b.x-pose.a.x)*(pose.b.y-pose.a.y)*(pose.b.z-pose.a.z);
+			if(!frustum)
+				continue;
+			// placed as object_t::set_bounds places them, offset from their position as from the model's origin
+			const vec_t pos(randf()*4-2,randf()*4-2,randf()*4-2);
+			by_model += (world()->is_visible(bounds_t(pos+model.bounds.a*size,pos+model.bounds.b*size)) != MISS);
+			by_pose += (world()->is_visible(bounds_t(pos+pose.a*size,pos+pose.b*size)) != MISS);
+			placed++;
+		}
+		volume += pose_volume/units/((double)all.x*all.y*all.z);
+	}
+	std::cout << "g3d: bounds of a pose of " << animated << " animated models are on average " << (animated? volume/animated: 0) <<
+		" of the volume of all their frames'";
+	if(frustum)
+		std::cout << "; of " << placed << " units, " << by_model << " visible by every frame's bounds and " << by_pose <<
+			" by their pose's, " << (by_model-by_pose) << " false positives culled";
+	std::cout << std::endl;
+}
+
+void model_g3d_t::benchmark_picking(const std::vector<model_g3d_t*>& models,size_t rays) {
+	/* rays from around each model through its bounds, tested against its tree, then against every
+	triangle, which must agree, then against the mesh simplified */
+	enum { CELLS = 32 };
+	size_t picked = 0, tris = 0, bytes = 0, simplified_tris = 0, simplified_bytes = 0, hits = 0, disagree = 0, simplified_hits = 0;
+	uint64_t by_tree = 0, by_triangle = 0, by_simplified = 0, simplifying = 0;
+	for(std::vector<model_g3d_t*>::const_iterator m=models.begin(); m!=models.end(); m++) {
+		const model_g3d_t& model = **m;
+		if(!model.ready)
+			continue;
+		const collision_t& collision = *model.collision;
+		uint64_t start = high_precision_time();
+		const collision_t simplified(collision,CELLS);
+		simplifying += high_precision_time()-start;
+		picked++;
+		tris += collision.triangles.size()/3;
+		bytes += collision.bytes();
+		simplified_tris += simplified.triangles.size()/3;
+		simplified_bytes += simplified.bytes();
+		const float radius = cache_vertex_t::POS_SCALE*2;
+		for(size_t i=0; i<rays; i++) {
+			const vec_t from = vec_t::normalise(vec_t(randf()-0.5f,randf()-0.5f,randf()-0.5f))*radius,
+				to = vec_t(randf()-0.5f,randf()-0.5f,randf()-0.5f)*cache_vertex_t::POS_SCALE;
+			const ray_t ray(from,(to-from)*2);
+			const int frame = rand()%collision.frame_count;
+			vec_t tree, every, coarse;
+			start = high_precision_time();
+			const bool hit = collision.intersection(ray,frame,0,false,tree);
+			by_tree += high_precision_time()-start;
+			start = high_precision_time();
+			const bool all = collision.intersection(ray,frame,0,true,every);
+			by_triangle += high_precision_time()-start;
+			start = high_precision_time();
+			simplified_hits += simplified.intersection(ray,frame,0,false,coarse);
+			by_simplified += high_precision_time()-start;
+			hits += hit;
+			disagree += (hit != all) || (hit && (fabsf(tree.distance(ray.o)-every.distance(ray.o)) > 1)); // in packed units
+		}
+	}
+	const size_t cast = picked*rays;
+	std::cout << "g3d: picking " << picked << " models of " << tris << " triangles in " << bytes << " bytes; " << cast << " rays, " <<
+		hits << " hits, " << (cast? by_tree/cast: 0) << " ns each by tree and " << (cast? by_triangle/cast: 0) <<
+		" ns by every triangle, " << disagree << " disagreeing; simplified to " << CELLS << " cells in " << simplifying << " ns, " <<
+		simplified_tris << " triangles in " << simplified_bytes << " bytes, " << simplified_hits << " hits, " <<
+		(cast? by_simplified/cast: 0) << " ns each" << std::endl;
+}
+
+static void draw_placeholder(const aabb_t& box) {
+	static const int edges[12][2] = {{0,1},{1,2},{2,3},{3,0},{4,5},{5,6},{6,7},{7,4},{0,4},{1,5},{2,6},{3,7}};
+	glDisable(GL_LIGHTING);
+	glColor3f(0.6f,0.6f,0.6f);
+	glBegin(GL_LINES);
+	for(int e=0; e<12; e++)
+		for(int i=0; i<2; i++) {
+			const vec_t c = box.corner(edges[e][i]);
+			glVertex3f(c.x,c.y,c.z);
+		}
+	glEnd();
+	glColor3f(1,1,1);
+	glEnable(GL_LIGHTING);
+}
+
+bool model_g3d_t::interpolate = false;
+
+int model_g3d_t::blend(unsigned frame,unsigned step) {
+	const unsigned key = frame*BLEND_STEPS+step;
+	blend_clock++;
+	size_t slot = 0;
+	for(size_t i=0; i<blends.size(); i++) {
+		if(blends[i].key == key) {
+			blends[i].used = blend_clock;
+			return i;
+		}
+		if(blends[i].used < blends[slot].used)
+			slot = i;
+	}
+	if(!blend_vbo) { // the first time this model is blended
+		for(meshes_t::iterator i=meshes.begin(); i!=meshes.end(); i++) {
+			(*i)->b_offset = blend_bytes;
+			blend_bytes += (*i)->vertex_count*sizeof(cache_vertex_t);
+		}
+		blend_vbo = graphics()->alloc_vbo();
+		graphics()->load_vbo(blend_vbo,GL_ARRAY_BUFFER,blend_bytes*BLEND_SLOTS,NULL,GL_DYNAMIC_DRAW);
+		memory += blend_bytes*BLEND_SLOTS;
+		blends.resize(BLEND_SLOTS);
+		blended.resize(blend_bytes);
+	}
+	// the least recently used slot is blended afresh
+	for(meshes_t::iterator i=meshes.begin(); i!=meshes.end(); i++) {
+		const mesh_t& mesh = **i;
+		const size_t bytes = mesh.vertex_count*sizeof(cache_vertex_t);
+		const unsigned a = frame%mesh.frame_count, b = (a+1)%mesh.frame_count;
+		_lerp_vertices((cache_vertex_t*)&blended[mesh.b_offset],(const cache_vertex_t*)(mesh.frames+a*bytes),
+			(const cache_vertex_t*)(mesh.frames+b*bytes),mesh.vertex_count,step*(LERP_ONE/BLEND_STEPS));
 	}
+	if(blend_bytes)
+		graphics()->update_vbo(blend_vbo,GL_ARRAY_BUFFER,slot*blend_bytes,blend_bytes,&blended[0]);
+	blends[slot].key = key;
+	blends[slot].used = blend_clock;
+	return slot;
+}
+
+float model_g3d_t::clock_frame() const {
+	const unsigned period = (ready && meshes.size()? meshes[0]->frame_count: 1)*100;
+	return (float)(now()%period)/100.0f;
 }
 
 void model_g3d_t::draw(float dist_from_camera) {
-	const int frame = (now()/100)%meshes[0]->vertices.size();
+	draw(dist_from_camera,clock_frame());
+}
+
+void model_g3d_t::pose(float at,int& frame,int& step) const {
+	// the phase is quantised so that units at much the same phase share a blend
+	const int frame_count = meshes[0]->frame_count;
+	const float whole = floorf(at);
+	frame = (int)whole;
+	step = 0;
+	if(interpolate && meshes[0]->frames) {
+		step = lrintf((at-whole)*BLEND_STEPS);
+		if(step == BLEND_STEPS) {
+			frame++;
+			step = 0;
+		}
+	}
+	frame = ((frame%frame_count)+frame_count)%frame_count;
+}
+
+bounds_t model_g3d_t::get_bounds(float at) const {
+	if(!ready)
+		return bounds;
+	int frame, step;
+	pose(at,frame,step);
+	// and as much again as the packing may have rounded the positions out by
+	const float slack = 2*scale/cache_vertex_t::POS_SCALE;
+	const vec_t pad(slack,slack,slack);
+	const aabb_t& a = frame_bounds[frame];
+	if(!step)
+		return bounds_t(a.a-pad,a.b+pad);
+	// a blend's vertices are between its frames' so within the blend of their boxes
+	const aabb_t& b = frame_bounds[(frame+1)%frame_bounds.size()];
+	const float t = (float)step/BLEND_STEPS;
+	return bounds_t(a.a+(b.a-a.a)*t-pad,a.b+(b.b-a.b)*t+pad);
+}
+
+unsigned model_g3d_t::collision_cells = 0;
+bool model_g3d_t::brute_force_picking = false;
+
+void model_g3d_t::stage_collision() {
+	collision = new collision_t(*this);
+	if(collision_cells) {
+		collision_t* simplified = new collision_t(*collision,collision_cells);
+		delete collision;
+		collision = simplified;
+	}
+}
+
+bool model_g3d_t::intersection(const ray_t& r,float at,vec_t& I) const {
+	if(!ready) {
+		if(!bounds.intersects(r))
+			return false;
+		I = bounds.centre;
+		return true;
+	}
+	int frame, step;
+	pose(at,frame,step);
+	const float to_packed = cache_vertex_t::POS_SCALE/scale;
+	const vec_t o = (r.o-origin)*to_packed;
+	if(!collision->intersection(ray_t(o,r.d*to_packed),frame,step,brute_force_picking,I))
+		return false;
+	I = origin+I*(scale/cache_vertex_t::POS_SCALE);
+	return true;
+}
+
+bool model_g3d_t::intersection(const ray_t& r,const matrix_t& transform,float at,vec_t& I) const {
+	// the ray is brought into the model, rather than every triangle out to the ray
+	const matrix_t inverse = transform.inverse().transpose(); // inverse() hands back rows, not GL columns
+	const vec_t o = r.o*inverse;
+	if(!intersection(ray_t(o,(r.o+r.d)*inverse-o),at,I))
+		return false;
+	I *= transform;
+	return true;
+}
+
+void model_g3d_t::draw(float dist_from_camera,float at) {
+	if(!ready) {
+		draw_placeholder(bounds);
+		return;
+	}
+	int frame, step;
+	pose(at,frame,step);
+	const int slot = step? blend(frame,step): -1;
+	// positions are snorm16 of the model's scale
+	const float s = scale/cache_vertex_t::POS_SCALE;
+	glMatrixMode(GL_MODELVIEW);
+	glPushMatrix();
+	glTranslatef(origin.x,origin.y,origin.z);
+	glScalef(s,s,s);
+	glBindBuffer(GL_ARRAY_BUFFER,data.vbo);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,elements.vbo);
 	glEnableClientState(GL_VERTEX_ARRAY);
 	glEnableClientState(GL_NORMAL_ARRAY);
 	for(meshes_t::iterator i=meshes.begin(); i!=meshes.end(); i++)
-		(*i)->draw(frame);
+		(*i)->draw(frame,slot);
 	glDisableClientState(GL_VERTEX_ARRAY);
 	glDisableClientState(GL_NORMAL_ARRAY);
+	glBindBuffer(GL_ARRAY_BUFFER,0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,0);
+	glPopMatrix();
+}
+
+bool model_batches_t::batching = true;
+bool model_batches_t::instancing = true;
+
+bool model_batches_t::instance_t::operator<(const instance_t& other) const {
+	if(texture != other.texture) return texture < other.texture;
+	if(model != other.model) return model < other.model;
+	if(frame != other.frame) return frame < other.frame;
+	return step < other.step;
+}
+
+void model_batches_t::add(model_g3d_t& model,const GLfloat* transform) {
+	add(model,transform,model.clock_frame());
+}
+
+void model_batches_t::add(model_g3d_t& model,const GLfloat* transform,float frame) {
+	instance_t instance;
+	instance.model = &model;
+	instance.at = frame;
+	instance.frame = instance.step = 0;
+	instance.texture = 0;
+	instance.transform = transforms.size();
+	instances.push_back(instance);
+	transforms.insert(transforms.end(),transform,transform+16);
 }
 
+void model_batches_t::clear() {
+	instances.clear();
+	transforms.clear();
+}
+
+static void _modelview(const GLfloat* view,const GLfloat* transform,const vec_t& origin,float scale,GLfloat* out) {
+	// view*transform*translate(origin)*scale(scale), all column-major
+	GLfloat m[16];
+	for(int c=0; c<4; c++)
+		for(int r=0; r<4; r++)
+			m[c*4+r] = view[r]*transform[c*4]+view[4+r]*transform[c*4+1]+view[8+r]*transform[c*4+2]+view[12+r]*transform[c*4+3];
+	for(int r=0; r<4; r++) {
+		out[r] = m[r]*scale;
+		out[4+r] = m[4+r]*scale;
+		out[8+r] = m[8+r]*scale;
+		out[12+r] = m[r]*origin.x+m[4+r]*origin.y+m[8+r]*origin.z+m[12+r];
+	}
+}
+
+void model_batches_t::draw() {
+	typedef model_g3d_t::meshes_t meshes_t;
+	stats = stats_t();
+	glMatrixMode(GL_MODELVIEW);
+	if(!batching) {
+		for(std::vector<instance_t>::const_iterator i=instances.begin(); i!=instances.end(); i++) {
+			glPushMatrix();
+			glMultMatrixf(&transforms[i->transform]);
+			i->model->draw(0,i->at);
+			glPopMatrix();
+			if(i->model->ready)
+				for(meshes_t::const_iterator m=i->model->meshes.begin(); m!=i->model->meshes.end(); m++) {
+					stats.draw_calls++;
+					stats.setups++;
+					stats.texture_binds += ((*m)->textures[model_g3d_t::mesh_t::DIFFUSE] && (*m)->tex_frames)? 2: 0;
+				}
+		}
+		stats.groups = instances.size();
+		clear();
+		return;
+	}
+	for(std::vector<instance_t>::iterator i=instances.begin(); i!=instances.end(); i++)
+		if(i->model->ready) {
+			i->model->pose(i->at,i->frame,i->step);
+			const model_g3d_t::mesh_t& mesh = *i->model->meshes[0];
+			i->texture = (mesh.tex_frames? mesh.textures[model_g3d_t::mesh_t::DIFFUSE]: 0);
+		}
+	std::sort(instances.begin(),instances.end());
+	static const GLfloat identity[16] = {1,0,0,0, 0,1,0,0, 0,0,1,0, 0,0,0,1};
+	const bool instanced = instancing && graphics()->can_instance();
+	GLfloat view[16];
+	glGetFloatv(GL_MODELVIEW_MATRIX,view);
+	glPushMatrix();
+	GLuint bound = 0;
+	for(std::vector<instance_t>::const_iterator g=instances.begin(), e; g!=instances.end(); g=e) {
+		model_g3d_t& model = *g->model;
+		for(e=g+1; (e!=instances.end()) && !(*g<*e); e++); // the same texture, model and pose
+		stats.groups++;
+		if(!model.ready) {
+			for(std::vector<instance_t>::const_iterator i=g; i!=e; i++) {
+				glLoadMatrixf(view);
+				glMultMatrixf(&transforms[i->transform]);
+				draw_placeholder(model.bounds);
+			}
+			continue;
+		}
+		const int slot = g->step? model.blend(g->frame,g->step): -1;
+		const size_t count = e-g;
+		matrices.resize(count*16);
+		// the shader puts the modelview before the instances' own matrices; the fixed function needs it in them
+		const float scale = model.scale/cache_vertex_t::POS_SCALE;
+		for(size_t i=0; i<count; i++)
+			_modelview(instanced? identity: view,&transforms[g[i].transform],model.origin,scale,&matrices[i*16]);
+		if(instanced) {
+			glLoadMatrixf(view);
+			graphics()->begin_instances(&matrices[0],count);
+		}
+		glBindBuffer(GL_ARRAY_BUFFER,model.data.vbo);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,model.elements.vbo);
+		glEnableClientState(GL_VERTEX_ARRAY);
+		glEnableClientState(GL_NORMAL_ARRAY);
+		for(meshes_t::const_iterator m=model.meshes.begin(); m!=model.meshes.end(); m++) {
+			model_g3d_t::mesh_t& mesh = **m;
+			const bool textured = mesh.set_arrays(g->frame,slot);
+			const GLuint texture = textured? mesh.textures[model_g3d_t::mesh_t::DIFFUSE]: 0;
+			if(texture != bound) {
+				glBindTexture(GL_TEXTURE_2D,texture);
+				bound = texture;
+				stats.texture_binds++;
+			}
+			if(instanced) {
+				mesh.draw_instances(count);
+				stats.draw_calls++;
+			} else {
+				for(size_t i=0; i<count; i++) {
+					glLoadMatrixf(&matrices[i*16]);
+					mesh.draw_elements();
+				}
+				stats.draw_calls += count;
+			}
+			if(textured)
+				glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+			stats.setups++;
+		}
+		glDisableClientState(GL_VERTEX_ARRAY);
+		glDisableClientState(GL_NORMAL_ARRAY);
+		glBindBuffer(GL_ARRAY_BUFFER,0);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,0);
+		if(instanced)
+			graphics()->end_instances();
+	}
+	if(bound)
+		glBindTexture(GL_TEXTURE_2D,0);
+	glPopMatrix();
+	clear();
+}
 
+void model_batches_t::benchmark(const std::vector<model_g3d_t*>& models,size_t units) {
+	// units of up to ten types scattered about the origin, drawn batched and then each alone
+	enum { TYPES = 10 };
+	std::vector<model_g3d_t*> types;
+	for(size_t i=0; (i<models.size()) && (types.size()<TYPES); i++)
+		if(models[i]->is_done())
+			types.push_back(models[i]);
+	if(types.empty())
+		return;
+	std::vector<GLfloat> placed(units*16,0);
+	for(size_t u=0; u<units; u++) {
+		GLfloat* t = &placed[u*16];
+		const float yaw = randf()*2*M_PI, size = 0.05f;
+		t[0] = cosf(yaw)*size; t[2] = -sinf(yaw)*size;
+		t[5] = size;
+		t[8] = sinf(yaw)*size; t[10] = cosf(yaw)*size;
+		t[12] = randf()*2-1; t[13] = randf()*2-1; t[14] = randf()*2-1;
+		t[15] = 1;
+	}
+	model_batches_t batches;
+	const bool old_batching = batching, old_instancing = instancing;
+	// instanced if the GL can, batched a glLoadMatrixf apart, then each alone
+	enum { PASSES = 3 };
+	uint64_t ns[PASSES];
+	stats_t stats[PASSES];
+	for(int pass=0; pass<PASSES; pass++) {
+		batching = (pass < 2);
+		instancing = !pass;
+		for(size_t u=0; u<units; u++)
+			batches.add(*types[u%types.size()],&placed[u*16],(float)u/units*10);
+		glFinish();
+		const uint64_t start = high_precision_time();
+		batches.draw();
+		glFinish();
+		ns[pass] = high_precision_time()-start;
+		stats[pass] = batches.get_stats();
+	}
+	batching = old_batching;
+	instancing = old_instancing;
+	glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
+	std::cout << "batches: " << units << " units of " << types.size() << " models in " << stats[0].groups << " groups; " <<
+		(graphics()->can_instance()? "instanced": "(cannot instance)") << " " << stats[0].setups << " array setups, " <<
+		stats[0].texture_binds << " texture binds and " << stats[0].draw_calls << " draws in " << ns[0] << " ns; batched " <<
+		stats[1].setups << " array setups, " << stats[1].texture_binds << " texture binds and " << stats[1].draw_calls <<
+		" draws in " << ns[1] << " ns; alone " << stats[2].setups << " array setups, " << stats[2].texture_binds <<
+		" texture binds and " << stats[2].draw_calls << " draws in " << ns[2] << " ns" << std::endl;
+}
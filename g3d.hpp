@@ -13,20 +13,117 @@
 #include "3d.hpp"
 #include "fs.hpp"
 #include "utils.hpp"
+#include "loader.hpp"
 
-class model_g3d_t {
+class techtree_t;
+
+class model_g3d_t: public load_job_t {
+	friend class model_batches_t;
 public:
-	model_g3d_t(istream_t& in);
+	model_g3d_t(istream_t& in); // loads from the cache, converting the stream if need be, and uploads it now
+	model_g3d_t(fs_t& fs,const std::string& path,loader_t& loader); // a box is drawn until the loader is done
 	virtual ~model_g3d_t();
-	const bounds_t& get_bounds() const { return bounds; }
-	void draw(float dist_from_camera);
+	const bounds_t& get_bounds() const { return bounds; } // of every frame; a box until loaded
+	bounds_t get_bounds(float frame) const; // of that pose, as it would be drawn
+	const std::string& get_path() const { return path; }
+	size_t get_memory() const { return memory; } // bytes of VBOs uploaded; the shared textures are not counted
+	void draw(float dist_from_camera); // animates at ten frames a second
+	float clock_frame() const; // the frame that draw(dist_from_camera) shows now
+	void draw(float dist_from_camera,float frame); // frame may be fractional, and is blended if interpolating
+	static bool interpolate; // blend between frames rather than snap to the nearest earlier one
+	// picking against the triangles, falling back to the bounds until loaded; I is the hit nearest r.o
+	bool intersection(const ray_t& r,float frame,vec_t& I) const; // r and I in the model's own space
+	bool intersection(const ray_t& r,const matrix_t& transform,float frame,vec_t& I) const; // transform places the model, column-major as glMultMatrixf
+	static unsigned collision_cells; // vertices are welded on a grid of this many cells across the model for picking; 0 keeps every triangle
+	static bool brute_force_picking; // every triangle is tested, not just those in the boxes the ray crosses; to check the tree against
+	static strings_t unit_models(fs_t& fs,techtree_t& techtree); // the paths of every unit's models
+	static void benchmark(fs_t& fs,techtree_t& techtree); // loads every unit model, printing timings to stdout
+protected:
+	void stage();
+	bool upload(size_t& budget);
 private:
 	struct mesh_t;
+	struct reader_t;
+	struct collision_t;
 	typedef std::vector<mesh_t*> meshes_t;
 	meshes_t meshes;
-	bounds_t bounds;
-	void load_v3(istream_t& in);
-	void load_v4(istream_t& in);
+	bounds_t bounds, staged_bounds;
+	std::vector<aabb_t> frame_bounds, staged_frame_bounds;
+	fs_t* const fs;
+	const std::string path;
+	fs_file_t::ptr_t file;
+	istream_t::ptr_t stream; // the cache, mapped until uploaded
+	std::vector<uint8_t> packed; // the cache, if it could not be written
+	std::string name;
+	size_t size, memory;
+	vec_t origin; // positions are packed relative to this,
+	float scale; // and as a fraction of this
+	size_t triangles, misses_before, misses_after; // of a 16-entry FIFO vertex cache, as in the G3D and as reordered
+	static float acmr(size_t triangles,size_t misses) { return triangles? (float)misses/triangles: 0; }
+	float acmr(size_t misses) const { return acmr(triangles,misses); }
+	bool ready;
+	size_t uploading, step; // the mesh and its step to upload next
+	uint64_t staging_time, upload_time;
+	graphics_t::vbo_range_t data, elements; // suballocated from buffers other models share
+	// frames blended on the CPU when interpolating, kept so units at the same phase share them
+	enum { BLEND_STEPS = 64, BLEND_SLOTS = 16 }; // phases a frame is quantised to, and blends kept
+	struct blend_t {
+		blend_t(): key(~0U), used(0) {}
+		unsigned key; // frame*BLEND_STEPS+step
+		unsigned used;
+	};
+	std::vector<blend_t> blends; // each a slot of blend_bytes in blend_vbo
+	GLuint blend_vbo;
+	size_t blend_bytes;
+	unsigned blend_clock;
+	std::vector<uint8_t> blended; // a slot's worth, on its way to the GPU
+	collision_t* collision; // for picking; made when staged
+	void pose(float at,int& frame,int& step) const; // the frame, and the phase after it in BLEND_STEPS if interpolating
+	int blend(unsigned frame,unsigned step); // returns the slot
+	void benchmark_blending(size_t units);
+	static void benchmark_bounds(const std::vector<model_g3d_t*>& models,size_t units);
+	static void benchmark_picking(const std::vector<model_g3d_t*>& models,size_t rays);
+	bool load_cache();
+	void stage_collision();
+	bool read_cache(reader_t& in,const std::string& source,uint64_t modified);
+	void convert(istream_t& source);
+	void parse(istream_t& in);
+	void load_v3(reader_t& in);
+	void load_v4(reader_t& in);
+};
+
+/* the models to draw this frame, queued as they are found visible and then drawn grouped by
+texture, model and pose, so that each mesh's arrays are set and its texture bound once for its
+whole group.  Where the GL can instance, each mesh of a group is then one draw, its instances'
+transforms streamed alongside; else each instance is drawn a glLoadMatrixf apart */
+class model_batches_t {
+public:
+	// transforms are column-major as glMultMatrixf, onto the modelview current at draw()
+	void add(model_g3d_t& model,const GLfloat* transform); // animated by the clock, as model_g3d_t::draw
+	void add(model_g3d_t& model,const GLfloat* transform,float frame);
+	void draw(); // then empties the queue
+	void clear();
+	size_t size() const { return instances.size(); }
+	static bool batching; // else each is drawn on its own as model_g3d_t::draw does
+	static bool instancing; // when batching, if the GL can
+	struct stats_t {
+		stats_t(): groups(0), draw_calls(0), setups(0), texture_binds(0) {}
+		size_t groups, draw_calls, setups, texture_binds; // setups are of a mesh's arrays
+	};
+	const stats_t& get_stats() const { return stats; } // of the last draw()
+	static void benchmark(const std::vector<model_g3d_t*>& models,size_t units); // prints timings to stdout
+private:
+	struct instance_t {
+		model_g3d_t* model;
+		float at;
+		int frame, step;
+		GLuint texture; // of its first mesh
+		size_t transform;
+		bool operator<(const instance_t& other) const;
+	};
+	std::vector<instance_t> instances;
+	std::vector<GLfloat> transforms, matrices;
+	stats_t stats;
 };
 
 #endif //__G3D_HPP__
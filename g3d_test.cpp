@@ -0,0 +1,210 @@
+/*
+ g3d_test.cpp is part of the GlestNG RTS game engine.
+ Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE version 3
+ See LICENSE for details
+ (c) William Edwards, 2011; all rights reserved
+*/
+
+#include "graphics.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <unistd.h>
+#include <utime.h>
+#include <iostream>
+
+#include "error.hpp"
+#include "fs.hpp"
+#include "g3d.hpp"
+
+static const char* const MODEL = "logo.g3d"; // copied from data/ into a directory of its own, so its cache can be spoilt
+
+static model_g3d_t* load(fs_t& fs) {
+	fs_file_t::ptr_t file(fs.get(MODEL));
+	istream_t::ptr_t stream(file->reader());
+	return new model_g3d_t(*stream);
+}
+
+static std::string slurp(const std::string& path) {
+	std::string body;
+	if(FILE* f = fopen(path.c_str(),"rb")) {
+		char buf[4096];
+		while(const size_t n = fread(buf,1,sizeof(buf),f))
+			body.append(buf,n);
+		fclose(f);
+	}
+	return body;
+}
+
+static bool same(const vec_t& a,const vec_t& b) {
+	return (a.x == b.x) && (a.y == b.y) && (a.z == b.z);
+}
+
+static bool same(const aabb_t& a,const aabb_t& b) {
+	return same(a.a,b.a) && same(a.b,b.b);
+}
+
+static size_t compare(const model_g3d_t& a,const model_g3d_t& b) {
+	// rays across the model along each axis must hit both alike; returns how many hit
+	enum { GRID = 24, FRAMES = 4 };
+	assert(same(a.get_bounds(),b.get_bounds()));
+	assert(a.get_memory() == b.get_memory());
+	const aabb_t& box = a.get_bounds();
+	const vec_t size = box.b-box.a;
+	size_t hits = 0;
+	for(int frame=0; frame<FRAMES; frame++) {
+		assert(same(a.get_bounds(frame),b.get_bounds(frame)));
+		for(int axis=0; axis<3; axis++)
+			for(int u=0; u<GRID; u++)
+				for(int v=0; v<GRID; v++) {
+					vec_t o = box.a, d(0,0,0);
+					o[(axis+1)%3] += size[(axis+1)%3]*(u+0.5f)/GRID;
+					o[(axis+2)%3] += size[(axis+2)%3]*(v+0.5f)/GRID;
+					o[axis] -= size[axis];
+					d[axis] = size[axis]*3;
+					const ray_t ray(o,d);
+					vec_t I, J;
+					const bool hit = a.intersection(ray,frame,I);
+					assert(hit == b.intersection(ray,frame,J));
+					if(hit) {
+						assert(same(I,J));
+						hits++;
+					}
+				}
+	}
+	return hits;
+}
+
+static void round_trip(fs_t& fs) {
+	const std::string cache = fs.cache_path(MODEL,".g3dc");
+	// converted from the G3D, and cached
+	assert(slurp(cache).empty());
+	std::auto_ptr<model_g3d_t> converted(load(fs));
+	const std::string written = slurp(cache);
+	assert(written.size());
+	// loaded from the cache just as it was converted
+	std::auto_ptr<model_g3d_t> cached(load(fs));
+	const size_t hits = compare(*converted,*cached);
+	assert(hits);
+	assert(slurp(cache) == written);
+	// a spoilt cache is ignored and made afresh
+	fs.write(cache,"not a cache",11);
+	std::auto_ptr<model_g3d_t> spoilt(load(fs));
+	assert(compare(*converted,*spoilt) == hits);
+	assert(slurp(cache) == written);
+	// as is one older than its G3D
+	const std::string source = fs.canocial(MODEL);
+	struct utimbuf touched;
+	touched.actime = touched.modtime = fs.modified(source)+60;
+	assert(!utime(source.c_str(),&touched));
+	std::auto_ptr<model_g3d_t> stale(load(fs));
+	assert(compare(*converted,*stale) == hits);
+	const std::string rewritten = slurp(cache);
+	assert(rewritten.size() == written.size());
+	assert(rewritten != written);
+	std::cout << "cache of " << MODEL << ": " << written.size() << " bytes, " << hits << " rays hit alike" << std::endl;
+}
+
+static bool near(const vec_t& a,const vec_t& b,float tolerance) {
+	return a.distance(b) <= tolerance;
+}
+
+static matrix_t place(const vec_t& pos,float size,float turn) {
+	// turned about y, scaled and moved; column-major as glMultMatrixf
+	const float c = cosf(turn)*size, s = sinf(turn)*size;
+	const matrix_t m = {{
+		c,0,-s,0,
+		0,size,0,0,
+		s,0,c,0,
+		pos.x,pos.y,pos.z,1}};
+	return m;
+}
+
+static void picking(fs_t& fs) {
+	/* rays from all around the model through its bounds must hit what testing every
+	triangle hits, in every pose, and when placed by a transform too */
+	enum { RAYS = 2000 };
+	std::auto_ptr<model_g3d_t> model(load(fs));
+	const bounds_t& bounds = model->get_bounds();
+	const float tolerance = bounds.radius*1e-4f;
+	size_t hits = 0, placed_hits = 0;
+	for(int i=0; i<RAYS; i++) {
+		model_g3d_t::interpolate = (i&1);
+		const float at = randf()*4;
+		const vec_t from = bounds.centre+vec_t::normalise(vec_t(randf()-0.5f,randf()-0.5f,randf()-0.5f))*bounds.radius*2,
+			to = bounds.a+vec_t(randf()*(bounds.b.x-bounds.a.x),randf()*(bounds.b.y-bounds.a.y),randf()*(bounds.b.z-bounds.a.z));
+		const ray_t ray(from,(to-from)*2);
+		vec_t tree, every;
+		model_g3d_t::brute_force_picking = false;
+		const bool hit = model->intersection(ray,at,tree);
+		model_g3d_t::brute_force_picking = true;
+		assert(hit == model->intersection(ray,at,every));
+		if(hit) {
+			assert(near(tree,every,tolerance));
+			const bounds_t pose = model->get_bounds(at);
+			assert(pose.aabb_t::contains(tree));
+			hits++;
+		}
+		// the same, with the model and the ray both moved
+		const float size = 0.5f+randf()*2;
+		const matrix_t transform = place(vec_t(randf()*100,randf()*10,randf()*100),size,randf()*6.3f);
+		const vec_t o = ray.o*transform;
+		const ray_t placed(o,(ray.o+ray.d)*transform-o);
+		model_g3d_t::brute_force_picking = false;
+		const bool placed_hit = model->intersection(placed,transform,at,tree);
+		model_g3d_t::brute_force_picking = true;
+		assert(placed_hit == model->intersection(placed,transform,at,every));
+		if(placed_hit) {
+			assert(near(tree,every,tolerance*size));
+			assert(near(tree,bounds.centre*transform,bounds.radius*size*1.01f));
+			placed_hits++;
+		}
+	}
+	model_g3d_t::brute_force_picking = false;
+	model_g3d_t::interpolate = false;
+	assert(hits && (hits < RAYS) && placed_hits);
+	std::cout << "picking " << RAYS << " rays: " << hits << " hits, and " << placed_hits << " placed" << std::endl;
+}
+
+int main(int argc,char** args) {
+	if(SDL_Init(SDL_INIT_VIDEO)) {
+		fprintf(stderr,"Unable to initialize SDL: %s\n",SDL_GetError());
+		return EXIT_FAILURE;
+	}
+	atexit(SDL_Quit);
+	if(!SDL_SetVideoMode(64,64,32,SDL_OPENGL)) {
+		fprintf(stderr,"Unable to create SDL screen: %s\n",SDL_GetError());
+		return EXIT_FAILURE;
+	}
+	if(GLEW_OK != glewInit()) {
+		fprintf(stderr,"Unable to initialize GLEW\n");
+		return EXIT_FAILURE;
+	}
+	char dir[] = "/tmp/g3d_test.XXXXXX";
+	if(!mkdtemp(dir)) {
+		perror("Unable to make a data directory");
+		return EXIT_FAILURE;
+	}
+	const std::string data_directory = std::string(dir)+"/";
+	std::auto_ptr<graphics_t::mgr_t> graphics_mgr(graphics_t::create());
+	int ret = EXIT_SUCCESS;
+	try {
+		std::auto_ptr<fs_t> fs(fs_t::create(data_directory));
+		const std::string body = slurp(std::string("data/")+MODEL);
+		assert(body.size());
+		fs->write(MODEL,body.data(),body.size());
+		round_trip(*fs);
+		picking(*fs);
+		remove(fs->cache_path(MODEL,".g3dc").c_str());
+		remove(fs->canocial(MODEL).c_str());
+	} catch(glest_exception_t* e) {
+		std::cerr << e << std::endl;
+		ret = EXIT_FAILURE;
+	}
+	rmdir((data_directory+"cache").c_str());
+	rmdir(dir);
+	if(ret == EXIT_SUCCESS)
+		std::cout << "G3D: ok" << std::endl;
+	return ret;
+}
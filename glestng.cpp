@@ -11,6 +11,7 @@
 #include <stdio.h>
 #include <inttypes.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <iostream>
 #include <sys/time.h>
@@ -29,6 +30,8 @@
 #include "techtree.hpp"
 #include "faction.hpp"
 #include "mod_ui.hpp"
+#include "loader.hpp"
+#include "models.hpp"
 
 SDL_Surface* screen;
 
@@ -42,7 +45,10 @@ int visible_objects = 0;
 
 std::auto_ptr<techtree_t> techtree;
 std::auto_ptr<unit_type_t> unit_type;
-std::auto_ptr<model_g3d_t> model, logo;
+std::auto_ptr<models_t> model_cache;
+models_t::handle_t model;
+std::auto_ptr<model_g3d_t> logo;
+model_batches_t unit_batches; // the units found visible this frame
 
 static void _draw_quad(const vec_t& a,const vec_t& b,const vec_t& c,const vec_t& d) {
 	glVertex3f(a.x,a.y,a.z);
@@ -77,17 +83,28 @@ static void draw_cube(const aabb_t& box) {
 	glEnd();
 }
 
-static void caret(const vec_t& pos,float scale,float rx,float ry,float rz,bool mark=false) {
+static matrix_t caret_transform(const vec_t& pos,float scale,float rx,float ry,float rz) {
+	// as glTranslatef, glScalef and glRotatef by 360/r degrees about x, y then z, column-major
+	const float
+		ax = rx? 2*M_PI/rx: 0, cx = cosf(ax), sx = sinf(ax),
+		ay = ry? 2*M_PI/ry: 0, cy = cosf(ay), sy = sinf(ay),
+		az = rz? 2*M_PI/rz: 0, cz = cosf(az), sz = sinf(az);
+	const matrix_t m = {{
+		scale*cy*cz, scale*(cx*sz+sx*sy*cz), scale*(sx*sz-cx*sy*cz), 0,
+		-scale*cy*sz, scale*(cx*cz-sx*sy*sz), scale*(sx*cz+cx*sy*sz), 0,
+		scale*sy, -scale*sx*cy, scale*cx*cy, 0,
+		pos.x, pos.y, pos.z, 1
+	}};
+	return m;
+}
+
+static void caret(const matrix_t& transform,float at,bool mark=false) {
 	glPushMatrix();		
-	glTranslatef(pos.x,pos.y,pos.z);
-	glScalef(scale,scale,scale);
-	if(rx) glRotatef(360.0/rx,1,0,0);
-	if(ry) glRotatef(360.0/ry,0,1,0);
-	if(rz) glRotatef(360.0/rz,0,0,1);
+	glMultMatrixf(transform.f);
 	bounds_t box(vec_t(-1,-1,-1),vec_t(1,1,1));
-	if(!mark && model.get()) {
-		model->draw(0);
-		box = model->get_bounds();
+	if(!mark && model.is_set()) {
+		model->draw(0,at);
+		box = model->get_bounds(at);
 	}
 	if(!mark)
 		glColor4ub(0xff,0xff,0xff,0x15);
@@ -104,7 +121,7 @@ struct test_t: public object_t {
 		r(128+(rand()%128)), g(128+(rand()%128)), b(128+(rand()%128)),
 		rx(randf()), ry(randf()), rz(randf()),
 		dir(randf(),randf(),randf()),
-		drawn(false)
+		drawn(false), at(0)
 	{
 		bounds_include(vec_t(0,0,0));
 		bounds_include(vec_t(SZ*2,SZ*2,SZ*2));
@@ -112,7 +129,7 @@ struct test_t: public object_t {
 		bounds_include(bounding_box().a);
 		bounds_include(bounding_box().b);
 		bounds_fix();
-		set_pos(vec_t(randf()-MARGIN,randf()-MARGIN,randf()-MARGIN));
+		place(vec_t(randf()-MARGIN,randf()-MARGIN,randf()-MARGIN));
 		world()->add(this);
 		dir.normalise();
 		dir *= SPEED;
@@ -123,21 +140,47 @@ struct test_t: public object_t {
 		p.x += dir.x; if((p.x<legal.a.x)||(p.x>legal.b.x)) { dir.x = -dir.x; p.x += dir.x; }
 		p.y += dir.y; if((p.y<legal.a.y)||(p.y>legal.b.y)) { dir.y = -dir.y; p.y += dir.y; }
 		p.z += dir.z; if((p.z<legal.a.z)||(p.z>legal.b.z)) { dir.z = -dir.z; p.z += dir.z; }
-		set_pos(p);
+		place(p);
 		return true;
 	}
+	void place(const vec_t& p) {
+		// culled by the box of the pose it is drawn in, turned as the model is
+		transform = caret_transform(p,SZ,rx,ry,rz);
+		if(model.is_set()) {
+			at = model->clock_frame();
+			const bounds_t box = model->get_bounds(at);
+			if((box.a.x != pose.a.x) || (box.a.y != pose.a.y) || (box.a.z != pose.a.z) ||
+				(box.b.x != pose.b.x) || (box.b.y != pose.b.y) || (box.b.z != pose.b.z)) {
+				pose = box;
+				bounds_t turned;
+				for(int i=0; i<8; i++)
+					turned.bounds_include(box.corner(i)*transform-p);
+				set_bounds(turned);
+			}
+		}
+		set_pos(p);
+	}
 	void draw(float) {
 		drawn = true;
+		if(model.is_set())
+			unit_batches.add(*model,transform.f,at);
 	}
-	bool refine_intersection(const ray_t&, vec_t& I) { 
-		I = centre;
-		return true;
+	bool refine_intersection(const ray_t& ray, vec_t& I) { 
+		if(!model.is_set()) {
+			I = centre;
+			return true;
+		}
+		// in the pose and place it was last drawn in
+		return model->intersection(ray,transform,at,I);
 	}
 	int age;
 	const uint8_t r,g,b;
 	const float rx, ry, rz;
 	vec_t dir;
 	bool drawn;
+	matrix_t transform; // as drawn
+	float at; // the frame it is posed in
+	bounds_t pose; // of the model in that frame
 };
 const float test_t::SZ = 0.05, test_t::MARGIN = test_t::SZ*2, test_t::SPEED = 0.01;
 bounds_t test_t::legal(vec_t(-1.0+MARGIN,-1.0+MARGIN,-1.0+MARGIN),
@@ -150,7 +193,7 @@ void ui() {
 	if(selection) {
 		glDisable(GL_DEPTH_TEST);
 		glColor3f(1,0,0);
-		caret(selected_point,0.03,0,0,0,true);
+		caret(caret_transform(selected_point,0.03,0,0,0),0,true);
 		glEnable(GL_DEPTH_TEST);
 	}
 	// draw logo
@@ -196,7 +239,7 @@ void spatial_test() {
 				glColor3ub(0,0,0xff);
 		}
 		obj->drawn = false;
-		caret(obj->get_pos(),obj->SZ,obj->rx,obj->ry,obj->rz);
+		caret(obj->transform,obj->at);
 		if(!obj->tick()) {
 			objs.erase(objs.begin()+i);
 			delete obj;
@@ -247,6 +290,8 @@ void tick() {
 		for(tests_t::iterator i=objs.begin(); i!=objs.end(); i++)
 			(*i)->draw(0);
 	}
+	glColor3f(1,1,1);
+	unit_batches.draw();
 	//spatial_test();
 	ui();
 	SDL_GL_SwapBuffers();
@@ -368,9 +413,7 @@ void load(fs_t& fs) {
 		}
 	if(!g3d.size()) data_error("no G3D models in "<<unit<<"/models");
 	std::cout << "loading "<<g3d<<std::endl;
-	fs_file_t::ptr_t g3d_file(fs.get(g3d));
-	istream_t::ptr_t gstream(g3d_file->reader());
-	model = std::auto_ptr<model_g3d_t>(new model_g3d_t(*gstream));
+	model = model_cache->get(g3d);
 	// and load it
 	std::cout << "loading "<<xml_name<<std::endl;
 	fs_file_t::ptr_t xml_file(fs.get(xml_name));
@@ -384,6 +427,13 @@ int main(int argc,char** args) {
 	
 	srand(time(NULL));
 	
+	bool benchmark = false; // run the benchmarks and exit, rather than play
+	for(int i=1; i<argc; i++)
+		if(!strcmp(args[i],"--benchmark"))
+			benchmark = true;
+		else
+			std::cerr << "ignoring argument " << args[i] << std::endl;
+	
 	try {
 		
 		if (SDL_Init(SDL_INIT_VIDEO)) {
@@ -417,10 +467,15 @@ int main(int argc,char** args) {
 		std::auto_ptr<xml_parser_t> xml_settings(new xml_parser_t("UI Settings",fs_settings->get_body("ui_settings.xml")));
 		xml_settings->set_as_settings();
 		std::auto_ptr<graphics_t::mgr_t> graphics_mgr(graphics_t::create());
+		std::auto_ptr<loader_t> loader(new loader_t());
 		std::auto_ptr<fonts_t> fonts(fonts_t::create());
 		std::auto_ptr<fs_t> fs;
+		struct unload_t { // models hold VBOs and may still be loading from fs, so they must go before either does
+			~unload_t() { model.reset(); logo.reset(); model_cache.reset(); }
+		} unload;
 		try {
 			fs.reset(fs_t::create("data/Glest"));
+			model_cache.reset(new models_t(*fs,*loader));
 			if(false) {
 				fs_file_t::ptr_t logo_file(fs_settings->get("logo.g3d"));
 				istream_t::ptr_t logostream(logo_file->reader());
@@ -463,9 +518,18 @@ int main(int argc,char** args) {
 		glBlendFunc(GL_SRC_ALPHA,GL_ONE_MINUS_SRC_ALPHA);
 		glColorMaterial(GL_FRONT_AND_BACK,GL_AMBIENT_AND_DIFFUSE);
 		glEnable(GL_COLOR_MATERIAL);
-		glEnable(GL_NORMALIZE);
+		glEnable(GL_NORMALIZE); // the planet and models scale their snorm16 positions down
 		glFrontFace(GL_CW);
 		camera();
+		if(benchmark) {
+			terrain->benchmark();
+			if(fs.get() && techtree.get()) {
+				model_g3d_t::benchmark(*fs,*techtree);
+				model_cache->benchmark(*techtree);
+			} else
+				std::cerr << "(model benchmark skipped as mod not loaded)" << std::endl;
+			return EXIT_SUCCESS;
+		}
 		bool quit = false;
 		SDL_Event event;
 		SDL_EnableKeyRepeat(200,20);
@@ -508,6 +572,10 @@ int main(int argc,char** args) {
 					case SDLK_ESCAPE:
 						quit = true;
 						break;
+					case SDLK_i:
+						model_g3d_t::interpolate = !model_g3d_t::interpolate;
+						std::cout << "model animation " << (model_g3d_t::interpolate? "interpolated": "snapped to frames") << std::endl;
+						break;
 					case SDLK_m: // MODDING MODE
 						if(!fs.get()) {
 							std::cerr << "(modding menu triggered but mod not loaded)" << std::endl;
@@ -532,6 +600,7 @@ int main(int argc,char** args) {
 				}
 			}
 			framerate.tick(now());
+			loader->upload(loader_t::FRAME_BUDGET);
 			tick();
 		}
 		for(tests_t::iterator i=objs.begin(); i!=objs.end(); i++)
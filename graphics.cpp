@@ -15,8 +15,116 @@
 struct graphics_t::pimpl_t {
 	typedef std::map<std::string,GLuint> textures_t;
 	textures_t textures;
+	struct shared_t {
+		std::string path;
+		size_t refs;
+	};
+	typedef std::map<GLuint,shared_t> shared_textures_t;
+	shared_textures_t shared;
+	enum {
+		ARENA_SIZE = 4<<20, // bytes in each shared VBO; bigger ranges get a VBO of their own
+		ARENA_ALIGN = 16,
+	};
+	struct arena_t {
+		GLenum target;
+		GLsizeiptr size, used;
+		typedef std::map<GLintptr,GLsizeiptr> holes_t; // free bytes by offset
+		holes_t holes;
+	};
+	typedef std::map<GLuint,arena_t> arenas_t;
+	arenas_t arenas;
+	static GLsizeiptr aligned(GLsizeiptr size) { return (size+ARENA_ALIGN-1)&~(GLsizeiptr)(ARENA_ALIGN-1); }
+	static bool take(arena_t& arena,GLsizeiptr size,GLintptr& offset);
+	pimpl_t(): instancing(-1), program(0), instance_vbo(0), lighting_uniform(-1), lights_uniform(-1) {}
+	enum { INSTANCE_ATTRIB = 1 }; // the first of the 4 attributes the transform's columns go in
+	int instancing; // -1 until tried, then whether the shader built
+	GLuint program, instance_vbo;
+	GLint lighting_uniform, lights_uniform; // whether GL_LIGHTING and GL_LIGHT0 and 1 are enabled, as the shader cannot see
+	static const char* const instance_shader;
+	bool build_program();
 };
 
+const char* const graphics_t::pimpl_t::instance_shader =
+	"#version 120\n"
+	"attribute vec4 instance0, instance1, instance2, instance3;\n"
+	"uniform bool lighting;\n"
+	"uniform bool lights[2];\n"
+	"void main() {\n"
+	"	mat4 transform = mat4(instance0,instance1,instance2,instance3);\n"
+	"	vec4 eye = gl_ModelViewMatrix*(transform*gl_Vertex);\n"
+	"	gl_TexCoord[0] = gl_MultiTexCoord0;\n"
+	"	gl_Position = gl_ProjectionMatrix*eye;\n"
+	"	if(!lighting) {\n"
+	"		gl_FrontColor = gl_Color;\n"
+	"		return;\n"
+	"	}\n"
+	"	// the instances are scaled evenly, so their normals turn as their positions do\n"
+	"	vec3 normal = normalize(gl_NormalMatrix*(mat3(instance0.xyz,instance1.xyz,instance2.xyz)*gl_Normal));\n"
+	"	vec4 colour = gl_LightModel.ambient*gl_Color;\n"
+	"	for(int i=0; i<2; i++) {\n"
+	"		if(!lights[i])\n"
+	"			continue;\n"
+	"		vec3 to = normalize(gl_LightSource[i].position.w == 0.0? gl_LightSource[i].position.xyz: gl_LightSource[i].position.xyz-eye.xyz);\n"
+	"		float d = max(dot(normal,to),0.0);\n"
+	"		colour += gl_LightSource[i].ambient*gl_Color+gl_LightSource[i].diffuse*gl_Color*d;\n"
+	"		if(d > 0.0)\n"
+	"			colour += gl_LightSource[i].specular*gl_FrontMaterial.specular*\n"
+	"				pow(max(dot(normal,normalize(to+vec3(0.0,0.0,1.0))),0.0),gl_FrontMaterial.shininess);\n"
+	"	}\n"
+	"	gl_FrontColor = vec4(colour.rgb,gl_Color.a);\n"
+	"}\n";
+
+bool graphics_t::pimpl_t::build_program() {
+	if(!GLEW_VERSION_2_0 || !GLEW_ARB_draw_instanced || !GLEW_ARB_instanced_arrays)
+		return false;
+	GLint ok = GL_FALSE;
+	char log[1024] = "";
+	const GLuint shader = glCreateShader(GL_VERTEX_SHADER);
+	glShaderSource(shader,1,&instance_shader,NULL);
+	glCompileShader(shader);
+	glGetShaderiv(shader,GL_COMPILE_STATUS,&ok);
+	if(!ok) {
+		glGetShaderInfoLog(shader,sizeof(log),NULL,log);
+		std::cerr << "WARNING! cannot compile the instancing shader, so drawing each instance alone: " << log << std::endl;
+		glDeleteShader(shader);
+		return false;
+	}
+	program = glCreateProgram();
+	glAttachShader(program,shader);
+	glDeleteShader(shader); // goes with the program
+	static const char* const columns[4] = {"instance0","instance1","instance2","instance3"};
+	for(int c=0; c<4; c++)
+		glBindAttribLocation(program,INSTANCE_ATTRIB+c,columns[c]);
+	glLinkProgram(program);
+	glGetProgramiv(program,GL_LINK_STATUS,&ok);
+	if(!ok) {
+		glGetProgramInfoLog(program,sizeof(log),NULL,log);
+		std::cerr << "WARNING! cannot link the instancing shader, so drawing each instance alone: " << log << std::endl;
+		glDeleteProgram(program);
+		program = 0;
+		return false;
+	}
+	lighting_uniform = glGetUniformLocation(program,"lighting");
+	lights_uniform = glGetUniformLocation(program,"lights");
+	glGenBuffers(1,&instance_vbo);
+	return instance_vbo;
+}
+
+bool graphics_t::pimpl_t::take(arena_t& arena,GLsizeiptr size,GLintptr& offset) {
+	// first fit
+	for(arena_t::holes_t::iterator h=arena.holes.begin(); h!=arena.holes.end(); h++)
+		if(h->second >= size) {
+			offset = h->first;
+			const GLsizeiptr left = h->second-size;
+			arena.holes.erase(h);
+			if(left)
+				arena.holes[offset+size] = left;
+			arena.used += size;
+			return true;
+		}
+	return false;
+}
+
 static graphics_t* singleton = NULL;
 
 graphics_t::mgr_t::~mgr_t() {
@@ -59,11 +167,134 @@ void graphics_t::load_vbo(GLuint buffer,GLenum target,GLsizeiptr size,const GLvo
 	//#### glCheckErrors
 }
 
+void graphics_t::free_vbo(GLuint buffer) {
+	if(!buffer) graphics_error("VBO handle not set");
+	glDeleteBuffers(1,&buffer);
+}
+
+void graphics_t::update_vbo(GLuint buffer,GLenum target,GLintptr offset,GLsizeiptr size,const GLvoid* data) {
+	if(!buffer) graphics_error("VBO handle not set");
+	glBindBuffer(target,buffer);
+	glBufferSubData(target,offset,size,data);
+	glBindBuffer(target,0);
+}
+
+graphics_t::vbo_range_t graphics_t::alloc_vbo_range(GLenum target,GLsizeiptr size) {
+	vbo_range_t range;
+	range.size = size;
+	if(!size)
+		return range;
+	size = pimpl_t::aligned(size);
+	for(pimpl_t::arenas_t::iterator a=pimpl->arenas.begin(); a!=pimpl->arenas.end(); a++)
+		if((a->second.target == target) && pimpl_t::take(a->second,size,range.offset)) {
+			range.vbo = a->first;
+			return range;
+		}
+	range.vbo = alloc_vbo();
+	pimpl_t::arena_t& arena = pimpl->arenas[range.vbo];
+	arena.target = target;
+	arena.size = (size > pimpl_t::ARENA_SIZE? size: (GLsizeiptr)pimpl_t::ARENA_SIZE);
+	arena.used = 0;
+	arena.holes[0] = arena.size;
+	load_vbo(range.vbo,target,arena.size,NULL,GL_STATIC_DRAW);
+	pimpl_t::take(arena,size,range.offset);
+	return range;
+}
+
+void graphics_t::update_vbo_range(const vbo_range_t& range,GLenum target,GLintptr offset,GLsizeiptr size,const GLvoid* data) {
+	if((offset < 0) || (offset+size > range.size))
+		graphics_error("cannot update "<<size<<" bytes at "<<offset<<" in a VBO range of "<<range.size);
+	update_vbo(range.vbo,target,range.offset+offset,size,data);
+}
+
+void graphics_t::free_vbo_range(const vbo_range_t& range) {
+	if(!range.size)
+		return;
+	pimpl_t::arenas_t::iterator a = pimpl->arenas.find(range.vbo);
+	if(a == pimpl->arenas.end())
+		graphics_error("VBO range not allocated");
+	pimpl_t::arena_t& arena = a->second;
+	const GLsizeiptr size = pimpl_t::aligned(range.size);
+	arena.used -= size;
+	if(!arena.used) {
+		free_vbo(a->first);
+		pimpl->arenas.erase(a);
+		return;
+	}
+	// coalesce with the holes either side
+	GLintptr offset = range.offset;
+	GLsizeiptr hole = size;
+	pimpl_t::arena_t::holes_t::iterator next = arena.holes.lower_bound(offset);
+	if((next != arena.holes.end()) && (next->first == offset+hole)) {
+		hole += next->second;
+		arena.holes.erase(next++);
+	}
+	if(next != arena.holes.begin()) {
+		pimpl_t::arena_t::holes_t::iterator prev = next;
+		prev--;
+		if(prev->first+prev->second == offset) {
+			offset = prev->first;
+			hole += prev->second;
+		}
+	}
+	arena.holes[offset] = hole;
+}
+
+size_t graphics_t::vbo_arenas() const {
+	return pimpl->arenas.size();
+}
+
+bool graphics_t::can_instance() {
+	if(pimpl->instancing < 0)
+		pimpl->instancing = pimpl->build_program();
+	return pimpl->instancing;
+}
+
+void graphics_t::begin_instances(const GLfloat* transforms,size_t count) {
+	if(!can_instance())
+		graphics_error("the GL cannot draw instances");
+	// orphaned each time, so the GL need not wait for the last draw to finish with it
+	glBindBuffer(GL_ARRAY_BUFFER,pimpl->instance_vbo);
+	glBufferData(GL_ARRAY_BUFFER,count*16*sizeof(GLfloat),NULL,GL_STREAM_DRAW);
+	glBufferSubData(GL_ARRAY_BUFFER,0,count*16*sizeof(GLfloat),transforms);
+	for(GLuint c=0; c<4; c++) {
+		const GLuint attrib = pimpl_t::INSTANCE_ATTRIB+c;
+		glEnableVertexAttribArray(attrib);
+		glVertexAttribPointer(attrib,4,GL_FLOAT,GL_FALSE,16*sizeof(GLfloat),(GLvoid*)(c*4*sizeof(GLfloat)));
+		glVertexAttribDivisorARB(attrib,1);
+	}
+	glBindBuffer(GL_ARRAY_BUFFER,0);
+	glUseProgram(pimpl->program);
+	const GLint lights[2] = {glIsEnabled(GL_LIGHT0),glIsEnabled(GL_LIGHT1)};
+	glUniform1i(pimpl->lighting_uniform,glIsEnabled(GL_LIGHTING));
+	glUniform1iv(pimpl->lights_uniform,2,lights);
+}
+
+void graphics_t::end_instances() {
+	glUseProgram(0);
+	for(GLuint c=0; c<4; c++) {
+		const GLuint attrib = pimpl_t::INSTANCE_ATTRIB+c;
+		glVertexAttribDivisorARB(attrib,0);
+		glDisableVertexAttribArray(attrib);
+	}
+}
+
 GLuint graphics_t::alloc_texture(fs_file_t& file) {
 	pimpl_t::textures_t::const_iterator i = pimpl->textures.find(file.path());
-	if(i != pimpl->textures.end())
+	if(i != pimpl->textures.end()) {
+		pimpl->shared[i->second].refs++;
+		return i->second;
+	}
+	return alloc_texture(file,load_surface(file));
+}
+
+GLuint graphics_t::alloc_texture(fs_file_t& file,SDL_Surface* surface) {
+	pimpl_t::textures_t::const_iterator i = pimpl->textures.find(file.path());
+	if(i != pimpl->textures.end()) {
+		SDL_FreeSurface(surface);
+		pimpl->shared[i->second].refs++;
 		return i->second;
-	SDL_Surface* surface = load_surface(file);
+	}
 	GLuint texture = 0;
 	try {
 		texture = graphics()->alloc_texture();
@@ -71,6 +302,9 @@ GLuint graphics_t::alloc_texture(fs_file_t& file) {
 		std::cout << "(loaded texture "<<file<<" "<<surface->w<<'x'<<surface->h<<")" << std::endl;
 		SDL_FreeSurface(surface); surface = NULL;
 		pimpl->textures[file.path()] = texture;
+		pimpl_t::shared_t& shared = pimpl->shared[texture];
+		shared.path = file.path();
+		shared.refs = 1;
 		return texture;
 	} catch(...) {
 		std::cerr << "Error loading: "<<file<<std::endl;
@@ -81,6 +315,23 @@ GLuint graphics_t::alloc_texture(fs_file_t& file) {
 	return texture;
 }
 
+void graphics_t::release_texture(GLuint texture) {
+	if(!texture)
+		graphics_error("texture handle not set");
+	pimpl_t::shared_textures_t::iterator i = pimpl->shared.find(texture);
+	if(i != pimpl->shared.end()) {
+		if(--i->second.refs)
+			return;
+		pimpl->textures.erase(i->second.path);
+		pimpl->shared.erase(i);
+	}
+	glDeleteTextures(1,&texture);
+}
+
+size_t graphics_t::shared_textures() const {
+	return pimpl->shared.size();
+}
+
 GLuint graphics_t::alloc_texture() {
 	GLuint texture;
 	glGenTextures(1,&texture);
@@ -33,7 +33,28 @@ public:
 	virtual ~graphics_t();
 	GLuint alloc_vbo();
 	void load_vbo(GLuint id,GLenum target,GLsizeiptr size,const GLvoid* data,GLenum usage);
+	void update_vbo(GLuint id,GLenum target,GLintptr offset,GLsizeiptr size,const GLvoid* data);
+	void free_vbo(GLuint id);
+	struct vbo_range_t { // a slice of a VBO that other ranges share
+		vbo_range_t(): vbo(0), offset(0), size(0) {}
+		GLuint vbo;
+		GLintptr offset;
+		GLsizeiptr size;
+	};
+	vbo_range_t alloc_vbo_range(GLenum target,GLsizeiptr size); // allocated, but contents undefined until updated
+	void update_vbo_range(const vbo_range_t& range,GLenum target,GLintptr offset,GLsizeiptr size,const GLvoid* data); // offset within the range
+	void free_vbo_range(const vbo_range_t& range);
+	size_t vbo_arenas() const; // the shared VBOs the ranges are in
+	/* the arrays set drawn many times in one glDraw*InstancedARB, each copy placed by its own
+	column-major transform after the modelview.  The vertex shader lights as the fixed function
+	would with whichever of lights 0 and 1 are enabled, and the colour as the ambient and diffuse material */
+	bool can_instance(); // GLSL, ARB_draw_instanced and ARB_instanced_arrays are all there
+	void begin_instances(const GLfloat* transforms,size_t count); // streams the transforms and binds the shader
+	void end_instances();
 	GLuint alloc_texture(fs_file_t& file); // PREFERRED METHOD, SHARED
+	GLuint alloc_texture(fs_file_t& file,SDL_Surface* surface); // decoded already, perhaps off the main thread; frees it
+	void release_texture(GLuint id); // shared textures go when the last user releases them
+	size_t shared_textures() const;
 	// raw stuff if you know what you're doing
 	GLuint alloc_texture();
 	void load_texture_2D(GLuint id,SDL_Surface* image);
@@ -0,0 +1,130 @@
+/*
+ graphics_test.cpp is part of the GlestNG RTS game engine.
+ Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE version 3
+ See LICENSE for details
+ (c) William Edwards, 2011; all rights reserved
+*/
+
+#include "graphics.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <iostream>
+
+#include "error.hpp"
+
+/* VBO ranges are suballocated first-fit from shared arenas; freed ranges must coalesce with
+the holes either side of them, and an arena must go when its last range does */
+
+typedef graphics_t::vbo_range_t range_t;
+
+enum { MB = 1<<20 }; // a quarter of an arena
+
+static range_t alloc(GLsizeiptr size) {
+	const range_t range = graphics()->alloc_vbo_range(GL_ARRAY_BUFFER,size);
+	assert(range.vbo && (range.size == size));
+	return range;
+}
+
+static void coalesce(bool forwards) {
+	// an arena filled end to end, then two neighbours freed in either order leave one hole for a range as big as both
+	const range_t a = alloc(MB), b = alloc(MB), c = alloc(MB), d = alloc(MB);
+	assert((a.vbo == b.vbo) && (b.vbo == c.vbo) && (c.vbo == d.vbo));
+	assert((a.offset == 0) && (b.offset == MB) && (c.offset == 2*MB) && (d.offset == 3*MB));
+	assert(graphics()->vbo_arenas() == 1);
+	graphics()->free_vbo_range(forwards? a: b);
+	graphics()->free_vbo_range(forwards? b: a);
+	const range_t ab = alloc(2*MB);
+	assert((ab.vbo == a.vbo) && (ab.offset == 0));
+	// a range freed between two holes joins them both
+	graphics()->free_vbo_range(ab);
+	const range_t e = alloc(MB), f = alloc(MB);
+	assert((e.offset == 0) && (f.offset == MB));
+	graphics()->free_vbo_range(forwards? e: c);
+	graphics()->free_vbo_range(forwards? c: e);
+	graphics()->free_vbo_range(f);
+	const range_t efc = alloc(3*MB);
+	assert((efc.vbo == a.vbo) && (efc.offset == 0));
+	assert(graphics()->vbo_arenas() == 1);
+	graphics()->free_vbo_range(efc);
+	graphics()->free_vbo_range(d);
+	assert(graphics()->vbo_arenas() == 0);
+}
+
+static void reuse() {
+	// a freed range is filled first-fit, and what is left over is still there
+	const range_t a = alloc(MB), b = alloc(MB), c = alloc(MB);
+	graphics()->free_vbo_range(b);
+	const range_t small = alloc(MB/2), rest = alloc(MB/2);
+	assert((small.vbo == b.vbo) && (small.offset == b.offset));
+	assert((rest.vbo == b.vbo) && (rest.offset == b.offset+MB/2));
+	// sizes are rounded up to the alignment
+	const range_t odd = alloc(1);
+	assert((odd.vbo == a.vbo) && (odd.offset == 3*MB));
+	const range_t next = alloc(1);
+	assert((next.vbo == a.vbo) && (next.offset > odd.offset) && !(next.offset&15));
+	// too big for what is left of the arena, so it gets another
+	const range_t big = alloc(MB);
+	assert(big.vbo != a.vbo);
+	assert(graphics()->vbo_arenas() == 2);
+	range_t ranges[] = {a, c, small, rest, odd, next, big};
+	for(size_t i=0; i<sizeof(ranges)/sizeof(*ranges); i++)
+		graphics()->free_vbo_range(ranges[i]);
+	assert(graphics()->vbo_arenas() == 0);
+}
+
+static void contents() {
+	// ranges are written within their own bounds
+	const range_t a = alloc(64), b = alloc(64);
+	GLubyte ones[64], twos[64], back[128];
+	for(int i=0; i<64; i++) {
+		ones[i] = 1;
+		twos[i] = 2;
+	}
+	graphics()->update_vbo_range(a,GL_ARRAY_BUFFER,0,sizeof(ones),ones);
+	graphics()->update_vbo_range(b,GL_ARRAY_BUFFER,0,sizeof(twos),twos);
+	glBindBuffer(GL_ARRAY_BUFFER,a.vbo);
+	glGetBufferSubData(GL_ARRAY_BUFFER,a.offset,sizeof(back),back);
+	glBindBuffer(GL_ARRAY_BUFFER,0);
+	for(int i=0; i<64; i++)
+		assert((back[i] == 1) && (back[64+i] == 2));
+	bool refused = false;
+	try {
+		graphics()->update_vbo_range(a,GL_ARRAY_BUFFER,32,64,twos);
+	} catch(graphics_error_t* e) {
+		refused = true;
+		delete e;
+	}
+	assert(refused);
+	graphics()->free_vbo_range(a);
+	graphics()->free_vbo_range(b);
+	assert(graphics()->vbo_arenas() == 0);
+}
+
+int main(int argc,char** args) {
+	if(SDL_Init(SDL_INIT_VIDEO)) {
+		fprintf(stderr,"Unable to initialize SDL: %s\n",SDL_GetError());
+		return EXIT_FAILURE;
+	}
+	atexit(SDL_Quit);
+	if(!SDL_SetVideoMode(64,64,32,SDL_OPENGL)) {
+		fprintf(stderr,"Unable to create SDL screen: %s\n",SDL_GetError());
+		return EXIT_FAILURE;
+	}
+	if(GLEW_OK != glewInit()) {
+		fprintf(stderr,"Unable to initialize GLEW\n");
+		return EXIT_FAILURE;
+	}
+	std::auto_ptr<graphics_t::mgr_t> graphics_mgr(graphics_t::create());
+	try {
+		coalesce(true);
+		coalesce(false);
+		reuse();
+		contents();
+	} catch(glest_exception_t* e) {
+		std::cerr << e << std::endl;
+		return EXIT_FAILURE;
+	}
+	std::cout << "VBO arenas: ok" << std::endl;
+	return EXIT_SUCCESS;
+}
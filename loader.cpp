@@ -0,0 +1,237 @@
+/*
+ loader.cpp is part of the GlestNG RTS game engine.
+ Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE version 3
+ See LICENSE for details
+ (c) William Edwards, 2011; all rights reserved
+*/
+
+#include <iostream>
+#include <algorithm>
+#include <exception>
+
+#include "loader.hpp"
+#include "error.hpp"
+
+struct loader_t::pimpl_t {
+	pimpl_t(): quit(false), jobs(0), mutex(SDL_CreateMutex()), work(SDL_CreateCond()), staged(SDL_CreateCond()) {
+		if(!mutex || !work || !staged)
+			panic("could not create the loader's locks: " << SDL_GetError());
+	}
+	~pimpl_t() {
+		SDL_DestroyCond(staged);
+		SDL_DestroyCond(work);
+		SDL_DestroyMutex(mutex);
+	}
+	bool quit;
+	size_t jobs; // added and not yet uploaded, failed or cancelled
+	SDL_mutex* const mutex; // guards the queues and job states
+	SDL_cond* const work; // signalled when a job is queued, or on quit
+	SDL_cond* const staged; // broadcast whenever a job leaves STAGING
+	std::vector<SDL_Thread*> threads;
+	typedef std::deque<load_job_t*> jobs_t;
+	jobs_t queued, ready; // ready are STAGED or FAILED, oldest first
+	static int worker(void* self);
+	void run();
+	void remove(jobs_t& jobs,load_job_t* job) {
+		jobs_t::iterator i = std::find(jobs.begin(),jobs.end(),job);
+		if(i != jobs.end())
+			jobs.erase(i);
+	}
+	void report(load_job_t* job) {
+		std::cerr << "could not load: " << job->error << std::endl;
+	}
+	static bool stage(load_job_t* job,std::string& error);
+	static bool upload(load_job_t* job,size_t& budget,std::string& error);
+};
+
+bool loader_t::pimpl_t::stage(load_job_t* job,std::string& error) {
+	// what went wrong goes in error rather than up the stack, so the job can be marked FAILED
+	try {
+		job->stage();
+		return true;
+	} catch(glest_exception_t* e) {
+		error = e->str();
+		delete e;
+	} catch(std::exception& e) {
+		error = e.what();
+	}
+	return false;
+}
+
+bool loader_t::pimpl_t::upload(load_job_t* job,size_t& budget,std::string& error) {
+	// true when finished or failed
+	try {
+		return job->upload(budget);
+	} catch(glest_exception_t* e) {
+		error = e->str();
+		delete e;
+	} catch(std::exception& e) {
+		error = e.what();
+	}
+	return true;
+}
+
+int loader_t::pimpl_t::worker(void* self) {
+	static_cast<pimpl_t*>(self)->run();
+	return 0;
+}
+
+void loader_t::pimpl_t::run() {
+	SDL_LockMutex(mutex);
+	for(;;) {
+		while(!quit && queued.empty())
+			SDL_CondWait(work,mutex);
+		if(quit)
+			break;
+		load_job_t* job = queued.front();
+		queued.pop_front();
+		job->state = load_job_t::STAGING;
+		SDL_UnlockMutex(mutex);
+		std::string error;
+		stage(job,error);
+		SDL_LockMutex(mutex);
+		job->error = error;
+		job->state = error.size()? load_job_t::FAILED: load_job_t::STAGED;
+		ready.push_back(job);
+		SDL_CondBroadcast(staged);
+	}
+	SDL_UnlockMutex(mutex);
+}
+
+loader_t::loader_t(size_t threads): pimpl(new pimpl_t()) {
+	for(size_t i=0; i<threads; i++)
+		if(SDL_Thread* thread = SDL_CreateThread(pimpl_t::worker,pimpl))
+			pimpl->threads.push_back(thread);
+		else
+			panic("could not start loader thread " << i << ": " << SDL_GetError());
+}
+
+loader_t::~loader_t() {
+	SDL_LockMutex(pimpl->mutex);
+	pimpl->quit = true;
+	SDL_CondBroadcast(pimpl->work);
+	SDL_UnlockMutex(pimpl->mutex);
+	for(size_t i=0; i<pimpl->threads.size(); i++)
+		SDL_WaitThread(pimpl->threads[i],NULL);
+	// what is left is never uploaded
+	for(pimpl_t::jobs_t::iterator j=pimpl->queued.begin(); j!=pimpl->queued.end(); j++) {
+		(*j)->state = load_job_t::IDLE;
+		(*j)->loader = NULL;
+	}
+	for(pimpl_t::jobs_t::iterator j=pimpl->ready.begin(); j!=pimpl->ready.end(); j++)
+		(*j)->loader = NULL;
+	delete pimpl;
+}
+
+void loader_t::add(load_job_t* job) {
+	SDL_LockMutex(pimpl->mutex);
+	if(job->state != load_job_t::IDLE) {
+		SDL_UnlockMutex(pimpl->mutex);
+		panic("job is already loading");
+	}
+	job->loader = this;
+	job->state = load_job_t::QUEUED;
+	pimpl->queued.push_back(job);
+	pimpl->jobs++;
+	SDL_CondSignal(pimpl->work);
+	SDL_UnlockMutex(pimpl->mutex);
+}
+
+void loader_t::upload(size_t budget) {
+	// jobs are only ever taken off ready by the main thread, so it can upload unlocked
+	while(budget) {
+		SDL_LockMutex(pimpl->mutex);
+		load_job_t* job = pimpl->ready.empty()? NULL: pimpl->ready.front();
+		SDL_UnlockMutex(pimpl->mutex);
+		if(!job)
+			break;
+		std::string error;
+		if((job->state == load_job_t::FAILED) || pimpl->upload(job,budget,error)) {
+			SDL_LockMutex(pimpl->mutex);
+			pimpl->ready.pop_front();
+			if(error.size()) {
+				job->error = error;
+				job->state = load_job_t::FAILED;
+			}
+			if(job->state == load_job_t::FAILED)
+				pimpl->report(job);
+			else
+				job->state = load_job_t::DONE;
+			job->loader = NULL;
+			pimpl->jobs--;
+			SDL_UnlockMutex(pimpl->mutex);
+		}
+	}
+}
+
+void loader_t::finish(load_job_t* job) {
+	SDL_LockMutex(pimpl->mutex);
+	if(job->loader != this) {
+		SDL_UnlockMutex(pimpl->mutex);
+		return;
+	}
+	// take it off the queue and stage it here rather than wait its turn
+	if(job->state == load_job_t::QUEUED) {
+		pimpl->remove(pimpl->queued,job);
+		job->state = load_job_t::STAGING;
+		SDL_UnlockMutex(pimpl->mutex);
+		std::string error;
+		pimpl_t::stage(job,error);
+		SDL_LockMutex(pimpl->mutex);
+		job->error = error;
+		job->state = error.size()? load_job_t::FAILED: load_job_t::STAGED;
+		SDL_CondBroadcast(pimpl->staged);
+	} else {
+		while(job->state == load_job_t::STAGING)
+			SDL_CondWait(pimpl->staged,pimpl->mutex);
+		pimpl->remove(pimpl->ready,job);
+	}
+	job->loader = NULL;
+	pimpl->jobs--;
+	SDL_UnlockMutex(pimpl->mutex);
+	// it failed here or on a worker; either way it is FAILED before the caller hears of it
+	if(job->state == load_job_t::FAILED)
+		data_error(job->error);
+	std::string error;
+	size_t unlimited = ~(size_t)0;
+	while(!pimpl_t::upload(job,unlimited,error))
+		unlimited = ~(size_t)0;
+	if(error.size()) {
+		job->error = error;
+		job->state = load_job_t::FAILED;
+		data_error(error);
+	}
+	job->state = load_job_t::DONE;
+}
+
+void loader_t::cancel(load_job_t* job) {
+	SDL_LockMutex(pimpl->mutex);
+	if(job->loader == this) {
+		while(job->state == load_job_t::STAGING)
+			SDL_CondWait(pimpl->staged,pimpl->mutex);
+		pimpl->remove(pimpl->queued,job);
+		pimpl->remove(pimpl->ready,job);
+		if(job->state == load_job_t::QUEUED)
+			job->state = load_job_t::IDLE;
+		job->loader = NULL;
+		pimpl->jobs--;
+	}
+	SDL_UnlockMutex(pimpl->mutex);
+}
+
+size_t loader_t::pending() const {
+	SDL_LockMutex(pimpl->mutex);
+	const size_t count = pimpl->jobs;
+	SDL_UnlockMutex(pimpl->mutex);
+	return count;
+}
+
+load_job_t::~load_job_t() {
+	if(loader)
+		panic("a load job must cancel() in its own destructor");
+}
+
+void load_job_t::cancel() {
+	if(loader)
+		loader->cancel(this);
+}
@@ -0,0 +1,58 @@
+/*
+ loader.hpp is part of the GlestNG RTS game engine.
+ Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE version 3
+ See LICENSE for details
+ (c) William Edwards, 2011; all rights reserved
+*/
+
+#ifndef __LOADER_HPP__
+#define __LOADER_HPP__
+
+#include <string>
+#include <deque>
+#include <vector>
+
+#include "graphics.hpp"
+
+class loader_t;
+
+/* a resource loaded in two halves: stage() runs on a worker thread and does the file I/O,
+parsing and image decoding into CPU-side buffers without touching GL, then upload() runs on
+the main thread a bounded number of bytes at a time until everything is on the GPU */
+class load_job_t {
+public:
+	enum state_t { IDLE, QUEUED, STAGING, STAGED, DONE, FAILED };
+	virtual ~load_job_t();
+	state_t get_state() const { return state; }
+	bool is_done() const { return state == DONE; }
+	bool is_failed() const { return state == FAILED; }
+	const std::string& get_error() const { return error; }
+protected:
+	load_job_t(): loader(NULL), state(IDLE) {}
+	virtual void stage() = 0;
+	virtual bool upload(size_t& budget) = 0; // takes what it uploads off the budget; true when finished
+	void cancel(); // derived destructors call this before they free anything stage() may be writing
+	void loaded() { state = DONE; } // for a derived class that staged and uploaded itself, without a loader
+private:
+	friend class loader_t;
+	loader_t* loader;
+	volatile state_t state;
+	std::string error;
+};
+
+class loader_t {
+public:
+	enum { FRAME_BUDGET = 1<<20 }; // bytes a frame may upload without the frame rate suffering
+	loader_t(size_t threads=2);
+	~loader_t();
+	void add(load_job_t* job); // the caller still owns the job
+	void upload(size_t budget); // call each frame on the main thread; budget is in bytes
+	void finish(load_job_t* job); // blocks until the job is staged, then uploads it whatever its size
+	void cancel(load_job_t* job);
+	size_t pending() const; // jobs added and not yet uploaded
+private:
+	struct pimpl_t;
+	pimpl_t* pimpl;
+};
+
+#endif //__LOADER_HPP__
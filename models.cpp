@@ -0,0 +1,161 @@
+/*
+ models.cpp is part of the GlestNG RTS game engine.
+ Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE version 3
+ See LICENSE for details
+ (c) William Edwards, 2011; all rights reserved
+*/
+
+#include <iostream>
+#include <vector>
+
+#include "models.hpp"
+#include "error.hpp"
+#include "world.hpp"
+
+models_t::handle_t::handle_t(models_t* m,entry_t* e): models(m), entry(e) {}
+
+models_t::handle_t::handle_t(const handle_t& copy): models(copy.models), entry(copy.entry) {
+	if(entry)
+		entry->refs++;
+}
+
+models_t::handle_t& models_t::handle_t::operator=(const handle_t& copy) {
+	if(copy.entry)
+		copy.entry->refs++;
+	reset();
+	models = copy.models;
+	entry = copy.entry;
+	return *this;
+}
+
+models_t::handle_t::~handle_t() {
+	reset();
+}
+
+model_g3d_t* models_t::handle_t::get() const {
+	if(!entry)
+		panic("model handle not set");
+	return entry->model;
+}
+
+void models_t::handle_t::reset() {
+	if(entry)
+		models->release(entry);
+	models = NULL;
+	entry = NULL;
+}
+
+models_t::models_t(fs_t& fs_,loader_t& loader_,size_t budget_):
+	fs(fs_), loader(loader_), budget(budget_) {}
+
+models_t::~models_t() {
+	for(entries_t::iterator i=entries.begin(); i!=entries.end(); i++)
+		if(i->second->refs)
+			panic(i->first << " is still in use");
+	while(entries.size())
+		remove(entries.begin()->second);
+}
+
+models_t::handle_t models_t::get(const std::string& path) {
+	const std::string canonical = fs.canocial(path);
+	entries_t::iterator i = entries.find(canonical);
+	entry_t* entry;
+	if(i != entries.end()) {
+		entry = i->second;
+		if(!entry->refs++)
+			unused.erase(entry->lru);
+	} else {
+		entry = new entry_t();
+		entry->path = canonical;
+		entry->refs = 1;
+		try {
+			entry->model = new model_g3d_t(fs,canonical,loader);
+		} catch(...) {
+			delete entry;
+			throw;
+		}
+		entries[canonical] = entry;
+	}
+	return handle_t(this,entry);
+}
+
+void models_t::release(entry_t* entry) {
+	if(--entry->refs)
+		return;
+	entry->lru = unused.insert(unused.end(),entry);
+	if(entry->model->is_failed()) // so a fixed file is loaded afresh
+		remove(entry);
+	else
+		evict();
+}
+
+void models_t::set_budget(size_t b) {
+	budget = b;
+	evict();
+}
+
+size_t models_t::memory() const {
+	size_t bytes = 0;
+	for(entries_t::const_iterator i=entries.begin(); i!=entries.end(); i++)
+		bytes += i->second->model->get_memory();
+	return bytes;
+}
+
+void models_t::evict() {
+	if(budget == NO_BUDGET) {
+		while(unused.size())
+			remove(unused.front());
+		return;
+	}
+	size_t bytes = memory();
+	while((bytes > budget) && unused.size()) {
+		entry_t* entry = unused.front();
+		bytes -= entry->model->get_memory();
+		remove(entry);
+	}
+}
+
+void models_t::remove(entry_t* entry) {
+	if(!entry->refs)
+		unused.erase(entry->lru);
+	entries.erase(entry->path);
+	delete entry->model; // frees its VBOs and releases its textures
+	delete entry;
+}
+
+void models_t::benchmark(techtree_t& techtree) {
+	// every unit model asked for twice, then dropped under a budget of half what they take
+	const strings_t paths = model_g3d_t::unit_models(fs,techtree);
+	const size_t old_budget = budget;
+	std::vector<handle_t> handles;
+	uint64_t start = high_precision_time();
+	for(int pass=0; pass<2; pass++)
+		for(strings_t::const_iterator p=paths.begin(); p!=paths.end(); p++)
+			handles.push_back(get(*p));
+	const uint64_t lookup = high_precision_time()-start;
+	const size_t loaded = entries.size();
+	while(loader.pending())
+		loader.upload(~(size_t)0);
+	const size_t held = memory();
+	const size_t held_textures = graphics()->shared_textures();
+	start = high_precision_time();
+	budget = held/2;
+	handles.clear();
+	const uint64_t release = high_precision_time()-start;
+	const size_t kept = entries.size(), kept_bytes = memory();
+	size_t reused = 0;
+	for(strings_t::const_iterator p=paths.begin(); p!=paths.end(); p++) {
+		const bool resident = (entries.find(fs.canocial(*p)) != entries.end());
+		handles.push_back(get(*p));
+		reused += (resident && handles.back()->is_done());
+	}
+	handles.clear();
+	budget = NO_BUDGET;
+	evict();
+	const size_t left = entries.size(), left_textures = graphics()->shared_textures();
+	budget = old_budget;
+	std::cout << "models: " << paths.size()*2 << " handles to " << loaded << " models in " << lookup << " ns, holding " <<
+		held << " bytes and " << held_textures << " textures; released under a budget of " << held/2 << " in " << release <<
+		" ns, keeping " << kept << " models of " << kept_bytes << " bytes, " << reused << " reused; then " << left << " models and " <<
+		left_textures << " textures still held" << std::endl;
+}
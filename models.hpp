@@ -0,0 +1,73 @@
+/*
+ models.hpp is part of the GlestNG RTS game engine.
+ Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE version 3
+ See LICENSE for details
+ (c) William Edwards, 2011; all rights reserved
+*/
+
+#ifndef __MODELS_HPP__
+#define __MODELS_HPP__
+
+#include <string>
+#include <map>
+#include <list>
+
+#include "g3d.hpp"
+
+class techtree_t;
+
+/* the G3D models in use, one per canonical path however many units ask for it.  Models are
+handed out as counted handles; when the last handle goes the model is released, or, if there
+is a budget, kept unreferenced in case it is wanted again until the least recently used of
+those have to go to keep the memory held under the budget */
+class models_t {
+	struct entry_t;
+public:
+	class handle_t {
+	public:
+		handle_t(): models(NULL), entry(NULL) {}
+		handle_t(const handle_t& copy);
+		handle_t& operator=(const handle_t& copy);
+		~handle_t();
+		bool is_set() const { return entry != NULL; }
+		model_g3d_t* get() const;
+		model_g3d_t* operator->() const { return get(); }
+		model_g3d_t& operator*() const { return *get(); }
+		void reset();
+	private:
+		friend class models_t;
+		handle_t(models_t* models,entry_t* entry); // already counted
+		models_t* models;
+		entry_t* entry;
+	};
+	enum { NO_BUDGET = 0 }; // models go as soon as they are unreferenced
+	models_t(fs_t& fs,loader_t& loader,size_t budget=NO_BUDGET);
+	~models_t(); // every handle must have gone
+	handle_t get(const std::string& path); // loads in the background if not already held
+	void set_budget(size_t budget); // in bytes; evicts if now over it
+	size_t get_budget() const { return budget; }
+	size_t memory() const; // bytes held by all the models, referenced or not
+	size_t count() const { return entries.size(); }
+	size_t unreferenced() const { return unused.size(); }
+	void benchmark(techtree_t& techtree); // prints timings to stdout
+private:
+	friend class handle_t;
+	struct entry_t {
+		std::string path;
+		model_g3d_t* model;
+		size_t refs;
+		std::list<entry_t*>::iterator lru; // set only whilst unreferenced
+	};
+	typedef std::map<std::string,entry_t*> entries_t;
+	typedef std::list<entry_t*> lru_t;
+	fs_t& fs;
+	loader_t& loader;
+	size_t budget;
+	entries_t entries;
+	lru_t unused; // unreferenced, least recently used first
+	void release(entry_t* entry);
+	void evict();
+	void remove(entry_t* entry);
+};
+
+#endif //__MODELS_HPP__
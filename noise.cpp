@@ -0,0 +1,61 @@
+/*
+ noise.cpp is part of the GlestNG RTS game engine.
+ Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE version 3
+ See LICENSE for details
+ (c) William Edwards, 2011; all rights reserved
+*/
+
+#include <math.h>
+#include <inttypes.h>
+
+#include "noise.hpp"
+
+static inline float fade(float t) { return t*t*t*(t*(t*6-15)+10); }
+
+static inline float lerp(float t,float a,float b) { return a+t*(b-a); }
+
+noise_t::noise_t(unsigned seed) {
+	// a Fisher-Yates shuffle driven by its own generator, so rand() and other noise_t are left alone
+	uint32_t state = seed*2654435761u+1;
+	for(int i=0; i<256; i++)
+		perm[i] = i;
+	for(int i=255; i>0; i--) {
+		state = state*1664525u+1013904223u;
+		const int j = (state>>8)%(i+1);
+		const int swap = perm[i];
+		perm[i] = perm[j];
+		perm[j] = swap;
+	}
+	for(int i=0; i<256; i++)
+		perm[256+i] = perm[i];
+}
+
+float noise_t::grad(int hash,float x,float y,float z) const {
+	// one of the 12 edge directions of a cube, picked by the low bits of the hash
+	const int h = hash&15;
+	const float u = h<8? x: y, v = h<4? y: (h==12||h==14)? x: z;
+	return ((h&1)? -u: u)+((h&2)? -v: v);
+}
+
+float noise_t::operator()(const vec_t& pt) const {
+	const float fx = floor(pt.x), fy = floor(pt.y), fz = floor(pt.z);
+	const int X = (int)fx&255, Y = (int)fy&255, Z = (int)fz&255;
+	const float x = pt.x-fx, y = pt.y-fy, z = pt.z-fz;
+	const float u = fade(x), v = fade(y), w = fade(z);
+	const int A = perm[X]+Y, AA = perm[A]+Z, AB = perm[A+1]+Z,
+		B = perm[X+1]+Y, BA = perm[B]+Z, BB = perm[B+1]+Z;
+	return lerp(w,lerp(v,lerp(u,grad(perm[AA],x,y,z),grad(perm[BA],x-1,y,z)),
+			lerp(u,grad(perm[AB],x,y-1,z),grad(perm[BB],x-1,y-1,z))),
+		lerp(v,lerp(u,grad(perm[AA+1],x,y,z-1),grad(perm[BA+1],x-1,y,z-1)),
+			lerp(u,grad(perm[AB+1],x,y-1,z-1),grad(perm[BB+1],x-1,y-1,z-1))));
+}
+
+float noise_t::octaves(const vec_t& pt,size_t count,float lacunarity,float gain) const {
+	float sum = 0, amplitude = 1, frequency = 1;
+	for(size_t i=0; i<count; i++) {
+		sum += (*this)(pt*frequency)*amplitude;
+		frequency *= lacunarity;
+		amplitude *= gain;
+	}
+	return sum;
+}
@@ -0,0 +1,25 @@
+/*
+ noise.hpp is part of the GlestNG RTS game engine.
+ Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE version 3
+ See LICENSE for details
+ (c) William Edwards, 2011; all rights reserved
+*/
+
+#ifndef __NOISE_HPP__
+#define __NOISE_HPP__
+
+#include "3d.hpp"
+
+/* seeded 3D gradient noise, after Perlin's improved noise; the same seed always gives the
+same field, and it is safe to sample from many threads at once */
+class noise_t {
+public:
+	noise_t(unsigned seed);
+	float operator()(const vec_t& pt) const; // roughly -1 to 1, and 0 at integer coordinates
+	float octaves(const vec_t& pt,size_t count,float lacunarity=2.0f,float gain=0.5f) const; // fractal sum
+private:
+	int perm[512]; // a shuffle of 0-255, twice over so lookups need not wrap
+	float grad(int hash,float x,float y,float z) const;
+};
+
+#endif //__NOISE_HPP__
@@ -0,0 +1,746 @@
+/*
+ path.cpp is part of the GlestNG RTS game engine.
+ Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE version 3
+ See LICENSE for details
+ (c) William Edwards, 2011; all rights reserved
+*/
+
+#include <vector>
+#include <map>
+#include <queue>
+#include <algorithm>
+#include <functional>
+#include <iostream>
+#include <stdlib.h>
+#include <math.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "path.hpp"
+#include "planet.hpp"
+#include "error.hpp"
+
+enum {
+	MAX_ENTRANCE = 8, // a passable stretch of border longer than this gets more than one portal
+	MAX_FLOWFIELDS = 32, // least recently used are dropped
+
+	NO_CLUSTER = ~0,
+};
+
+static const float MAX_SLOPE = 1.0f; // rise over run
+
+struct pathfinder_t::pimpl_t {
+	pimpl_t(const planet_t& p): planet(p), flowfields_used(0) {}
+	~pimpl_t() { clear_flowfields(); }
+	const planet_t& planet;
+	struct cluster_t {
+		std::vector<GLuint> points; // sorted
+		std::vector<size_t> neighbours; // clusters that share points with this one
+		std::vector<GLuint> portals; // sorted
+		std::vector<float> costs; // between portals, row-major; negative if unreachable within the cluster
+		int portal(GLuint p) const;
+	};
+	std::vector<cluster_t> clusters;
+	struct search_t { // scratch for the searches over points; one per thread
+		search_t(size_t points): g(points), parent(points), via(points), seen(points,0), done(points,0), generation(0) {}
+		std::vector<float> g;
+		std::vector<GLuint> parent;
+		std::vector<size_t> via; // the cluster a portal was reached through
+		std::vector<unsigned> seen, done;
+		unsigned generation;
+		typedef std::pair<float,GLuint> entry_t;
+		std::priority_queue<entry_t,std::vector<entry_t>,std::greater<entry_t> > open;
+		void reset();
+		bool reached(GLuint p) const { return done[p] == generation; }
+	};
+	struct step_t { // an abstract path is a list of points and the cluster in which to refine to them
+		step_t(GLuint p,size_t c): point(p), cluster(c) {}
+		GLuint point;
+		size_t cluster;
+	};
+	struct edge_t { // from the start or to the goal, through a cluster
+		edge_t(): cost(-1), cluster(NO_CLUSTER) {}
+		edge_t(float c,size_t cl): cost(c), cluster(cl) {}
+		float cost;
+		size_t cluster;
+	};
+	typedef std::map<GLuint,edge_t> edges_t;
+	bool passable(GLuint p) const { return planet.types[p] != planet_t::WATER; }
+	float factor(GLuint p) const;
+	float cost(GLuint from,GLuint to) const;
+	float heuristic(GLuint from,GLuint to) const { return planet.points[from].distance(planet.points[to]); }
+	size_t clusters_of(GLuint p,size_t out[6]) const;
+	bool in_cluster(GLuint p,size_t c) const;
+	void init();
+	void init_portals(size_t c);
+	void init_costs(search_t& search,size_t c);
+	void border(size_t a,size_t b,std::vector<GLuint>& portals) const;
+	bool search(search_t& search,GLuint start,GLuint goal,size_t cluster,path_t* path) const;
+	void sweep(search_t& s,GLuint start,size_t cluster) const { search(s,start,~0,cluster,NULL); }
+	bool find(search_t& search,GLuint start,GLuint goal,path_t& path) const;
+	typedef std::map<GLuint,flowfield_t*> flowfields_t;
+	flowfields_t flowfields;
+	unsigned flowfields_used;
+	struct improved_t { // a cheaper way to the goal that a cluster found for one of its points
+		improved_t(GLuint p,GLuint n,float c,size_t cl,bool e): point(p), next(n), cost(c), cluster(cl), expanded(e) {}
+		GLuint point, next;
+		float cost;
+		size_t cluster;
+		bool expanded; // else it is beyond the band, and its neighbours have yet to hear of it
+		bool operator<(const improved_t& o) const { return (point < o.point) || ((point == o.point) && (cost < o.cost)); }
+	};
+	typedef std::vector<improved_t> improvements_t;
+	void flow(flowfield_t& field) const;
+	float band; // of costs a round of a flow field's sweep settles
+	void relax(search_t& search,const flowfield_t& field,size_t cluster,const std::vector<GLuint>& from,float limit,improvements_t& out) const;
+	static void release(flowfield_t* field) { if(!--field->refs) delete field; }
+	void clear_flowfields();
+	void evict_flowfields(size_t keep);
+};
+
+int pathfinder_t::pimpl_t::cluster_t::portal(GLuint p) const {
+	std::vector<GLuint>::const_iterator i = std::lower_bound(portals.begin(),portals.end(),p);
+	if((i == portals.end()) || (*i != p))
+		return -1;
+	return i-portals.begin();
+}
+
+void pathfinder_t::pimpl_t::search_t::reset() {
+	if(!++generation) { // wrapped
+		std::fill(seen.begin(),seen.end(),0);
+		std::fill(done.begin(),done.end(),0);
+		generation = 1;
+	}
+	while(open.size()) open.pop();
+}
+
+float pathfinder_t::pimpl_t::factor(GLuint p) const {
+	switch(planet.types[p]) {
+	case planet_t::LAND: return 1.0f;
+	case planet_t::ICE_FLOW: return 1.5f;
+	case planet_t::ICE: return 2.0f;
+	case planet_t::MOUNTAIN: return 3.0f;
+	default: return -1.0f;
+	}
+}
+
+float pathfinder_t::pimpl_t::cost(GLuint from,GLuint to) const {
+	// symmetric, so that a sweep out from the goal gives the cost of getting to it
+	if(!passable(from) || !passable(to))
+		return -1;
+	const vec_t &a = planet.points[from], &b = planet.points[to];
+	const float run = a.distance(b), rise = fabs(a.magnitude()-b.magnitude());
+	if(rise > run*MAX_SLOPE)
+		return -1;
+	return (run+rise)*(factor(from)+factor(to))/2.0f;
+}
+
+size_t pathfinder_t::pimpl_t::clusters_of(GLuint p,size_t out[6]) const {
+	const planet_t::adjacent_t& adj = planet.adjacent_faces[p];
+	size_t n = 0;
+	for(int i=0; (i<6) && (adj.adj[i] != planet_t::adjacent_t::EMPTY); i++) {
+		const size_t c = planet.mesh_of(adj.adj[i]);
+		if(std::find(out,out+n,c) == out+n)
+			out[n++] = c;
+	}
+	return n;
+}
+
+bool pathfinder_t::pimpl_t::in_cluster(GLuint p,size_t c) const {
+	const planet_t::adjacent_t& adj = planet.adjacent_faces[p];
+	for(int i=0; (i<6) && (adj.adj[i] != planet_t::adjacent_t::EMPTY); i++)
+		if(planet.mesh_of(adj.adj[i]) == c)
+			return true;
+	return false;
+}
+
+void pathfinder_t::pimpl_t::init() {
+	clusters.clear();
+	clusters.resize(planet.meshes.size());
+	for(size_t c=0; c<clusters.size(); c++) {
+		const mesh_t& mesh = *planet.meshes[c];
+		cluster_t& cluster = clusters[c];
+		for(size_t f=mesh.start; f<=mesh.stop; f++) {
+			cluster.points.push_back(planet.faces[f].a);
+			cluster.points.push_back(planet.faces[f].b);
+			cluster.points.push_back(planet.faces[f].c);
+		}
+		std::sort(cluster.points.begin(),cluster.points.end());
+		cluster.points.erase(std::unique(cluster.points.begin(),cluster.points.end()),cluster.points.end());
+		for(std::vector<GLuint>::const_iterator p=cluster.points.begin(); p!=cluster.points.end(); p++) {
+			size_t in[6];
+			const size_t n = clusters_of(*p,in);
+			for(size_t i=0; i<n; i++)
+				if((in[i] != c) && (std::find(cluster.neighbours.begin(),cluster.neighbours.end(),in[i]) == cluster.neighbours.end()))
+					cluster.neighbours.push_back(in[i]);
+		}
+	}
+	for(size_t c=0; c<clusters.size(); c++)
+		init_portals(c);
+	// a round of a flow field's sweep settles about a quarter of a cluster's width at a time
+	float total = 0;
+	size_t steps = 0;
+	for(std::vector<GLuint>::const_iterator p=clusters[0].points.begin(); p!=clusters[0].points.end(); p++) {
+		const planet_t::adjacent_t& adj = planet.adjacent_points[*p];
+		for(int i=0; (i<6) && (adj.adj[i] != planet_t::adjacent_t::EMPTY); i++) {
+			const float step = cost(*p,adj.adj[i]);
+			if(step >= 0) {
+				total += step;
+				steps++;
+			}
+		}
+	}
+	band = (steps? total/steps: 1.0f)*planet.meshes[0]->N/4;
+	#pragma omp parallel
+	{
+		search_t search(planet.points.size());
+		#pragma omp for schedule(dynamic)
+		for(int c=0; c<(int)clusters.size(); c++)
+			init_costs(search,c);
+	}
+}
+
+void pathfinder_t::pimpl_t::border(size_t a,size_t b,std::vector<GLuint>& portals) const {
+	/* the passable points a and b share, split into connected stretches with a portal in
+	the middle of each; only depends on the pair, so both sides agree on the portals */
+	if(a > b) std::swap(a,b);
+	std::vector<GLuint> shared;
+	const std::vector<GLuint>& points = clusters[a].points;
+	for(std::vector<GLuint>::const_iterator p=points.begin(); p!=points.end(); p++)
+		if(passable(*p) && in_cluster(*p,b))
+			shared.push_back(*p);
+	std::vector<int> stretch_of(shared.size(),-1);
+	std::vector<GLuint> stretch;
+	for(size_t s=0; s<shared.size(); s++) {
+		if(stretch_of[s] >= 0) continue;
+		/* walk out to find the stretch s is in; the border is a line, so walking again from
+		the end with fewest neighbours in the stretch visits the points in order */
+		GLuint end = shared[s];
+		int ends = 3;
+		for(int pass=0; pass<2; pass++) {
+			stretch.assign(1,end);
+			stretch_of[std::lower_bound(shared.begin(),shared.end(),end)-shared.begin()] = s*2+pass;
+			for(size_t i=0; i<stretch.size(); i++) {
+				const planet_t::adjacent_t& adj = planet.adjacent_points[stretch[i]];
+				int neighbours = 0;
+				for(int j=0; (j<6) && (adj.adj[j] != planet_t::adjacent_t::EMPTY); j++) {
+					std::vector<GLuint>::const_iterator k = std::lower_bound(shared.begin(),shared.end(),adj.adj[j]);
+					if((k == shared.end()) || (*k != adj.adj[j]) || (cost(stretch[i],*k) < 0))
+						continue;
+					neighbours++;
+					int& in = stretch_of[k-shared.begin()];
+					if(in < (int)(s*2+pass)) {
+						in = s*2+pass;
+						stretch.push_back(*k);
+					}
+				}
+				if(!pass && (neighbours < ends)) {
+					ends = neighbours;
+					end = stretch[i];
+				}
+			}
+		}
+		for(size_t i=0; i<stretch.size(); i+=MAX_ENTRANCE)
+			portals.push_back(stretch[std::min<size_t>(i+MAX_ENTRANCE/2,stretch.size()-1)]);
+	}
+}
+
+void pathfinder_t::pimpl_t::init_portals(size_t c) {
+	cluster_t& cluster = clusters[c];
+	cluster.portals.clear();
+	for(std::vector<size_t>::const_iterator n=cluster.neighbours.begin(); n!=cluster.neighbours.end(); n++)
+		border(c,*n,cluster.portals);
+	std::sort(cluster.portals.begin(),cluster.portals.end());
+	cluster.portals.erase(std::unique(cluster.portals.begin(),cluster.portals.end()),cluster.portals.end());
+}
+
+void pathfinder_t::pimpl_t::init_costs(search_t& search,size_t c) {
+	cluster_t& cluster = clusters[c];
+	const size_t n = cluster.portals.size();
+	cluster.costs.resize(n*n);
+	for(size_t i=0; i<n; i++) {
+		sweep(search,cluster.portals[i],c);
+		for(size_t j=0; j<n; j++)
+			cluster.costs[i*n+j] = search.reached(cluster.portals[j])? search.g[cluster.portals[j]]: -1;
+	}
+}
+
+bool pathfinder_t::pimpl_t::search(search_t& s,GLuint start,GLuint goal,size_t cluster,path_t* path) const {
+	/* A* from start to goal, only stepping on points in cluster unless it is NO_CLUSTER;
+	if goal is ~0 it is a sweep of everywhere reachable, and afterwards s.reached() and s.g say
+	how far away each point is */
+	const bool sweeping = (goal == (GLuint)~0);
+	s.reset();
+	s.g[start] = 0;
+	s.seen[start] = s.generation;
+	s.open.push(search_t::entry_t(sweeping? 0: heuristic(start,goal),start));
+	while(s.open.size()) {
+		const GLuint p = s.open.top().second;
+		s.open.pop();
+		if(s.done[p] == s.generation) continue;
+		s.done[p] = s.generation;
+		if(p == goal) {
+			if(path) {
+				const size_t first = path->size();
+				for(GLuint q=goal; q!=start; q=s.parent[q])
+					path->push_back(q);
+				path->push_back(start);
+				std::reverse(path->begin()+first,path->end());
+			}
+			return true;
+		}
+		const planet_t::adjacent_t& adj = planet.adjacent_points[p];
+		for(int i=0; (i<6) && (adj.adj[i] != planet_t::adjacent_t::EMPTY); i++) {
+			const GLuint q = adj.adj[i];
+			if(s.done[q] == s.generation) continue;
+			if((cluster != (size_t)NO_CLUSTER) && !in_cluster(q,cluster)) continue;
+			const float step = cost(p,q);
+			if(step < 0) continue;
+			const float g = s.g[p]+step;
+			if((s.seen[q] == s.generation) && (s.g[q] <= g)) continue;
+			s.seen[q] = s.generation;
+			s.g[q] = g;
+			s.parent[q] = p;
+			s.open.push(search_t::entry_t(sweeping? g: g+heuristic(q,goal),q));
+		}
+	}
+	return sweeping;
+}
+
+bool pathfinder_t::pimpl_t::find(search_t& s,GLuint start,GLuint goal,path_t& path) const {
+	if(!passable(start) || !passable(goal))
+		return false;
+	if(start == goal) {
+		path.push_back(start);
+		return true;
+	}
+	// join start and goal to the portals of the clusters they are in
+	edges_t from_start, to_goal;
+	size_t in[6];
+	for(size_t i=0, n=clusters_of(start,in); i<n; i++) {
+		const cluster_t& cluster = clusters[in[i]];
+		sweep(s,start,in[i]);
+		for(std::vector<GLuint>::const_iterator p=cluster.portals.begin(); p!=cluster.portals.end(); p++)
+			if(s.reached(*p) && ((from_start[*p].cost < 0) || (s.g[*p] < from_start[*p].cost)))
+				from_start[*p] = edge_t(s.g[*p],in[i]);
+		if(s.reached(goal) && ((from_start[goal].cost < 0) || (s.g[goal] < from_start[goal].cost)))
+			from_start[goal] = edge_t(s.g[goal],in[i]);
+	}
+	for(size_t i=0, n=clusters_of(goal,in); i<n; i++) {
+		const cluster_t& cluster = clusters[in[i]];
+		sweep(s,goal,in[i]);
+		for(std::vector<GLuint>::const_iterator p=cluster.portals.begin(); p!=cluster.portals.end(); p++)
+			if(s.reached(*p) && ((to_goal[*p].cost < 0) || (s.g[*p] < to_goal[*p].cost)))
+				to_goal[*p] = edge_t(s.g[*p],in[i]);
+	}
+	// A* over the portals; the scratch is indexed by point so it serves for portals too
+	s.reset();
+	s.g[start] = 0;
+	s.seen[start] = s.generation;
+	s.open.push(search_t::entry_t(heuristic(start,goal),start));
+	bool found = false;
+	#define RELAX(q,step,cl) { \
+		const float g = s.g[p]+(step); \
+		if((s.done[q] != s.generation) && ((s.seen[q] != s.generation) || (g < s.g[q]))) { \
+			s.seen[q] = s.generation; \
+			s.g[q] = g; s.parent[q] = p; s.via[q] = (cl); \
+			s.open.push(search_t::entry_t(g+heuristic(q,goal),q)); \
+		} \
+	}
+	while(s.open.size()) {
+		const GLuint p = s.open.top().second;
+		s.open.pop();
+		if(s.done[p] == s.generation) continue;
+		s.done[p] = s.generation;
+		if(p == goal) {
+			found = true;
+			break;
+		}
+		if(p == start) {
+			for(edges_t::const_iterator e=from_start.begin(); e!=from_start.end(); e++)
+				if(e->second.cost >= 0)
+					RELAX(e->first,e->second.cost,e->second.cluster);
+			continue;
+		}
+		edges_t::const_iterator e = to_goal.find(p);
+		if((e != to_goal.end()) && (e->second.cost >= 0))
+			RELAX(goal,e->second.cost,e->second.cluster);
+		for(size_t i=0, n=clusters_of(p,in); i<n; i++) {
+			const cluster_t& cluster = clusters[in[i]];
+			const int from = cluster.portal(p);
+			if(from < 0) continue;
+			const size_t count = cluster.portals.size();
+			for(size_t to=0; to<count; to++) {
+				const float step = cluster.costs[from*count+to];
+				if((to != (size_t)from) && (step >= 0))
+					RELAX(cluster.portals[to],step,in[i]);
+			}
+		}
+	}
+	#undef RELAX
+	if(!found)
+		return false;
+	// refine each step within its cluster
+	std::vector<step_t> steps;
+	for(GLuint p=goal; p!=start; p=s.parent[p])
+		steps.push_back(step_t(p,s.via[p]));
+	path.push_back(start);
+	for(std::vector<step_t>::reverse_iterator i=steps.rbegin(); i!=steps.rend(); i++) {
+		const GLuint from = path.back();
+		path.pop_back(); // search puts it back
+		if(!search(s,from,i->point,i->cluster,&path))
+			panic("cannot refine path from " << from << " to " << i->point << " in cluster " << i->cluster);
+	}
+	return true;
+}
+
+void pathfinder_t::pimpl_t::flow(flowfield_t& field) const {
+	/* costs are symmetric, so the tree a sweep out from the goal leaves behind is the way back
+	to it from everywhere.  The sweep is split by cluster so that threads can share it: each
+	round, every cluster in which a point got cheaper carries that on across itself, seeing only
+	what was known when the round began, and the cheapest of what they all find is kept.  Costs
+	only ever fall and every fall is passed on, so it stops where one sweep of the whole planet
+	would.  Rounds only go a band of cost further than the cheapest point not yet carried on,
+	so that clusters do not race ahead along the long way round and have to be redone */
+	std::fill(field.next.begin(),field.next.end(),(GLuint)~0);
+	std::fill(field.cost.begin(),field.cost.end(),-1.0f);
+	if(!passable(field.goal))
+		return;
+	field.next[field.goal] = field.goal;
+	field.cost[field.goal] = 0;
+#ifdef _OPENMP
+	const bool parallel = (omp_get_max_threads() > 1);
+#else
+	const bool parallel = false;
+#endif
+	if(!parallel) { // the rounds redo some points, so alone a plain sweep is quicker
+		search_t s(planet.points.size());
+		sweep(s,field.goal,NO_CLUSTER);
+		for(size_t p=0; p<field.next.size(); p++)
+			if(s.reached(p) && (p != field.goal)) {
+				field.next[p] = s.parent[p];
+				field.cost[p] = s.g[p];
+			}
+		return;
+	}
+	// the points that got cheaper, by the clusters yet to carry them on, and those this round's clusters carry on
+	std::vector<std::vector<GLuint> > from(clusters.size()), seeds;
+	size_t in[6];
+	for(size_t i=0, n=clusters_of(field.goal,in); i<n; i++)
+		from[in[i]].push_back(field.goal);
+	std::vector<size_t> active;
+	std::vector<improvements_t> found;
+	improvements_t round;
+	float limit = 0;
+	#pragma omp parallel
+	{
+		search_t search(planet.points.size());
+		for(;;) {
+			#pragma omp single
+			{
+				// merge what the last round found
+				round.clear();
+				for(size_t i=0; i<found.size(); i++)
+					round.insert(round.end(),found[i].begin(),found[i].end());
+				std::sort(round.begin(),round.end());
+				for(size_t i=0; i<round.size(); i++) {
+					const improved_t& best = round[i];
+					if((i && (round[i-1].point == best.point)) ||
+						((field.cost[best.point] >= 0) && (field.cost[best.point] <= best.cost)))
+						continue;
+					field.next[best.point] = best.next;
+					field.cost[best.point] = best.cost;
+					// the cluster that carried it on is up to date, but the others it is in are not
+					for(size_t j=0, n=clusters_of(best.point,in); j<n; j++)
+						if(!best.expanded || (in[j] != best.cluster))
+							from[in[j]].push_back(best.point);
+				}
+				// and pick the clusters with points in the band
+				float lowest = -1;
+				for(size_t c=0; c<from.size(); c++)
+					for(std::vector<GLuint>::const_iterator p=from[c].begin(); p!=from[c].end(); p++)
+						if((lowest < 0) || (field.cost[*p] < lowest))
+							lowest = field.cost[*p];
+				if(lowest > limit)
+					limit = lowest+band;
+				active.clear();
+				seeds.clear();
+				for(size_t c=0; (lowest >= 0) && (c<from.size()); c++) {
+					std::vector<GLuint> later;
+					for(std::vector<GLuint>::const_iterator p=from[c].begin(); p!=from[c].end(); p++)
+						if(field.cost[*p] <= limit) {
+							if(!active.size() || (active.back() != c)) {
+								active.push_back(c);
+								seeds.push_back(std::vector<GLuint>());
+							}
+							seeds.back().push_back(*p);
+						} else
+							later.push_back(*p);
+					from[c].swap(later);
+				}
+				found.assign(active.size(),improvements_t());
+			}
+			if(active.empty())
+				break;
+			#pragma omp for schedule(dynamic)
+			for(int i=0; i<(int)active.size(); i++)
+				relax(search,field,active[i],seeds[i],limit,found[i]);
+		}
+	}
+}
+
+void pathfinder_t::pimpl_t::relax(search_t& s,const flowfield_t& field,size_t c,const std::vector<GLuint>& from,float limit,improvements_t& out) const {
+	// a sweep within the cluster out from the points that got cheaper, only going where it makes things cheaper still
+	s.reset();
+	for(std::vector<GLuint>::const_iterator p=from.begin(); p!=from.end(); p++) {
+		s.g[*p] = field.cost[*p];
+		s.parent[*p] = field.next[*p];
+		s.seen[*p] = s.generation;
+		s.open.push(search_t::entry_t(s.g[*p],*p));
+	}
+	while(s.open.size()) {
+		const GLuint p = s.open.top().second;
+		s.open.pop();
+		if(s.done[p] == s.generation) continue;
+		s.done[p] = s.generation;
+		const bool expand = (s.g[p] <= limit);
+		if((field.cost[p] < 0) || (s.g[p] < field.cost[p]))
+			out.push_back(improved_t(p,s.parent[p],s.g[p],c,expand));
+		if(!expand) continue; // it and everything after it are left for a later round
+		const planet_t::adjacent_t& adj = planet.adjacent_points[p];
+		for(int i=0; (i<6) && (adj.adj[i] != planet_t::adjacent_t::EMPTY); i++) {
+			const GLuint q = adj.adj[i];
+			if((s.done[q] == s.generation) || !in_cluster(q,c)) continue;
+			const float step = cost(p,q);
+			if(step < 0) continue;
+			const float g = s.g[p]+step, known = (s.seen[q] == s.generation)? s.g[q]: field.cost[q];
+			if((known >= 0) && (known <= g)) continue;
+			s.seen[q] = s.generation;
+			s.g[q] = g;
+			s.parent[q] = p;
+			s.open.push(search_t::entry_t(g,q));
+		}
+	}
+}
+
+void pathfinder_t::pimpl_t::clear_flowfields() {
+	for(flowfields_t::iterator i=flowfields.begin(); i!=flowfields.end(); i++)
+		release(i->second);
+	flowfields.clear();
+}
+
+void pathfinder_t::pimpl_t::evict_flowfields(size_t keep) {
+	while(flowfields.size() > keep) {
+		flowfields_t::iterator oldest = flowfields.begin();
+		for(flowfields_t::iterator i=flowfields.begin(); i!=flowfields.end(); i++)
+			if(i->second->used < oldest->second->used)
+				oldest = i;
+		release(oldest->second);
+		flowfields.erase(oldest);
+	}
+}
+
+pathfinder_t::pathfinder_t(const planet_t& planet): pimpl(new pimpl_t(planet)) {
+	pimpl->init();
+}
+
+pathfinder_t::~pathfinder_t() {
+	delete pimpl;
+}
+
+bool pathfinder_t::find(GLuint start,GLuint goal,path_t& path) const {
+	pimpl_t::search_t search(pimpl->planet.points.size());
+	return pimpl->find(search,start,goal,path);
+}
+
+bool pathfinder_t::find_direct(GLuint start,GLuint goal,path_t& path) const {
+	if(!pimpl->passable(start) || !pimpl->passable(goal))
+		return false;
+	pimpl_t::search_t search(pimpl->planet.points.size());
+	return pimpl->search(search,start,goal,NO_CLUSTER,&path);
+}
+
+void pathfinder_t::find(requests_t& requests) const {
+	#pragma omp parallel
+	{
+		pimpl_t::search_t search(pimpl->planet.points.size());
+		#pragma omp for schedule(dynamic,4)
+		for(int i=0; i<(int)requests.size(); i++) {
+			request_t& request = requests[i];
+			request.path.clear();
+			request.found = pimpl->find(search,request.start,request.goal,request.path);
+		}
+	}
+}
+
+float pathfinder_t::cost(GLuint from,GLuint to) const {
+	return pimpl->cost(from,to);
+}
+
+float pathfinder_t::cost(const path_t& path) const {
+	float total = 0;
+	for(size_t i=1; i<path.size(); i++)
+		total += pimpl->cost(path[i-1],path[i]);
+	return total;
+}
+
+pathfinder_t::flowfield_ptr_t::flowfield_ptr_t(flowfield_t* f): field(f) {
+	field->refs++;
+}
+
+pathfinder_t::flowfield_ptr_t::flowfield_ptr_t(const flowfield_ptr_t& copy): field(copy.field) {
+	if(field)
+		field->refs++;
+}
+
+pathfinder_t::flowfield_ptr_t& pathfinder_t::flowfield_ptr_t::operator=(const flowfield_ptr_t& copy) {
+	if(copy.field)
+		copy.field->refs++;
+	reset();
+	field = copy.field;
+	return *this;
+}
+
+pathfinder_t::flowfield_ptr_t::~flowfield_ptr_t() {
+	reset();
+}
+
+void pathfinder_t::flowfield_ptr_t::reset() {
+	if(field)
+		pimpl_t::release(field);
+	field = NULL;
+}
+
+pathfinder_t::flowfield_ptr_t pathfinder_t::flowfield(GLuint goal) const {
+	pimpl_t::flowfields_t::iterator i = pimpl->flowfields.find(goal);
+	if(i == pimpl->flowfields.end()) {
+		flowfields(std::vector<GLuint>(1,goal));
+		i = pimpl->flowfields.find(goal);
+	}
+	i->second->used = ++pimpl->flowfields_used;
+	return flowfield_ptr_t(i->second);
+}
+
+void pathfinder_t::flowfields(const std::vector<GLuint>& goals) const {
+	std::vector<flowfield_t*> todo;
+	for(std::vector<GLuint>::const_iterator g=goals.begin(); g!=goals.end(); g++) {
+		flowfield_t*& field = pimpl->flowfields[*g];
+		if(!field) {
+			field = new flowfield_t(*g,pimpl->planet.points.size());
+			todo.push_back(field);
+		}
+		field->used = ++pimpl->flowfields_used;
+	}
+	for(size_t i=0; i<todo.size(); i++)
+		pimpl->flow(*todo[i]);
+	pimpl->evict_flowfields(std::max<size_t>(MAX_FLOWFIELDS,goals.size()));
+}
+
+void pathfinder_t::moved(const std::set<size_t>& meshes) {
+	// the portals on every border of a changed cluster may move, so its neighbours are redone too
+	std::set<size_t> redo(meshes);
+	for(std::set<size_t>::const_iterator c=meshes.begin(); c!=meshes.end(); c++)
+		redo.insert(pimpl->clusters[*c].neighbours.begin(),pimpl->clusters[*c].neighbours.end());
+	for(std::set<size_t>::const_iterator c=redo.begin(); c!=redo.end(); c++)
+		pimpl->init_portals(*c);
+	pimpl_t::search_t search(pimpl->planet.points.size());
+	for(std::set<size_t>::const_iterator c=redo.begin(); c!=redo.end(); c++)
+		pimpl->init_costs(search,*c);
+	// a change anywhere can open or close a shorter way to any goal
+	pimpl->clear_flowfields();
+}
+
+void pathfinder_t::benchmark() {
+	enum { TICKS = 10, REQUESTS = 256, DIRECT = 32 };
+	const planet_t& planet = pimpl->planet;
+	uint64_t start = high_precision_time();
+	pimpl->init();
+	uint64_t ns = high_precision_time()-start;
+	size_t portals = 0;
+	for(size_t c=0; c<pimpl->clusters.size(); c++)
+		portals += pimpl->clusters[c].portals.size();
+	std::cout << "pathfinder: " << planet.points.size() << " points, " << pimpl->clusters.size() <<
+		" clusters, " << portals << " portals (shared portals counted per cluster), built in " <<
+		ns << " ns" << std::endl;
+	std::vector<GLuint> land;
+	for(size_t p=0; p<planet.points.size(); p++)
+		if(pimpl->passable(p))
+			land.push_back(p);
+	if(land.size() < 2) {
+		std::cout << "pathfinder: nowhere to go" << std::endl;
+		return;
+	}
+	requests_t requests;
+	size_t found = 0, length = 0;
+	ns = 0;
+	for(int tick=0; tick<TICKS; tick++) {
+		requests.clear();
+		for(int i=0; i<REQUESTS; i++)
+			requests.push_back(request_t(land[rand()%land.size()],land[rand()%land.size()]));
+		start = high_precision_time();
+		find(requests);
+		ns += high_precision_time()-start;
+		for(requests_t::const_iterator r=requests.begin(); r!=requests.end(); r++)
+			if(r->found) {
+				found++;
+				length += r->path.size();
+			}
+	}
+	std::cout << "pathfinder: " << TICKS << " ticks of " << REQUESTS << " requests, " << found <<
+		" found (" << (found? length/found: 0) << " points long on average), " << (ns/TICKS) <<
+		" ns/tick (" << (uint64_t)(TICKS*REQUESTS*1000000000.0/ns) << "/sec)" << std::endl;
+	// compare the last tick's first few with plain A*
+	float hierarchical = 0, direct = 0;
+	size_t compared = 0, disagree = 0;
+	start = high_precision_time();
+	for(int i=0; i<DIRECT; i++) {
+		path_t path;
+		const bool ok = find_direct(requests[i].start,requests[i].goal,path);
+		if(ok != requests[i].found)
+			disagree++;
+		else if(ok) {
+			compared++;
+			direct += cost(path);
+			hierarchical += cost(requests[i].path);
+		}
+	}
+	ns = high_precision_time()-start;
+	std::cout << "pathfinder: plain A* " << DIRECT << " requests, " << ns << " ns (" <<
+		(uint64_t)(DIRECT*1000000000.0/ns) << "/sec), " << disagree << " disagree on reachability, " <<
+		"hierarchical paths cost " << (direct? hierarchical/direct: 1) << "x as much" << std::endl;
+	// flow fields
+	enum { GOALS = 8, UNITS = 1000 };
+	pimpl->clear_flowfields();
+	std::vector<GLuint> goals;
+	for(int i=0; i<GOALS; i++)
+		goals.push_back(land[rand()%land.size()]);
+	start = high_precision_time();
+	const flowfield_ptr_t field = flowfield(goals[0]);
+	ns = high_precision_time()-start;
+	start = high_precision_time();
+	flowfields(goals);
+	const uint64_t batch_ns = high_precision_time()-start;
+	// walk units down the field, checking that what they pay is what the field said
+	size_t arrived = 0, steps = 0, wrong = 0;
+	start = high_precision_time();
+	for(int i=0; i<UNITS; i++) {
+		GLuint p = land[rand()%land.size()];
+		if(!field->reachable(p)) continue;
+		const float expected = field->cost[p];
+		float paid = 0;
+		while(p != field->goal) {
+			const GLuint q = field->step(p);
+			paid += cost(p,q);
+			p = q;
+			steps++;
+		}
+		arrived++;
+		if(fabs(paid-expected) > expected*0.001f)
+			wrong++;
+	}
+	const uint64_t walk_ns = high_precision_time()-start;
+	std::cout << "pathfinder: flow field in " << ns << " ns, " << (GOALS-1) << " more in " <<
+		batch_ns << " ns; " << arrived << " of " << UNITS << " units walked " << steps << " steps in " <<
+		walk_ns << " ns, " << wrong << " paid other than the field said" << std::endl;
+}
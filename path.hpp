@@ -0,0 +1,75 @@
+/*
+ path.hpp is part of the GlestNG RTS game engine.
+ Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE version 3
+ See LICENSE for details
+ (c) William Edwards, 2011; all rights reserved
+*/
+
+#ifndef __PATH_HPP__
+#define __PATH_HPP__
+
+#include <vector>
+#include <set>
+
+#include "graphics.hpp"
+
+struct planet_t;
+
+/* hierarchical A* over the points of a planet; each mesh_t is a cluster, and portals
+are picked along the passable stretches of the borders clusters share.  Searches run
+over the portals first and are then refined within each cluster they cross */
+struct pathfinder_t {
+	pathfinder_t(const planet_t& planet);
+	~pathfinder_t();
+	typedef std::vector<GLuint> path_t; // points, start and goal inclusive
+	bool find(GLuint start,GLuint goal,path_t& path) const;
+	bool find_direct(GLuint start,GLuint goal,path_t& path) const; // plain A*, for comparison
+	struct request_t {
+		request_t(GLuint s,GLuint g): start(s), goal(g), found(false) {}
+		GLuint start, goal;
+		path_t path;
+		bool found;
+	};
+	typedef std::vector<request_t> requests_t;
+	void find(requests_t& requests) const; // in parallel
+	float cost(GLuint from,GLuint to) const; // of a step between adjacent points; negative if impassable
+	float cost(const path_t& path) const;
+	/* for groups heading to the same place; one sweep out from the goal says which way
+	to step from every point, and fields are kept until the terrain changes */
+	struct flowfield_t {
+		flowfield_t(GLuint g,size_t points): goal(g), next(points), cost(points), refs(1) {}
+		const GLuint goal;
+		std::vector<GLuint> next; // the adjacent point to step to; ~0 if the goal cannot be reached
+		std::vector<float> cost; // of getting to the goal
+		bool reachable(GLuint from) const { return next[from] != (GLuint)~0; }
+		GLuint step(GLuint from) const { return next[from]; }
+		unsigned used;
+		unsigned refs; // the cache's, if it still has it, and each handle's
+	};
+	class flowfield_ptr_t { // keeps a field alive whilst held, even once the cache has dropped it
+	public:
+		flowfield_ptr_t(): field(NULL) {}
+		flowfield_ptr_t(const flowfield_ptr_t& copy);
+		flowfield_ptr_t& operator=(const flowfield_ptr_t& copy);
+		~flowfield_ptr_t();
+		bool is_set() const { return field != NULL; }
+		const flowfield_t* operator->() const { return field; }
+		const flowfield_t& operator*() const { return *field; }
+		void reset();
+	private:
+		friend struct pathfinder_t;
+		explicit flowfield_ptr_t(flowfield_t* field); // counts it
+		flowfield_t* field;
+	};
+	/* handles are counted unlocked, so only the thread that asks for fields should copy them;
+	a field held when the terrain changes is still whole, but stale */
+	flowfield_ptr_t flowfield(GLuint goal) const;
+	void flowfields(const std::vector<GLuint>& goals) const; // makes those not yet cached; each sweep is in parallel
+	void moved(const std::set<size_t>& meshes); // the terrain in these meshes has changed
+	void benchmark(); // prints timings to stdout
+private:
+	struct pimpl_t;
+	pimpl_t* pimpl;
+};
+
+#endif //__PATH_HPP__
@@ -0,0 +1,277 @@
+/*
+ placement.cpp is part of the GlestNG RTS game engine.
+ Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE version 3
+ See LICENSE for details
+ (c) William Edwards, 2011; all rights reserved
+*/
+
+#include <vector>
+#include <set>
+#include <algorithm>
+#include <iostream>
+#include <stdlib.h>
+#include <math.h>
+
+#include "placement.hpp"
+#include "planet.hpp"
+#include "unit.hpp"
+#include "error.hpp"
+
+enum {
+	MAX_SIZE = 8, // cellmaps are 8x8 at most
+	MAX_SEARCH = 4096, // points looked at per query before giving up
+};
+
+static const float BUILD_SLOPE = 0.25f; // rise over run
+
+struct placement_t::pimpl_t {
+	pimpl_t(const planet_t& p): planet(p) {}
+	const planet_t& planet;
+	struct region_t { // a mesh; bit i of row j is lattice point (i,j)
+		std::vector<uint64_t> unbuildable, occupied; // padded with MAX_SIZE full rows so footprints can hang off the end
+	};
+	std::vector<region_t> regions;
+	struct cell_t { // where a point is in a mesh's lattice; points on borders are in more than one
+		cell_t(size_t m,int i_,int j_): mesh(m), i(i_), j(j_) {}
+		uint32_t mesh;
+		uint8_t i, j;
+	};
+	std::vector<size_t> first_cell; // the cells of point p are [first_cell[p],first_cell[p+1])
+	std::vector<cell_t> cells;
+	static uint64_t row(uint64_t cellmap,int size,int y) { return (cellmap >> (y*8)) & ((1 << size)-1); }
+	bool buildable(GLuint p) const;
+	void init();
+	void update(GLuint p);
+	void set(std::vector<uint64_t> region_t::*rows,GLuint p,bool on);
+	bool fits_slow(const site_t& site,uint64_t cellmap,int size) const; // for checking
+};
+
+bool placement_t::pimpl_t::buildable(GLuint p) const {
+	if(planet.types[p] != planet_t::LAND)
+		return false;
+	const vec_t& a = planet.points[p];
+	const float height = a.magnitude();
+	const planet_t::adjacent_t& adj = planet.adjacent_points[p];
+	for(int i=0; (i<6) && (adj.adj[i] != planet_t::adjacent_t::EMPTY); i++) {
+		const vec_t& b = planet.points[adj.adj[i]];
+		if(fabs(height-b.magnitude()) > a.distance(b)*BUILD_SLOPE)
+			return false;
+	}
+	return true;
+}
+
+void placement_t::pimpl_t::init() {
+	const size_t points = planet.points.size();
+	first_cell.assign(points+1,0);
+	for(size_t m=0; m<planet.meshes.size(); m++) {
+		const mesh_t& mesh = *planet.meshes[m];
+		if(mesh.N+MAX_SIZE > 64)
+			panic("mesh lattice of " << mesh.N << " is too big for placement rows");
+		for(int j=0; j<=mesh.N; j++)
+			for(int i=0; i<=mesh.N-j; i++)
+				first_cell[mesh.lattice_at(i,j)+1]++;
+	}
+	for(size_t p=0; p<points; p++)
+		first_cell[p+1] += first_cell[p];
+	cells.assign(first_cell[points],cell_t(0,0,0));
+	std::vector<size_t> next(first_cell.begin(),first_cell.end()-1);
+	regions.resize(planet.meshes.size());
+	for(size_t m=0; m<planet.meshes.size(); m++) {
+		const mesh_t& mesh = *planet.meshes[m];
+		region_t& region = regions[m];
+		region.unbuildable.assign(mesh.N+1+MAX_SIZE,~uint64_t(0));
+		region.occupied.assign(mesh.N+1+MAX_SIZE,0);
+		for(int j=0; j<=mesh.N; j++) {
+			region.unbuildable[j] = ~((uint64_t(2) << (mesh.N-j))-1); // off the end of the row
+			for(int i=0; i<=mesh.N-j; i++)
+				cells[next[mesh.lattice_at(i,j)]++] = cell_t(m,i,j);
+		}
+	}
+	for(size_t p=0; p<points; p++)
+		update(p);
+}
+
+void placement_t::pimpl_t::set(std::vector<uint64_t> region_t::*rows,GLuint p,bool on) {
+	for(size_t c=first_cell[p]; c<first_cell[p+1]; c++) {
+		const cell_t& cell = cells[c];
+		uint64_t& bits = (regions[cell.mesh].*rows)[cell.j];
+		if(on)
+			bits |= uint64_t(1) << cell.i;
+		else
+			bits &= ~(uint64_t(1) << cell.i);
+	}
+}
+
+void placement_t::pimpl_t::update(GLuint p) {
+	set(&region_t::unbuildable,p,!buildable(p));
+}
+
+bool placement_t::pimpl_t::fits_slow(const site_t& site,uint64_t cellmap,int size) const {
+	const mesh_t& mesh = *planet.meshes[site.mesh];
+	const region_t& region = regions[site.mesh];
+	for(int y=0; y<size; y++)
+		for(int x=0; x<size; x++) {
+			if(!(cellmap & ((uint64_t(1) << x) << (y*8))))
+				continue;
+			const int i = site.i+x, j = site.j+y;
+			if(i+j > mesh.N)
+				return false;
+			const GLuint p = mesh.lattice_at(i,j);
+			if(!buildable(p) || (region.occupied[j] & (uint64_t(1) << i)))
+				return false;
+		}
+	return true;
+}
+
+placement_t::placement_t(const planet_t& planet): pimpl(new pimpl_t(planet)) {
+	pimpl->init();
+}
+
+placement_t::~placement_t() {
+	delete pimpl;
+}
+
+bool placement_t::site_at(const vec_t& dir,int size,site_t& site) const {
+	const GLuint p = pimpl->planet.nearest_point(dir);
+	for(size_t c=pimpl->first_cell[p]; c<pimpl->first_cell[p+1]; c++) {
+		const pimpl_t::cell_t& cell = pimpl->cells[c];
+		const int i = cell.i-size/2, j = cell.j-size/2;
+		if((i >= 0) && (j >= 0)) {
+			site = site_t(cell.mesh,i,j);
+			return true;
+		}
+	}
+	return false;
+}
+
+bool placement_t::fits(const site_t& site,uint64_t cellmap,int size) const {
+	if((site.mesh >= pimpl->regions.size()) || (site.i < 0) || (site.j < 0) || (size > MAX_SIZE))
+		return false;
+	const pimpl_t::region_t& region = pimpl->regions[site.mesh];
+	if(site.j >= (int)region.unbuildable.size()-MAX_SIZE)
+		return false;
+	for(int y=0; y<size; y++) {
+		const uint64_t footprint = pimpl_t::row(cellmap,size,y) << site.i;
+		if(footprint & (region.unbuildable[site.j+y] | region.occupied[site.j+y]))
+			return false;
+	}
+	return true;
+}
+
+bool placement_t::fits(const site_t& site,const unit_type_t& type) const {
+	return fits(site,type.get_cellmap(),type.get_size());
+}
+
+void placement_t::occupy(const site_t& site,uint64_t cellmap,int size,bool occupied) {
+	const mesh_t& mesh = *pimpl->planet.meshes[site.mesh];
+	for(int y=0; y<size; y++)
+		for(int x=0; x<size; x++)
+			if((cellmap & ((uint64_t(1) << x) << (y*8))) && (site.i+x+site.j+y <= mesh.N))
+				pimpl->set(&pimpl_t::region_t::occupied,mesh.lattice_at(site.i+x,site.j+y),occupied);
+}
+
+void placement_t::occupy(const site_t& site,const unit_type_t& type,bool occupied) {
+	occupy(site,type.get_cellmap(),type.get_size(),occupied);
+}
+
+vec_t placement_t::centre(const site_t& site,uint64_t cellmap,int size) const {
+	const mesh_t& mesh = *pimpl->planet.meshes[site.mesh];
+	vec_t centre(0,0,0);
+	int count = 0;
+	for(int y=0; y<size; y++)
+		for(int x=0; x<size; x++)
+			if((cellmap & ((uint64_t(1) << x) << (y*8))) && (site.i+x+site.j+y <= mesh.N)) {
+				centre += pimpl->planet.points[mesh.lattice_at(site.i+x,site.j+y)];
+				count++;
+			}
+	return count? centre/count: centre;
+}
+
+placement_t::query_t::query_t(const vec_t& n,const unit_type_t& type,size_t count):
+	near(n), cellmap(type.get_cellmap()), size(type.get_size()), wanted(count) {}
+
+void placement_t::find_sites(query_t& query) const {
+	// breadth-first out from the nearest point, trying the footprint centred on each
+	query.sites.clear();
+	std::vector<GLuint> queue(1,pimpl->planet.nearest_point(query.near));
+	std::set<GLuint> seen(queue.begin(),queue.end());
+	for(size_t q=0; (q<queue.size()) && (q<MAX_SEARCH) && (query.sites.size()<query.wanted); q++) {
+		const GLuint p = queue[q];
+		for(size_t c=pimpl->first_cell[p]; c<pimpl->first_cell[p+1]; c++) {
+			const pimpl_t::cell_t& cell = pimpl->cells[c];
+			const site_t site(cell.mesh,cell.i-query.size/2,cell.j-query.size/2);
+			if(fits(site,query.cellmap,query.size)) {
+				query.sites.push_back(site);
+				break;
+			}
+		}
+		const planet_t::adjacent_t& adj = pimpl->planet.adjacent_points[p];
+		for(int i=0; (i<6) && (adj.adj[i] != planet_t::adjacent_t::EMPTY); i++)
+			if(seen.insert(adj.adj[i]).second)
+				queue.push_back(adj.adj[i]);
+	}
+}
+
+void placement_t::find_sites(queries_t& queries) const {
+	#pragma omp parallel for schedule(dynamic)
+	for(int i=0; i<(int)queries.size(); i++)
+		find_sites(queries[i]);
+}
+
+void placement_t::moved(const std::set<size_t>& meshes) {
+	for(std::set<size_t>::const_iterator m=meshes.begin(); m!=meshes.end(); m++) {
+		const mesh_t& mesh = *pimpl->planet.meshes[*m];
+		for(size_t p=0; p<mesh.lattice.size(); p++)
+			pimpl->update(mesh.lattice[p]);
+	}
+}
+
+void placement_t::benchmark() {
+	enum { FITS = 1000000, CHECKS = 10000, QUERIES = 64, WANTED = 8, SIZE = 3 };
+	const planet_t& planet = pimpl->planet;
+	uint64_t start = high_precision_time();
+	pimpl->init();
+	uint64_t ns = high_precision_time()-start;
+	std::cout << "placement: index of " << pimpl->cells.size() << " cells built in " << ns << " ns" << std::endl;
+	std::vector<site_t> sites(FITS);
+	for(size_t i=0; i<sites.size(); i++) {
+		const size_t m = rand()%planet.meshes.size();
+		const int N = planet.meshes[m]->N;
+		sites[i] = site_t(m,rand()%(N+1),rand()%(N+1));
+	}
+	const uint64_t square = 0x0707070707070707ULL; // 3x3
+	size_t fit = 0;
+	start = high_precision_time();
+	for(size_t i=0; i<sites.size(); i++)
+		fit += fits(sites[i],square,SIZE);
+	ns = high_precision_time()-start;
+	size_t disagree = 0;
+	for(size_t i=0; i<CHECKS; i++)
+		if(fits(sites[i],square,SIZE) != pimpl->fits_slow(sites[i],square,SIZE))
+			disagree++;
+	std::cout << "placement: " << FITS << " footprint tests, " << fit << " fit, " << ns << " ns (" <<
+		(uint64_t)(FITS*1000000000.0/ns) << "/sec), " << disagree << " of " << CHECKS <<
+		" disagree with testing cell by cell" << std::endl;
+	queries_t queries;
+	for(int i=0; i<QUERIES; i++)
+		queries.push_back(query_t(planet.points[rand()%planet.points.size()],square,SIZE,WANTED));
+	start = high_precision_time();
+	find_sites(queries);
+	ns = high_precision_time()-start;
+	size_t found = 0;
+	for(queries_t::const_iterator q=queries.begin(); q!=queries.end(); q++)
+		found += q->sites.size();
+	// taking a site must stop it fitting, and giving it back must free it again
+	bool occupancy = true;
+	for(queries_t::const_iterator q=queries.begin(); q!=queries.end(); q++)
+		if(q->sites.size()) {
+			const site_t& site = q->sites[0];
+			occupy(site,square,SIZE);
+			occupancy = occupancy && !fits(site,square,SIZE);
+			occupy(site,square,SIZE,false);
+			occupancy = occupancy && fits(site,square,SIZE);
+			break;
+		}
+	std::cout << "placement: " << QUERIES << " queries for " << WANTED << " sites found " << found <<
+		" in " << ns << " ns; occupancy " << (occupancy? "ok": "BROKEN") << std::endl;
+}
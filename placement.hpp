@@ -0,0 +1,58 @@
+/*
+ placement.hpp is part of the GlestNG RTS game engine.
+ Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE version 3
+ See LICENSE for details
+ (c) William Edwards, 2011; all rights reserved
+*/
+
+#ifndef __PLACEMENT_HPP__
+#define __PLACEMENT_HPP__
+
+#include <vector>
+#include <set>
+#include <inttypes.h>
+
+#include "3d.hpp"
+
+struct planet_t;
+class unit_type_t;
+
+/* where buildings can go; each mesh_t lattice row is a bitmask of points that cannot be
+built on and of points that are taken, so a footprint is tested a row at a time by
+ANDing the unit_type_t cellmap against them.  A cellmap row runs along the lattice
+rows, so on the planet a square footprint is a 60 degree rhombus */
+struct placement_t {
+	placement_t(const planet_t& planet);
+	~placement_t();
+	struct site_t { // cell (0,0) of a footprint is lattice point (i,j) of the mesh
+		site_t(): mesh(~0), i(0), j(0) {}
+		site_t(size_t m,int i_,int j_): mesh(m), i(i_), j(j_) {}
+		size_t mesh;
+		int i, j;
+	};
+	bool site_at(const vec_t& dir,int size,site_t& site) const; // the footprint centred on dir
+	bool fits(const site_t& site,uint64_t cellmap,int size) const;
+	bool fits(const site_t& site,const unit_type_t& type) const;
+	void occupy(const site_t& site,uint64_t cellmap,int size,bool occupied=true);
+	void occupy(const site_t& site,const unit_type_t& type,bool occupied=true);
+	vec_t centre(const site_t& site,uint64_t cellmap,int size) const; // of the points it covers
+	struct query_t { // for the AI; sites nearest first, and they may overlap each other
+		query_t(const vec_t& n,uint64_t c,int s,size_t count): near(n), cellmap(c), size(s), wanted(count) {}
+		query_t(const vec_t& n,const unit_type_t& type,size_t count);
+		vec_t near;
+		uint64_t cellmap;
+		int size;
+		size_t wanted;
+		std::vector<site_t> sites;
+	};
+	typedef std::vector<query_t> queries_t;
+	void find_sites(query_t& query) const;
+	void find_sites(queries_t& queries) const; // in parallel
+	void moved(const std::set<size_t>& meshes); // the terrain in these meshes has changed
+	void benchmark(); // prints timings to stdout
+private:
+	struct pimpl_t;
+	pimpl_t* pimpl;
+};
+
+#endif //__PLACEMENT_HPP__
@@ -7,110 +7,129 @@
 
 #include <vector>
 #include <map>
+#include <set>
 #include <algorithm>
 #include <math.h>
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <stddef.h>
 #include <time.h>
 #include <iostream>
 
 #include "memcheck.h"
-#include "terrain.hpp"
-#include "graphics.hpp"
-#include "world.hpp"
-#include "utils.hpp"
+#include "planet.hpp"
+#include "path.hpp"
+#include "placement.hpp"
+#include "surface.hpp"
+#include "sight.hpp"
+#include "fog.hpp"
+#include "noise.hpp"
+#include "roads.hpp"
+#include "settlement.hpp"
+#include "loader.hpp"
 #include "error.hpp"
 
-enum {
-	DIVIDE_THRESHOLD = 4,
-	FACE_IDX = 18, // how much to shift to get the ID of the mesh the face belongs to?
-	FACE_MASK = (1<<FACE_IDX)-1,
+/* the surface generated over a mesh beyond the planet's simulated level, a point at a time.  Each
+simulated facet is subdivided, and raised by noise with an octave a level; the raising tapers to
+nothing at the mesh's edges, which so stay exactly on the simulated edges and meet neighbours
+drawn at any level without cracks.  The corners' weights are powers of two, and the edges only
+ever sum two of them, so both meshes that share an edge make bit-identical points along it.
+Drawing and surface_at both make their points here, so that what is stood on is what is drawn */
+struct detail_surface_t {
+	detail_surface_t(int N,size_t levels,const vec_t& a,const vec_t& b,const noise_t& noise); // a and b neighbour in the mesh's lattice
+	const int N, M, S; // segments along an edge of the mesh, and of its detail; and detail segments in a simulated one
+	const float edge, frequency, relief;
+	const size_t octaves;
+	const noise_t& noise;
+	void corners(int i,int j,int c[3],int w[3]) const; // the simulated points around (i,j), as indices into the mesh's lattice, and their weights in S-ths
+	float taper(int i,int j) const { return std::min(1.0f,(float)std::min(std::min(i,j),M-i-j)/S); }
+	float most() const { return relief*2.2f; } // it is raised or lowered; noise stays within about 1.1, and the octaves' amplitudes sum to under 2
+	vec_t point(int i,int j,const int w[3],const vec_t corner[3],const planet_t::type_t type[3]) const; // given those corners' points and types
 };
 
-struct rgb_t {
-	rgb_t() {}
-	rgb_t(GLubyte r_,GLubyte g_,GLubyte b_): r(r_), g(g_), b(b_) {}
-	GLubyte r,g,b;
-};
+detail_surface_t::detail_surface_t(int n,size_t levels,const vec_t& a,const vec_t& b,const noise_t& n_):
+	N(n), M(n << levels), S(1 << levels),
+	edge(vec_t::normalise(a).distance(vec_t::normalise(b))),
+	frequency(0.5f/edge), // a bump every two simulated segments
+	relief(edge*0.25f),
+	octaves(levels),
+	noise(n_)
+{}
 
-struct planet_t;
-
-struct mesh_t: public object_t {
-	mesh_t(planet_t& planet,face_t tri,size_t recursionLevel);
-	void calc_bounds();
-	void draw(float d);
-	bool refine_intersection(const ray_t& r,vec_t& I);
-	planet_t& planet;
-	const GLuint ID;
-	GLuint mn_point, mx_point;
-	size_t start, stop;
-#ifdef USE_GL
-	GLuint faces;
-	void init_gl();
-#endif
-};
+void detail_surface_t::corners(int i,int j,int c[3],int w[3]) const {
+	const int ci = i/S, cj = j/S, fi = i%S, fj = j%S;
+	if(fi+fj <= S) {
+		c[0] = grid_t::index(N,ci,cj); w[0] = S-fi-fj;
+		c[1] = fi? grid_t::index(N,ci+1,cj): c[0]; w[1] = fi;
+		c[2] = fj? grid_t::index(N,ci,cj+1): c[0]; w[2] = fj;
+	} else {
+		c[0] = grid_t::index(N,ci+1,cj+1); w[0] = fi+fj-S;
+		c[1] = grid_t::index(N,ci+1,cj); w[1] = S-fj;
+		c[2] = grid_t::index(N,ci,cj+1); w[2] = S-fi;
+	}
+}
 
-struct planet_t: public terrain_t {
-	planet_t	(size_t recursionLevel,size_t iterations,size_t smoothing_passes);
-	~planet_t();
-	void intersection(const ray_t& r,test_hits_t& hits) const;
-	bool surface_at(const vec_t& normal,vec_t& pt) const;
-	static size_t num_points(size_t recursionLevel);
-	static size_t num_faces(size_t recursionLevel);
-	GLuint midpoint(GLuint a,GLuint b);
-	GLuint find_face(GLuint a,GLuint b,GLuint c);
-	void draw_init();
-	void draw_done();
-	void draw();
-	void divide(const face_t& tri,size_t recursionLevel,size_t depth);
-	void gen(size_t iterations,size_t smoothing_passes);
-	bool intersection(int x,int y,vec_t& pt);
-	typedef std::map<uint64_t,GLuint> midpoints_t;
-	midpoints_t midpoints;
-	typedef std::vector<mesh_t*> meshes_t;
-	meshes_t meshes;
-	fixed_array_t<vec_t> points;
-	fixed_array_t<vec_t> normals;
-	fixed_array_t<rgb_t> colours;
-	fixed_array_t<face_t> faces;
-	struct adjacent_t {
-		adjacent_t();
-		size_t size() const;
-		GLuint adj[6];
-		void add(GLuint neighbour);
-		adjacent_t& operator-=(adjacent_t a);
-		static const GLuint EMPTY = ~0; 
-	};
-	fixed_array_t<adjacent_t> adjacent_faces;
-	fixed_array_t<adjacent_t> adjacent_points;
-	static const float
-		WATER_LEVEL = 0.85f,
-		MOUNTAIN_LEVEL = 0.95f;
-	enum type_t {
-		WATER,
-		ICE,
-		LAND,
-		MOUNTAIN,
-		ICE_FLOW,
-	};
-	fixed_array_t<type_t> types;
-	vec_t sun;
-#ifdef USE_GL
-	struct {
-		GLuint points, normals, colours; 
-	} vbo;
-	void init_gl();
-#endif
+vec_t detail_surface_t::point(int i,int j,const int w[3],const vec_t corner[3],const planet_t::type_t type[3]) const {
+	vec_t pt(0,0,0);
+	float land = 0;
+	for(int k=0; k<3; k++) {
+		const float f = (float)w[k]/S;
+		pt += corner[k]*f;
+		if(type[k] != planet_t::WATER && type[k] != planet_t::ICE)
+			land += f;
+	}
+	if(w[0] == S) // a simulated point
+		return pt;
+	const vec_t dir = vec_t::normalise(pt);
+	const float raise = taper(i,j)*land*relief*noise.octaves(dir*frequency,octaves);
+	if(raise)
+		pt += dir*raise;
+	if(pt.magnitude_sqrd() > 1.0f) // the packing only reaches the unit sphere
+		pt = dir;
+	return pt;
+}
+
+/* a mesh's generated surface, for drawing close up; it is made on a loader thread from a copy
+of the mesh's simulated points, so that the planet can be edited meanwhile */
+struct detail_t: public load_job_t {
+	detail_t(const mesh_t& mesh,size_t levels,const noise_t& noise);
+	~detail_t();
+	const int N, M; // segments along an edge of the mesh, and of its detail
+	const size_t levels;
+	const noise_t& noise; // the planet's, which outlives it
+	std::vector<vec_t> points, normals; // the mesh's lattice, as simulated
+	std::vector<planet_t::type_t> types;
+	std::vector<vertex_t> vertices; // laid out as grid_t; kept in RAM until the budget needs the room
+	GLuint vbo; // 0 whilst not on the GPU
+	size_t cpu_bytes() const { return vertices.size()*sizeof(vertex_t); }
+	size_t vertex_count() const { return grid_t::index(M,0,M)+1; }
+	size_t gpu_bytes() const { return vbo? vertex_count()*sizeof(vertex_t): 0; }
+	void load(); // puts the vertices on the GPU
+	static void lattice_faces(int M,std::vector<face_t>& out);
+protected:
+	void stage();
+	bool upload(size_t& budget);
 };
 
+static void vertex_pointers() {
+	// of the vertex_t in the bound GL_ARRAY_BUFFER
+	glVertexPointer(3,GL_SHORT,sizeof(vertex_t),(GLvoid*)offsetof(vertex_t,pos));
+	glNormalPointer(GL_BYTE,sizeof(vertex_t),(GLvoid*)offsetof(vertex_t,normal));
+	glColorPointer(3,GL_UNSIGNED_BYTE,sizeof(vertex_t),(GLvoid*)offsetof(vertex_t,colour));
+}
 
 mesh_t::mesh_t(planet_t& p,face_t tri,size_t recursionLevel):
 	object_t(TERRAIN),
 	planet(p),
-	ID(p.meshes.size()<<FACE_IDX),
 	mn_point(~0), mx_point(0)
+#ifdef USE_GL
+	,detail(NULL),
+	drawn(0)
+#endif
 {
 	start = stop = planet.faces.append(tri);
 	for(size_t i=0; i<=recursionLevel; i++) {
@@ -132,10 +151,10 @@ mesh_t::mesh_t(planet_t& p,face_t tri,size_t recursionLevel):
 		const GLuint a = f.a, b = f.b, c = f.c;
 		mn_point = std::min<GLuint>(mn_point,std::min<GLuint>(a,std::min<GLuint>(b,c)));
 		mx_point = std::max<GLuint>(mx_point,std::max<GLuint>(a,std::max<GLuint>(b,c)));
-		planet.adjacent_faces[a].add(ID|i);
-		planet.adjacent_faces[b].add(ID|i);
-		planet.adjacent_faces[c].add(ID|i);
-		assert(planet.find_face(a,b,c)==(ID|i));
+		planet.adjacent_faces[a].add(i);
+		planet.adjacent_faces[b].add(i);
+		planet.adjacent_faces[c].add(i);
+		assert(planet.find_face(a,b,c)==i);
 		planet.adjacent_points[a].add(b);
 		planet.adjacent_points[b].add(a);
 		planet.adjacent_points[a].add(c);
@@ -143,19 +162,110 @@ mesh_t::mesh_t(planet_t& p,face_t tri,size_t recursionLevel):
 		planet.adjacent_points[b].add(c);
 		planet.adjacent_points[c].add(b);
 	}
+	N = 1 << (recursionLevel+1);
+	grid_t grid(planet,tri,N);
+	lattice = grid.idx;
+	if(N > LOD_MIN_SEGMENTS) {
+		for(int step=2; N/step >= LOD_MIN_SEGMENTS; step*=2) {
+			lod_faces.push_back(lod_faces_t());
+			init_lod(grid,step,lod_faces.back());
+		}
+	}
+}
+
+grid_t::grid_t(planet_t& p,const face_t& tri,int n): planet(p), N(n), idx((N+1)*(N+2)/2) {
+	(*this)(0,0) = tri.a;
+	(*this)(N,0) = tri.b;
+	(*this)(0,N) = tri.c;
+	fill(0,0,N,0,0,N);
+}
+
+void grid_t::fill(int pi,int pj,int qi,int qj,int ri,int rj) {
+	if((std::abs(qi-pi) < 2) && (std::abs(qj-pj) < 2))
+		return;
+	const int
+		ai = (pi+qi)/2, aj = (pj+qj)/2,
+		bi = (qi+ri)/2, bj = (qj+rj)/2,
+		ci = (ri+pi)/2, cj = (rj+pj)/2;
+	(*this)(ai,aj) = planet.midpoint((*this)(pi,pj),(*this)(qi,qj));
+	(*this)(bi,bj) = planet.midpoint((*this)(qi,qj),(*this)(ri,rj));
+	(*this)(ci,cj) = planet.midpoint((*this)(ri,rj),(*this)(pi,pj));
+	fill(pi,pj,ai,aj,ci,cj);
+	fill(qi,qj,bi,bj,ai,aj);
+	fill(ri,rj,ci,cj,bi,bj);
+	fill(ai,aj,bi,bj,ci,cj);
+}
+
+struct lod_loop_t { // a closed loop of lattice points, ordered by angle about the mesh centre
+	lod_loop_t(int N_): N(N_) {}
+	void add(int i,int j) {
+		const float x = i+j*0.5f-N*0.5f, y = (j-N/3.0f)*0.866f;
+		float a = atan2(y,x);
+		if(pts.size() && (a < angles.back())) a += 2.0f*M_PI;
+		pts.push_back(std::make_pair(i,j));
+		angles.push_back(a);
+	}
+	float angle(size_t i) const { return (i<angles.size()? angles[i]: angles[i-angles.size()]+2.0f*M_PI); }
+	const std::pair<int,int>& pt(size_t i) const { return pts[i%pts.size()]; }
+	const int N;
+	std::vector<std::pair<int,int> > pts;
+	std::vector<float> angles;
+};
+
+void mesh_t::init_lod(grid_t& grid,int s,lod_faces_t& out) {
+	// emits faces in the same winding as the full-detail faces
+	#define LOD_FACE(ai,aj,bi,bj,ci,cj) { \
+		const int w = grid_t::winding(ai,aj,bi,bj,ci,cj); \
+		if(w > 0) out.push_back(face_t(grid(ai,aj),grid(bi,bj),grid(ci,cj))); \
+		else if(w < 0) out.push_back(face_t(grid(ai,aj),grid(ci,cj),grid(bi,bj))); }
+	const int N = grid.N;
+	// the interior at the coarse step
+	for(int j=s; j<N; j+=s)
+		for(int i=s; i<N; i+=s) {
+			if(i+j+s <= N-s)
+				LOD_FACE(i,j,i+s,j,i,j+s);
+			if(i+j+2*s <= N-s)
+				LOD_FACE(i+s,j,i+s,j+s,i,j+s);
+		}
+	// zip the full-detail border to the edge of the coarse interior
+	lod_loop_t outer(N), inner(N);
+	for(int t=0; t<N; t++) outer.add(t,0);
+	for(int t=0; t<N; t++) outer.add(N-t,t);
+	for(int t=0; t<N; t++) outer.add(0,N-t);
+	const int m = N-3*s;
+	for(int t=0; t<m; t+=s) inner.add(s+t,s);
+	for(int t=0; t<m; t+=s) inner.add(N-2*s-t,s+t);
+	for(int t=0; t<m; t+=s) inner.add(s,N-2*s-t);
+	// both loops start at the bottom-left corner and go anticlockwise
+	size_t o = 0, i = 0;
+	while((o < outer.pts.size()) || (i < inner.pts.size())) {
+		const std::pair<int,int> &a = outer.pt(o), &b = inner.pt(i);
+		if((i == inner.pts.size()) || ((o < outer.pts.size()) && (outer.angle(o+1) <= inner.angle(i+1)))) {
+			const std::pair<int,int>& c = outer.pt(++o);
+			LOD_FACE(a.first,a.second,c.first,c.second,b.first,b.second);
+		} else {
+			const std::pair<int,int>& c = inner.pt(++i);
+			LOD_FACE(a.first,a.second,c.first,c.second,b.first,b.second);
+		}
+	}
+	#undef LOD_FACE
 }
 
 void mesh_t::calc_bounds() {
+	// an object's box is centred on its pos, so the mesh is put where its points are; else
+	// every mesh would sit on the planet's centre and be the same distance from the camera
+	bounds_t box;
 	bounds_reset();
 	for(size_t i=start; i<=stop; i++) {
 		const face_t& f = planet.faces[i];
-		bounds_include(planet.points[f.a]);
-		bounds_include(planet.points[f.b]);
-		bounds_include(planet.points[f.c]);
+		const vec_t* pts[3] = {&planet.points[f.a],&planet.points[f.b],&planet.points[f.c]};
+		for(int p=0; p<3; p++) {
+			bounds_include(*pts[p]);
+			box.bounds_include(*pts[p]);
+		}
 	}
-	bounds_fix();
-	// must be called only once ever:
-	world()->add(this);
+	box.bounds_fix();
+	set_pos(box.centre); // moves it in the world if it is already in it
 }
 
 bool mesh_t::refine_intersection(const ray_t& r,vec_t& I) {
@@ -178,20 +288,138 @@ bool mesh_t::refine_intersection(const ray_t& r,vec_t& I) {
 }
 
 void mesh_t::init_gl() {
-	faces = graphics()->alloc_vbo();
-	graphics()->load_vbo(faces,
+	lod_t lod = {graphics()->alloc_vbo(),(GLsizei)((stop-start)+1)};
+	graphics()->load_vbo(lod.faces,
 		GL_ELEMENT_ARRAY_BUFFER,
-		((stop-start)+1)*sizeof(face_t),
+		lod.count*sizeof(face_t),
 		planet.faces.ptr()+start,
 		GL_STATIC_DRAW);
+	lods.push_back(lod);
+	for(size_t i=0; i<lod_faces.size(); i++) {
+		lod.faces = graphics()->alloc_vbo();
+		lod.count = lod_faces[i].size();
+		graphics()->load_vbo(lod.faces,
+			GL_ELEMENT_ARRAY_BUFFER,
+			lod.count*sizeof(face_t),
+			&lod_faces[i][0],
+			GL_STATIC_DRAW);
+		lods.push_back(lod);
+	}
+	std::vector<lod_faces_t>().swap(lod_faces); // only needed them to upload
 }
 
-void mesh_t::draw(float) {
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,faces);
-        glDrawRangeElements(GL_TRIANGLES,mn_point,mx_point,((stop-start)+1)*3,GL_UNSIGNED_INT,NULL);
+void mesh_t::draw(float d) {
+	// d is the square of the distance from the camera; drop a level each time it doubles
+	if(planet.detail_levels && (d <= sqrd(radius*DETAIL_DISTANCE)) && planet.want_detail(*this)) {
+		draw_detail();
+		return;
+	}
+	size_t lod = 0;
+	for(float threshold = sqrd(radius*LOD_DISTANCE); (lod+1 < lods.size()) && (d > threshold); threshold *= 4)
+		lod++;
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,lods[lod].faces);
+        glDrawRangeElements(GL_TRIANGLES,mn_point,mx_point,lods[lod].count*3,GL_UNSIGNED_INT,NULL);
         glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,0);
 }
 
+void mesh_t::draw_detail() {
+	// its own vertices, but the lattice's faces are shared; then back to the planet's
+	glBindBuffer(GL_ARRAY_BUFFER,detail->vbo);
+	vertex_pointers();
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,planet.vbo.detail);
+	glDrawRangeElements(GL_TRIANGLES,0,detail->vertex_count()-1,planet.detail_faces*3,GL_UNSIGNED_INT,NULL);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,0);
+	glBindBuffer(GL_ARRAY_BUFFER,planet.vbo.vertices);
+	vertex_pointers();
+	glBindBuffer(GL_ARRAY_BUFFER,0);
+}
+
+detail_t::detail_t(const mesh_t& mesh,size_t l,const noise_t& n):
+	N(mesh.N), M(mesh.N << l), levels(l), noise(n),
+	points(mesh.lattice.size()), normals(mesh.lattice.size()), types(mesh.lattice.size()),
+	vbo(0)
+{
+	for(size_t i=0; i<mesh.lattice.size(); i++) {
+		const GLuint p = mesh.lattice[i];
+		points[i] = mesh.planet.points[p];
+		normals[i] = mesh.planet.normal_at(p);
+		types[i] = mesh.planet.types[p];
+	}
+}
+
+detail_t::~detail_t() {
+	cancel();
+	if(vbo)
+		graphics()->free_vbo(vbo);
+}
+
+void detail_t::stage() {
+	const detail_surface_t surface(N,levels,points[0],points[1],noise);
+	const int S = surface.S;
+	const size_t count = vertex_count();
+	std::vector<vec_t> pos(count), flat(count); // flat is the interpolated simulated normal
+	std::vector<float> taper(count);
+	std::vector<planet_t::type_t> type(count);
+	for(int j=0; j<=M; j++)
+		for(int i=0; i+j<=M; i++) {
+			const int v = grid_t::index(M,i,j);
+			int c[3], w[3];
+			surface.corners(i,j,c,w);
+			vec_t corner[3], normal(0,0,0);
+			planet_t::type_t corner_type[3];
+			for(int k=0; k<3; k++) {
+				corner[k] = points[c[k]];
+				corner_type[k] = types[c[k]];
+				normal += normals[c[k]]*((float)w[k]/S);
+			}
+			taper[v] = surface.taper(i,j);
+			flat[v] = normal.normalise();
+			pos[v] = surface.point(i,j,w,corner,corner_type);
+			type[v] = (w[0] == S)? types[c[0]]: planet_t::classify(vec_t::normalise(pos[v]),pos[v].magnitude());
+		}
+	vertices.resize(count);
+	for(int j=0; j<=M; j++)
+		for(int i=0; i+j<=M; i++) {
+			const int v = grid_t::index(M,i,j);
+			vec_t normal = flat[v];
+			if(taper[v] > 0) {
+				// across the lattice; (i,j) winds the same way as the faces
+				const vec_t
+					di = pos[grid_t::index(M,std::min(i+1,M-j),j)]-pos[grid_t::index(M,std::max(i-1,0),j)],
+					dj = pos[grid_t::index(M,i,std::min(j+1,M-i))]-pos[grid_t::index(M,i,std::max(j-1,0))];
+				normal = normal*(1.0f-taper[v]) + di.cross(dj).normalise()*taper[v];
+				normal.normalise();
+			}
+			vertices[v] = planet_t::pack(pos[v],normal,type[v]);
+		}
+}
+
+bool detail_t::upload(size_t& budget) {
+	// one buffer, so it goes whole once there is any budget left at all
+	load();
+	budget -= std::min(budget,cpu_bytes());
+	return true;
+}
+
+void detail_t::load() {
+	vbo = graphics()->alloc_vbo();
+	graphics()->load_vbo(vbo,
+		GL_ARRAY_BUFFER,
+		cpu_bytes(),
+		&vertices[0],
+		GL_STATIC_DRAW);
+}
+
+void detail_t::lattice_faces(int M,std::vector<face_t>& out) {
+	// the same winding as the simulated faces
+	for(int j=0; j<M; j++)
+		for(int i=0; i+j<M; i++) {
+			out.push_back(face_t(grid_t::index(M,i,j),grid_t::index(M,i+1,j),grid_t::index(M,i,j+1)));
+			if(i+j+1 < M)
+				out.push_back(face_t(grid_t::index(M,i+1,j),grid_t::index(M,i+1,j+1),grid_t::index(M,i,j+1)));
+		}
+}
+
 std::ostream& operator<<(std::ostream& out,const planet_t::adjacent_t& adj) {
 	out << "[";
 	for(int i=0; i<6; i++) {
@@ -223,7 +451,7 @@ void planet_t::adjacent_t::add(GLuint neighbour) {
 }
 
 size_t planet_t::adjacent_t::size() const {
-	for(int i=5; i>=0; i++)
+	for(int i=5; i>=0; i--)
 		if(adj[i] != EMPTY)
 			return i+1;
 	return 0;
@@ -278,17 +506,40 @@ size_t planet_t::num_faces(size_t recursionLevel) {
 	return (20*pow(4,recursionLevel+1));
 }
 
-planet_t::planet_t(size_t recursionLevel,size_t iterations,size_t smoothing_passes):
-	points(num_points(recursionLevel)),
-	normals(num_points(recursionLevel)),
-	colours(num_points(recursionLevel)),
-	faces(num_faces(recursionLevel)),
-	adjacent_faces(num_points(recursionLevel),true),
-	adjacent_points(num_points(recursionLevel),true),
-	types(num_points(recursionLevel)),
-	sun(0,0,100)
+planet_t::planet_t(size_t level,size_t iterations,size_t smoothing_passes,generator_t generator,unsigned seed):
+	detail_levels(level-simulated_level(level)),
+	points(num_points(simulated_level(level))),
+	faces(num_faces(simulated_level(level))),
+	adjacent_faces(num_points(simulated_level(level)),true),
+	adjacent_points(num_points(simulated_level(level)),true),
+	types(num_points(simulated_level(level))),
+	lookup_levels(simulated_level(level)+1),
+	sun(0,0,100),
+	detail_noise(NULL),
+	detail_relief(0),
+	pathfinder(NULL),
+	placement(NULL),
+	sight(NULL)
+#ifdef USE_GL
+	,loader(NULL),
+	frame(0),
+	loads(0)
+#endif
 {
-	std::cout << "terraforming...\n: recursionLevel = " << recursionLevel << std::endl;
+	// the whole planet is only ever made at the simulated level; closer up, the meshes make their own
+	const size_t recursionLevel = simulated_level(level);
+	std::cout << "terraforming...\n: recursionLevel = " << level;
+	if(detail_levels)
+		std::cout << " (simulated at " << recursionLevel << ", the rest generated close up)";
+	std::cout << std::endl;
+	if(detail_levels > MAX_DETAIL_LEVELS)
+		panic("recursionLevel " << level << " needs more than " << MAX_DETAIL_LEVELS << " levels of generated detail");
+	if(num_faces(recursionLevel) >= adjacent_t::EMPTY)
+		panic("recursionLevel " << recursionLevel << " has too many faces to index");
+#ifdef USE_GL
+	vbo.vertices = vbo.detail = 0;
+	detail_faces = 0;
+#endif
 	static const float t = (1.0f + sqrt(5.0f)) / 2.0f;
 	static const vec_t Ts[12] = {
 		vec_t(-1, t, 0),vec_t( 1, t, 0),vec_t(-1,-t, 0),vec_t( 1,-t, 0),
@@ -303,35 +554,51 @@ planet_t::planet_t(size_t recursionLevel,size_t iterations,size_t smoothing_pass
             face_t(4,9,5),face_t(2,4,11),face_t(6,2,10),face_t(8,6,7),face_t(9,8,1)};
         for(int f=0; f<20; f++)
         		divide(Fs[f],recursionLevel,0);
+	faces_per_mesh = meshes[0]->stop+1;
+	for(size_t i=0; i<meshes.size(); i++)
+		assert((meshes[i]->start == i*faces_per_mesh) && (meshes[i]->stop+1 == (i+1)*faces_per_mesh));
+	lookup.reserve(20*(pow(4,lookup_levels+1)-1)/3);
+	for(int f=0; f<20; f++)
+		lookup.push_back(lookup_t(Fs[f]));
+	for(int f=0; f<20; f++)
+		init_lookup(f,lookup_levels);
 	std::cout << ": " << points.size() << " points, "
 		<< meshes.size() << " meshes, "
 		<< faces.size() << " faces"<< std::endl;
+	for(size_t lod=0; lod<meshes[0]->lod_faces.size(); lod++) {
+		size_t count = 0;
+		for(meshes_t::const_iterator i=meshes.begin(); i!=meshes.end(); i++)
+			count += (*i)->lod_faces[lod].size();
+		std::cout << ": level of detail " << (lod+1) << " has " << count << " faces" << std::endl;
+	}
 	assert(points.full());
         	assert(faces.full());
-	gen(iterations,smoothing_passes);
-	normals.fill(vec_t(0,0,0));
-	for(size_t i=0; i<faces.size(); i++) {
-		const face_t& f = faces[i];
-		const vec_t a = points[f.c]-points[f.b];
-		const vec_t b = points[f.a]-points[f.b];
-		const vec_t pn = a.cross(b).normalise();
-		normals[f.a] += pn;
-		normals[f.b] += pn;
-		normals[f.c] += pn;
-	}
-	for(size_t i=0; i<normals.size(); i++) {
-		assert(adjacent_faces[i].size() >= 5);
-		normals[i] /= adjacent_faces[i].size();
-		normals[i].normalise();
+	gen(generator,iterations,smoothing_passes,seed);
+	if(detail_levels) {
+		detail_noise = new noise_t(this->seed);
+		for(meshes_t::const_iterator i=meshes.begin(); i!=meshes.end(); i++) {
+			const detail_surface_t surface((*i)->N,detail_levels,points[(*i)->lattice[0]],points[(*i)->lattice[1]],*detail_noise);
+			detail_relief = std::max(detail_relief,surface.most());
+		}
 	}
-	for(meshes_t::iterator i=meshes.begin(); i!=meshes.end(); i++)
+	for(meshes_t::iterator i=meshes.begin(); i!=meshes.end(); i++) {
 		(*i)->calc_bounds();
-#ifdef USE_GL
-	init_gl();
-#endif
+		world()->add(*i);
+	}
+	midpoints_t().swap(midpoints); // only needed whilst subdividing
+	memory_report();
 }
 
 planet_t::~planet_t() {
+#ifdef USE_GL
+	for(std::vector<mesh_t*>::iterator i=resident.begin(); i!=resident.end(); i++)
+		delete (*i)->detail;
+	delete loader;
+#endif
+	delete pathfinder;
+	delete placement;
+	delete sight;
+	delete detail_noise;
 	for(int i=meshes.size()-1; i>=0; i--)
 		delete meshes[i];
 }
@@ -360,28 +627,18 @@ void planet_t::divide(const face_t& tri,size_t recursionLevel,size_t depth) {
 	}
 }
 
-void planet_t::gen(size_t iterations,size_t smoothing_passes) {
-        // http://freespace.virgin.net/hugo.elias/models/m_landsp.htm
-        std::cout << ": generating landscape with " << iterations << " iterations" << std::endl;
-        srand(time(NULL));
-        vec_t n, v;
-        fixed_array_t<float> adj(points.size());
-        adj.fill(0);
-        for(size_t i=0; i<iterations; i++) {
-        	do {
-			n.x = (randf()-0.5f)*2.0f;
-			n.y = (randf()-0.5f)*2.0f;
-			n.z = (randf()-0.5f)*2.0f;
-		} while(n.magnitude_sqrd() <= 0.0f);
-		const int m = (randf() > 0.7)? -1: 1;
-		for(size_t p=0; p<points.size(); p++) {
-			v = points[p];
-			v -= n;
-			if(v.dot(n) > 0)
-				adj[p] += m;
-			else
-				adj[p] -= m;
-		}
+void planet_t::gen(generator_t generator,size_t iterations,size_t smoothing_passes,unsigned seed) {
+	if(!seed)
+		seed = time(NULL);
+	this->seed = seed;
+	fixed_array_t<float> adj(points.size(),true);
+	if(generator == NOISE) {
+		std::cout << ": generating landscape with " << iterations << " octaves of noise, seed " << seed << std::endl;
+		gen_noise(iterations,seed,adj);
+	} else {
+		std::cout << ": generating landscape with " << iterations << " iterations, seed " << seed << std::endl;
+		srand(seed);
+		gen_faults(iterations,adj);
 	}
 	// rescale all
 	float mn = INT_MAX, mx = -INT_MAX;
@@ -417,24 +674,8 @@ void planet_t::gen(size_t iterations,size_t smoothing_passes) {
 		}
 	}
 	// reclassify it
-	const float POLAR = 0.7f;
-	for(size_t p=0; p<points.size(); p++) {
-		const float y = points[p].y;
-		const bool polar = (y < -POLAR || y > POLAR);
-		if(adj[p] > WATER_LEVEL) {
-			if((adj[p] > MOUNTAIN_LEVEL))
-				types[p] = MOUNTAIN;
-			else if(polar)
-				types[p] = ICE_FLOW;
-			else
-				types[p] = LAND;	
-		} else {
-			if(polar)
-				types[p] = ICE;
-			else
-				types[p] = WATER;
-		}	
-	}
+	for(size_t p=0; p<points.size(); p++)
+		types[p] = classify(points[p],adj[p]);
 	// set heights
 	for(size_t p=0; p<points.size(); p++)
 		if(types[p] == WATER || types[p] == ICE)
@@ -444,32 +685,123 @@ void planet_t::gen(size_t iterations,size_t smoothing_passes) {
 			if(points[p].magnitude() < WATER_LEVEL)
 				panic(p << "," << points[p] << "," << adj[p] << "," << types[p] << " is "<<points[p].magnitude());
 		}
-	// colour it
-	const rgb_t WATER_COLOUR(0,0,0xff),
+}
+
+void planet_t::gen_faults(size_t iterations,fixed_array_t<float>& adj) const {
+        // http://freespace.virgin.net/hugo.elias/models/m_landsp.htm
+        vec_t n, v;
+        adj.fill(0);
+        for(size_t i=0; i<iterations; i++) {
+        	do {
+			n.x = (randf()-0.5f)*2.0f;
+			n.y = (randf()-0.5f)*2.0f;
+			n.z = (randf()-0.5f)*2.0f;
+		} while(n.magnitude_sqrd() <= 0.0f);
+		const int m = (randf() > 0.7)? -1: 1;
+		for(size_t p=0; p<points.size(); p++) {
+			v = points[p];
+			v -= n;
+			if(v.dot(n) > 0)
+				adj[p] += m;
+			else
+				adj[p] -= m;
+		}
+	}
+}
+
+void planet_t::gen_noise(size_t octaves,unsigned seed,fixed_array_t<float>& adj) const {
+	// each point is the sum of its own samples, so it is O(points) and any number of threads can share it
+	const float FREQUENCY = 1.5f; // continents per unit
+	const noise_t noise(seed);
+	#pragma omp parallel for schedule(static)
+	for(int p=0; p<(int)points.size(); p++)
+		adj[p] = noise.octaves(points[p]*FREQUENCY,octaves);
+}
+
+planet_t::type_t planet_t::classify(const vec_t& dir,float height) {
+	const float POLAR = 0.7f;
+	const bool polar = (dir.y < -POLAR || dir.y > POLAR);
+	if(height > WATER_LEVEL) {
+		if(height > MOUNTAIN_LEVEL)
+			return MOUNTAIN;
+		return polar? ICE_FLOW: LAND;
+	}
+	return polar? ICE: WATER;
+}
+
+rgb_t planet_t::colour(type_t type) {
+	static const rgb_t WATER_COLOUR(0,0,0xff),
 		ICE_COLOUR(0xff,0xff,0xff),
 		LAND_COLOUR(0,0xff,0),
 		ICE_FLOW_COLOUR(0xc0,0xc0,0xc0),
 		MOUNTAIN_COLOUR(0xa0,0xa0,0xa0);
-	for(size_t p=0; p<points.size(); p++) {
-		switch(types[p]) {
-		case WATER:
-			colours.append(WATER_COLOUR);
-			break;
-		case ICE:
-			colours.append(ICE_COLOUR);
-			break;
-		case LAND:
-			colours.append(LAND_COLOUR);
-			break;
-		case ICE_FLOW:
-			colours.append(ICE_FLOW_COLOUR);
-			break;
-		case MOUNTAIN:
-			colours.append(MOUNTAIN_COLOUR);
-			break;
-		default:
-			assert(false);
-		}
+	switch(type) {
+	case WATER: return WATER_COLOUR;
+	case ICE: return ICE_COLOUR;
+	case LAND: return LAND_COLOUR;
+	case ICE_FLOW: return ICE_FLOW_COLOUR;
+	case MOUNTAIN: return MOUNTAIN_COLOUR;
+	default: panic("bad type "<<type);
+	}
+}
+
+static inline GLshort _snorm16(float f) {
+	// the packing only reaches the unit sphere, so further out cannot be drawn where it is
+	assert(fabsf(f) <= 1.0f+1e-5f);
+	return (GLshort)lrintf(std::max(-1.0f,std::min(1.0f,f))*vertex_t::POS_SCALE);
+}
+
+static inline GLbyte _snorm8(float f) {
+	return (GLbyte)lrintf(std::max(-1.0f,std::min(1.0f,f))*vertex_t::NORMAL_SCALE);
+}
+
+vertex_t planet_t::pack(GLuint p,const vec_t& normal) const {
+	return pack(points[p],normal,types[p]);
+}
+
+vertex_t planet_t::pack(const vec_t& pt,const vec_t& normal,type_t type) {
+	vertex_t v;
+	v.pos[0] = _snorm16(pt.x);
+	v.pos[1] = _snorm16(pt.y);
+	v.pos[2] = _snorm16(pt.z);
+	v.unused = 0;
+	v.normal[0] = _snorm8(normal.x);
+	v.normal[1] = _snorm8(normal.y);
+	v.normal[2] = _snorm8(normal.z);
+	v.normal[3] = 0;
+	v.colour = colour(type);
+	v.type = type;
+	return v;
+}
+
+void planet_t::memory_report() const {
+	typedef int CHECK[sizeof(vertex_t) == 16] __attribute__((unused));
+	size_t lod_faces = 0;
+	for(meshes_t::const_iterator i=meshes.begin(); i!=meshes.end(); i++)
+		for(size_t j=0; j<(*i)->lod_faces.size(); j++)
+			lod_faces += (*i)->lod_faces[j].size();
+	const size_t
+		cpu_points = points.capacity*sizeof(vec_t),
+		cpu_types = types.capacity*sizeof(type_t),
+		cpu_faces = faces.capacity*sizeof(face_t),
+		cpu_adjacent = (adjacent_faces.capacity+adjacent_points.capacity)*sizeof(adjacent_t),
+		cpu_lookup = lookup.capacity()*sizeof(lookup_t),
+		cpu_meshes = meshes.size()*(sizeof(mesh_t)+meshes[0]->lattice.size()*sizeof(GLuint)),
+		gpu_vertices = points.size()*sizeof(vertex_t),
+		gpu_unpacked = points.size()*(sizeof(vec_t)*2+sizeof(rgb_t)),
+		gpu_faces = (faces.size()+lod_faces)*sizeof(face_t);
+	std::cout << ": memory: points " << cpu_points << ", types " << cpu_types <<
+		", faces " << cpu_faces << ", adjacency " << cpu_adjacent <<
+		", lookup " << cpu_lookup << ", meshes " << cpu_meshes << " = " <<
+		(cpu_points+cpu_types+cpu_faces+cpu_adjacent+cpu_lookup+cpu_meshes) << " bytes" << std::endl <<
+		": GPU: vertices " << gpu_vertices << " (" << sizeof(vertex_t) << " bytes each, " <<
+		gpu_unpacked << " unpacked), faces " << gpu_faces << " = " <<
+		(gpu_vertices+gpu_faces) << " bytes" << std::endl;
+	if(detail_levels) {
+		const size_t M = meshes[0]->N << detail_levels;
+		std::cout << ": detail: " << detail_levels << " levels generated per mesh, " <<
+			(grid_t::index(M,0,M)+1)*sizeof(vertex_t) << " bytes each; at most " <<
+			DETAIL_CPU_BUDGET << " bytes in RAM and " << DETAIL_GPU_BUDGET << " on the GPU" << std::endl;
 	}
 }
 
@@ -486,6 +818,36 @@ GLuint planet_t::midpoint(GLuint a,GLuint b) {
 	return value;
 }
 
+void planet_t::init_lookup(GLuint node,size_t levels) {
+	// children are in the same order and orientation as divide() and mesh_t make them
+	if(!levels) return;
+	const face_t f = lookup[node].tri;
+	const GLuint
+		a = midpoint(f.a,f.b),
+		b = midpoint(f.b,f.c),
+		c = midpoint(f.c,f.a),
+		child = lookup.size();
+	lookup[node].child = child;
+	lookup.push_back(lookup_t(face_t(f.a,a,c)));
+	lookup.push_back(lookup_t(face_t(f.b,b,a)));
+	lookup.push_back(lookup_t(face_t(f.c,c,b)));
+	lookup.push_back(lookup_t(face_t(a,b,c)));
+	for(int i=0; i<4; i++)
+		init_lookup(child+i,levels-1);
+}
+
+vec_t planet_t::normal_at(GLuint p) const {
+	vec_t normal(0,0,0);
+	const adjacent_t& adj = adjacent_faces[p];
+	for(int i=0; (i<6) && (adj.adj[i] != adjacent_t::EMPTY); i++) {
+		const face_t& f = faces[adj.adj[i]];
+		const vec_t a = points[f.c]-points[f.b];
+		const vec_t b = points[f.a]-points[f.b];
+		normal += a.cross(b).normalise();
+	}
+	return normal.normalise();
+}
+
 GLuint planet_t::find_face(GLuint a,GLuint b,GLuint c) {
 	adjacent_t set = adjacent_faces[a];
 	set -= adjacent_faces[b];
@@ -497,26 +859,125 @@ GLuint planet_t::find_face(GLuint a,GLuint b,GLuint c) {
 
 #ifdef USE_GL
 void planet_t::init_gl() {
-	vbo.points = graphics()->alloc_vbo();
-	graphics()->load_vbo(vbo.points,
-		GL_ARRAY_BUFFER,
-		points.size()*sizeof(vec_t),
-		points.ptr(),
-		GL_STATIC_DRAW);
-	vbo.normals = graphics()->alloc_vbo();
-	graphics()->load_vbo(vbo.normals,
-		GL_ARRAY_BUFFER,
-		normals.size()*sizeof(vec_t),
-		normals.ptr(),
-		GL_STATIC_DRAW);
-	vbo.colours = graphics()->alloc_vbo();
-	graphics()->load_vbo(vbo.colours,
+	fixed_array_t<vertex_t> vertices(points.size(),true);
+	// a gather rather than a scatter over the faces, so each point is written by one thread only
+	#pragma omp parallel for schedule(static)
+	for(int i=0; i<(int)points.size(); i++)
+		vertices[i] = pack(i,normal_at(i));
+	vbo.vertices = graphics()->alloc_vbo();
+	graphics()->load_vbo(vbo.vertices,
 		GL_ARRAY_BUFFER,
-		colours.size()*sizeof(rgb_t),
-		colours.ptr(),
+		vertices.size()*sizeof(vertex_t),
+		vertices.ptr(),
 		GL_STATIC_DRAW);
 	for(meshes_t::iterator i=meshes.begin(); i!=meshes.end(); i++)
 		(*i)->init_gl();
+	if(detail_levels) {
+		std::vector<face_t> lattice;
+		detail_t::lattice_faces(meshes[0]->N << detail_levels,lattice);
+		detail_faces = lattice.size();
+		vbo.detail = graphics()->alloc_vbo();
+		graphics()->load_vbo(vbo.detail,
+			GL_ELEMENT_ARRAY_BUFFER,
+			lattice.size()*sizeof(face_t),
+			&lattice[0],
+			GL_STATIC_DRAW);
+	}
+	dirty.clear(); // they went up with the rest
+}
+
+bool planet_t::want_detail(mesh_t& mesh) {
+	// the simulated mesh stands in until its detail is generated and on the GPU
+	mesh.drawn = frame;
+	if(!mesh.detail) {
+		if(!loader)
+			loader = new loader_t(1);
+		if(loader->pending() >= MAX_DETAIL_LOADS)
+			return false;
+		mesh.detail = new detail_t(mesh,detail_levels,*detail_noise);
+		loader->add(mesh.detail);
+		resident.push_back(&mesh);
+		return false;
+	}
+	detail_t& detail = *mesh.detail;
+	if(!detail.is_done())
+		return false;
+	if(!detail.vbo) { // evicted from the GPU but still in RAM
+		if(loads >= MAX_DETAIL_LOADS)
+			return false;
+		detail.load();
+		loads++;
+	}
+	return true;
+}
+
+static bool least_recently_wanted(const mesh_t* a,const mesh_t* b) {
+	return a->drawn < b->drawn;
+}
+
+void planet_t::evict_detail(size_t cpu_budget,size_t gpu_budget) {
+	// detail still generating is neither counted nor evicted
+	size_t cpu = 0, gpu = 0;
+	for(std::vector<mesh_t*>::const_iterator i=resident.begin(); i!=resident.end(); i++) {
+		const detail_t& detail = *(*i)->detail;
+		if(!detail.is_done()) // its vertices belong to the loader thread until then
+			continue;
+		cpu += detail.cpu_bytes();
+		gpu += detail.gpu_bytes();
+	}
+	if((cpu <= cpu_budget) && (gpu <= gpu_budget))
+		return;
+	std::sort(resident.begin(),resident.end(),least_recently_wanted);
+	for(std::vector<mesh_t*>::iterator i=resident.begin(); (i!=resident.end()) && ((cpu > cpu_budget) || (gpu > gpu_budget)); i++) {
+		detail_t& detail = *(*i)->detail;
+		if(!detail.is_done())
+			continue;
+		if((gpu > gpu_budget) && detail.vbo) {
+			gpu -= detail.gpu_bytes();
+			graphics()->free_vbo(detail.vbo);
+			detail.vbo = 0;
+		}
+		if((cpu > cpu_budget) && detail.vertices.size()) {
+			cpu -= detail.cpu_bytes();
+			std::vector<vertex_t>().swap(detail.vertices);
+		}
+	}
+	// whatever is now in neither has to be generated again
+	for(size_t i=0; i<resident.size(); ) {
+		const detail_t& detail = *resident[i]->detail;
+		if(detail.is_done() && !detail.vbo && detail.vertices.empty())
+			drop_detail(*resident[i]);
+		else
+			i++;
+	}
+}
+
+void planet_t::drop_detail(mesh_t& mesh) {
+	delete mesh.detail;
+	mesh.detail = NULL;
+	resident.erase(std::find(resident.begin(),resident.end(),&mesh));
+}
+
+void planet_t::upload_dirty() {
+	// coalesce nearby points into runs so that a crater is a handful of uploads, not one per point
+	enum { MAX_GAP = 32 };
+	std::vector<vertex_t> run;
+	std::set<GLuint>::const_iterator i = dirty.begin();
+	while(i != dirty.end()) {
+		const GLuint start = *i;
+		GLuint stop = start;
+		for(; (i != dirty.end()) && (*i-stop <= MAX_GAP); ++i)
+			stop = *i;
+		run.clear();
+		for(GLuint p=start; p<=stop; p++)
+			run.push_back(pack(p,normal_at(p)));
+		graphics()->update_vbo(vbo.vertices,
+			GL_ARRAY_BUFFER,
+			start*sizeof(vertex_t),
+			run.size()*sizeof(vertex_t),
+			&run[0]);
+	}
+	dirty.clear();
 }
 #endif
 
@@ -530,27 +991,175 @@ void planet_t::draw_init() {
 	light[2] = sun.z;
 	light[3] = 0;
 	glLightfv(GL_LIGHT1,GL_POSITION,light);
+#ifdef USE_GL
+	if(!vbo.vertices)
+		init_gl();
+	frame++;
+	loads = 0;
+	if(dirty.size())
+		upload_dirty();
+	if(loader)
+		loader->upload(loader_t::FRAME_BUDGET);
+	evict_detail(DETAIL_CPU_BUDGET,DETAIL_GPU_BUDGET);
+#endif
+        // positions are snorm16
+        glMatrixMode(GL_MODELVIEW);
+        glPushMatrix();
+        glScalef(1.0f/vertex_t::POS_SCALE,1.0f/vertex_t::POS_SCALE,1.0f/vertex_t::POS_SCALE);
+        glBindBuffer(GL_ARRAY_BUFFER,vbo.vertices);
         glEnableClientState(GL_VERTEX_ARRAY);
-        glBindBuffer(GL_ARRAY_BUFFER,vbo.points);
-        glVertexPointer(3,GL_FLOAT,0,NULL);
         glEnableClientState(GL_NORMAL_ARRAY);
-        glBindBuffer(GL_ARRAY_BUFFER,vbo.normals);
-        glNormalPointer(GL_FLOAT,0,NULL);
         glEnableClientState(GL_COLOR_ARRAY);
-        glBindBuffer(GL_ARRAY_BUFFER,vbo.colours);
-        glColorPointer(3,GL_UNSIGNED_BYTE,0,NULL);
+        vertex_pointers();
         glBindBuffer(GL_ARRAY_BUFFER,0);
         //glEnable(GL_CULL_FACE);
 }
 
 void planet_t::draw_done() {
+        glPopMatrix();
         glDisableClientState(GL_COLOR_ARRAY);
         glDisableClientState(GL_VERTEX_ARRAY);
         glDisableClientState(GL_NORMAL_ARRAY);
         //glDisable(GL_CULL_FACE);
 }
 
-bool planet_t::surface_at(const vec_t& normal,vec_t& pt) const {
+GLuint planet_t::base_lookup(const vec_t& d) const {
+	GLuint node = 0;
+	float best = -INT_MAX;
+	for(GLuint i=0; i<20; i++) {
+		const face_t& f = lookup[i].tri;
+		const vec_t &a = points[f.a], &b = points[f.b], &c = points[f.c];
+		const float inside = std::min(d.dot(a.cross(b)),std::min(d.dot(b.cross(c)),d.dot(c.cross(a))));
+		if(inside > best) {
+			best = inside;
+			node = i;
+		}
+	}
+	return node;
+}
+
+int planet_t::child_lookup(GLuint node,const vec_t& d) const {
+	const face_t& m = lookup[lookup[node].child+3].tri; // the middle child
+	const vec_t &ab = points[m.a], &bc = points[m.b], &ca = points[m.c];
+	const float
+		to_a = d.dot(ca.cross(ab)),
+		to_b = d.dot(ab.cross(bc)),
+		to_c = d.dot(bc.cross(ca));
+	if(to_a < 0 && to_a <= to_b && to_a <= to_c)
+		return 0;
+	else if(to_b < 0 && to_b <= to_c)
+		return 1;
+	else if(to_c < 0)
+		return 2;
+	return 3;
+}
+
+GLuint planet_t::find_lookup(const vec_t& d,size_t levels) const {
+	/* points are only ever displaced along their direction from the centre, so the plane
+	through the centre and any two of them is the same great circle as before displacement;
+	we can descend the subdivision by which side of the inner edges the direction is on */
+	GLuint node = base_lookup(d);
+	for(size_t level=0, stop=std::min(levels,lookup_levels); level<stop; level++)
+		node = lookup[node].child+child_lookup(node,d);
+	return node;
+}
+
+const mesh_t& planet_t::find_facet(const vec_t& d,int corner[3][2]) const {
+	/* as find_lookup; the meshes are made in the order the lookup descends, down to the level
+	divide() made them at, and then their lattices are filled in that order too */
+	GLuint node = base_lookup(d);
+	size_t mesh = node;
+	for(size_t count=20; count<meshes.size(); count*=4) {
+		const int child = child_lookup(node,d);
+		mesh = mesh*4+child;
+		node = lookup[node].child+child;
+	}
+	const int N = meshes[mesh]->N;
+	int p[3][2] = {{0,0},{N,0},{0,N}};
+	for(int n=N; n>1; n/=2) {
+		const int child = child_lookup(node,d);
+		node = lookup[node].child+child;
+		const int mid[3][2] = {
+			{(p[0][0]+p[1][0])/2,(p[0][1]+p[1][1])/2},
+			{(p[1][0]+p[2][0])/2,(p[1][1]+p[2][1])/2},
+			{(p[2][0]+p[0][0])/2,(p[2][1]+p[0][1])/2}};
+		static const int children[4][3] = {{0,3,5},{1,4,3},{2,5,4},{3,4,5}}; // of p then mid, as in grid_t::fill
+		int q[6][2];
+		memcpy(q,p,sizeof(p));
+		memcpy(q+3,mid,sizeof(mid));
+		for(int k=0; k<3; k++) {
+			p[k][0] = q[children[child][k]][0];
+			p[k][1] = q[children[child][k]][1];
+		}
+	}
+	memcpy(corner,p,sizeof(p));
+	return *meshes[mesh];
+}
+
+static bool _plane_intersection(const vec_t& d,const vec_t& a,const vec_t& b,const vec_t& c,vec_t& pt) {
+	// of the ray from the centre with the plane of the face
+	const vec_t n = (b-a).cross(c-a);
+	const float dn = d.dot(n);
+	if(!dn) return false;
+	const float t = a.dot(n)/dn;
+	if(t <= 0) return false;
+	pt = d*t;
+	return true;
+}
+
+bool planet_t::simulated_surface_at(const vec_t& d,vec_t& pt) const {
+	const face_t& f = lookup[find_lookup(d)].tri;
+	return _plane_intersection(d,points[f.a],points[f.b],points[f.c],pt);
+}
+
+static vec_t _detail_point(const planet_t& planet,const mesh_t& mesh,const detail_surface_t& surface,int i,int j) {
+	int c[3], w[3];
+	surface.corners(i,j,c,w);
+	vec_t corner[3];
+	planet_t::type_t type[3];
+	for(int k=0; k<3; k++) {
+		corner[k] = planet.points[mesh.lattice[c[k]]];
+		type[k] = planet.types[mesh.lattice[c[k]]];
+	}
+	return surface.point(i,j,w,corner,type);
+}
+
+bool planet_t::surface_at(const vec_t& d,vec_t& pt) const {
+	if(!detail_levels)
+		return simulated_surface_at(d,pt);
+	// where the direction crosses the simulated facet is where it is in the generated lattice over it
+	int corner[3][2];
+	const mesh_t& mesh = find_facet(d,corner);
+	const vec_t
+		&a = points[mesh.lattice_at(corner[0][0],corner[0][1])],
+		&b = points[mesh.lattice_at(corner[1][0],corner[1][1])],
+		&c = points[mesh.lattice_at(corner[2][0],corner[2][1])];
+	vec_t flat;
+	if(!_plane_intersection(d,a,b,c,flat))
+		return false;
+	const vec_t ab = b-a, ac = c-a, ap = flat-a;
+	const float
+		d00 = ab.dot(ab), d01 = ab.dot(ac), d11 = ac.dot(ac), d20 = ap.dot(ab), d21 = ap.dot(ac),
+		denom = d00*d11-d01*d01,
+		u = (d11*d20-d01*d21)/denom, // towards b
+		v = (d00*d21-d01*d20)/denom; // towards c
+	const detail_surface_t surface(mesh.N,detail_levels,points[mesh.lattice[0]],points[mesh.lattice[1]],*detail_noise);
+	const float
+		I = surface.S*(corner[0][0]+(corner[1][0]-corner[0][0])*u+(corner[2][0]-corner[0][0])*v),
+		J = surface.S*(corner[0][1]+(corner[1][1]-corner[0][1])*u+(corner[2][1]-corner[0][1])*v);
+	// the face of the generated lattice it is in; one either side of an edge is as good
+	const int M = surface.M,
+		i = std::max(0,std::min(M-1,(int)floorf(I))),
+		j = std::max(0,std::min(M-1-i,(int)floorf(J)));
+	if((I-i)+(J-j) > 1 && (i+j+2 <= M))
+		return _plane_intersection(d,_detail_point(*this,mesh,surface,i+1,j+1),
+			_detail_point(*this,mesh,surface,i+1,j),_detail_point(*this,mesh,surface,i,j+1),pt);
+	return _plane_intersection(d,_detail_point(*this,mesh,surface,i,j),
+		_detail_point(*this,mesh,surface,i+1,j),_detail_point(*this,mesh,surface,i,j+1),pt);
+}
+
+bool planet_t::surface_by_intersection(const vec_t& normal,vec_t& pt) const {
+	// the slow way, for comparison
 	world_t::hits_t hits;
 	ray_t ray(vec_t(0,0,0),normal*2);
 	world()->intersection(ray,TERRAIN,hits,world_t::SORT_BY_DISTANCE);
@@ -565,6 +1174,159 @@ bool planet_t::surface_at(const vec_t& normal,vec_t& pt) const {
 	return hit;
 }
 
+void planet_t::points_within(const vec_t& centre,float radius,std::vector<GLuint>& out) const {
+	// flood out from the face under the centre; radius is a chord on the unit sphere
+	const vec_t c = vec_t::normalise(centre);
+	const float r2 = radius*radius;
+	const face_t& f = lookup[find_lookup(c)].tri;
+	std::set<GLuint> seen;
+	std::vector<GLuint> queue;
+	queue.push_back(f.a);
+	queue.push_back(f.b);
+	queue.push_back(f.c);
+	seen.insert(queue.begin(),queue.end());
+	while(queue.size()) {
+		const GLuint p = queue.back();
+		queue.pop_back();
+		if(vec_t::normalise(points[p]).distance_sqrd(c) > r2)
+			continue;
+		out.push_back(p);
+		const adjacent_t& adj = adjacent_points[p];
+		for(int i=0; (i<6) && (adj.adj[i] != adjacent_t::EMPTY); i++)
+			if(seen.insert(adj.adj[i]).second)
+				queue.push_back(adj.adj[i]);
+	}
+	if(!out.size()) // smaller than a face; take the nearest corner
+		out.push_back(nearest_point(c));
+}
+
+GLuint planet_t::nearest_point(const vec_t& dir) const {
+	const vec_t c = vec_t::normalise(dir);
+	const face_t& f = lookup[find_lookup(c)].tri;
+	GLuint nearest = f.a;
+	if(vec_t::normalise(points[f.b]).distance_sqrd(c) < vec_t::normalise(points[nearest]).distance_sqrd(c))
+		nearest = f.b;
+	if(vec_t::normalise(points[f.c]).distance_sqrd(c) < vec_t::normalise(points[nearest]).distance_sqrd(c))
+		nearest = f.c;
+	return nearest;
+}
+
+bool planet_t::find_path(const vec_t& from,const vec_t& to,std::vector<vec_t>& path) {
+	if(!pathfinder)
+		pathfinder = new pathfinder_t(*this);
+	pathfinder_t::path_t pts;
+	if(!pathfinder->find(nearest_point(from),nearest_point(to),pts))
+		return false;
+	for(pathfinder_t::path_t::const_iterator i=pts.begin(); i!=pts.end(); i++)
+		path.push_back(points[*i]);
+	return true;
+}
+
+void planet_t::set_height(const vec_t& centre,float radius,float height) {
+	if(height > 1.0f)
+		panic("height " << height << " is outside the unit sphere the vertices are packed into");
+	std::vector<GLuint> changed;
+	points_within(centre,radius,changed);
+	for(std::vector<GLuint>::const_iterator i=changed.begin(); i!=changed.end(); i++) {
+		const vec_t dir = vec_t::normalise(points[*i]);
+		types[*i] = classify(dir,height);
+		points[*i] = dir*(height > WATER_LEVEL? height: WATER_LEVEL);
+	}
+	moved(changed);
+}
+
+void planet_t::flatten(const vec_t& centre,float radius) {
+	vec_t pt;
+	if(surface_at(vec_t::normalise(centre),pt))
+		set_height(centre,radius,pt.magnitude());
+}
+
+void planet_t::moved(const std::vector<GLuint>& changed) {
+	// the normals of the changed points and their one-ring neighbours are now stale
+	std::set<size_t> refit;
+	for(std::vector<GLuint>::const_iterator i=changed.begin(); i!=changed.end(); i++) {
+		dirty.insert(*i);
+		const adjacent_t &pts = adjacent_points[*i], &fcs = adjacent_faces[*i];
+		for(int j=0; (j<6) && (pts.adj[j] != adjacent_t::EMPTY); j++)
+			dirty.insert(pts.adj[j]);
+		for(int j=0; (j<6) && (fcs.adj[j] != adjacent_t::EMPTY); j++)
+			refit.insert(mesh_of(fcs.adj[j]));
+	}
+	for(std::set<size_t>::const_iterator i=refit.begin(); i!=refit.end(); i++) {
+		meshes[*i]->calc_bounds();
+#ifdef USE_GL
+		if(meshes[*i]->detail) // generated from the old points
+			drop_detail(*meshes[*i]);
+#endif
+	}
+	if(pathfinder)
+		pathfinder->moved(refit);
+	if(placement)
+		placement->moved(refit);
+	if(sight)
+		sight->moved(refit);
+}
+
+placement_t& planet_t::get_placement() {
+	if(!placement)
+		placement = new placement_t(*this);
+	return *placement;
+}
+
+sight_t& planet_t::get_sight() {
+	if(!sight)
+		sight = new sight_t(*this);
+	return *sight;
+}
+
+void planet_t::benchmark() {
+	enum { LOOKUPS = 1000000, SLOW_LOOKUPS = 1000, GEN_ITERATIONS = 500, GEN_OCTAVES = 8 };
+	std::vector<vec_t> dirs(LOOKUPS);
+	for(size_t i=0; i<dirs.size(); i++)
+		do {
+			dirs[i] = vec_t(randf()-0.5f,randf()-0.5f,randf()-0.5f);
+		} while(dirs[i].magnitude_sqrd() <= 0.0f);
+	vec_t pt;
+	size_t hits = 0;
+	uint64_t start = high_precision_time();
+	for(size_t i=0; i<dirs.size(); i++)
+		hits += surface_at(dirs[i],pt);
+	uint64_t ns = high_precision_time()-start;
+	std::cout << "surface_at: " << dirs.size() << " lookups, " << hits << " hits, " <<
+		ns << " ns (" << (uint64_t)(dirs.size()*1000000000.0/ns) << "/sec)" << std::endl;
+	size_t disagree = 0;
+	hits = 0;
+	start = high_precision_time();
+	for(size_t i=0; i<SLOW_LOOKUPS; i++) {
+		if(!surface_by_intersection(dirs[i],pt)) continue;
+		hits++;
+		vec_t fast;
+		if(!simulated_surface_at(dirs[i],fast) || (fast.distance_sqrd(pt) > 0.000001f))
+			disagree++;
+	}
+	ns = high_precision_time()-start;
+	std::cout << "surface_by_intersection: " << SLOW_LOOKUPS << " lookups, " << hits << " hits, " <<
+		ns << " ns (" << (uint64_t)(SLOW_LOOKUPS*1000000000.0/ns) << "/sec), " <<
+		disagree << " disagree with simulated_surface_at" << std::endl;
+	fixed_array_t<float> adj(points.size(),true);
+	start = high_precision_time();
+	gen_faults(GEN_ITERATIONS,adj);
+	ns = high_precision_time()-start;
+	start = high_precision_time();
+	gen_noise(GEN_OCTAVES,1,adj);
+	std::cout << "gen: " << GEN_ITERATIONS << " fault lines " << ns << " ns, " << GEN_OCTAVES << " octaves of noise " <<
+		(high_precision_time()-start) << " ns" << std::endl;
+	if(!pathfinder)
+		pathfinder = new pathfinder_t(*this);
+	pathfinder->benchmark();
+	get_placement().benchmark();
+	surface_index_t(*this).benchmark();
+	get_sight().benchmark();
+	fog_t(*this,4).benchmark();
+	roads_t(*this).benchmark();
+	settlements_t(*this).benchmark();
+}
+
 static terrain_t* _terrain = NULL;
 
 terrain_t* terrain_t::get_terrain() {
@@ -572,11 +1334,12 @@ terrain_t* terrain_t::get_terrain() {
 	return _terrain;
 }
 
-terrain_t* terrain_t::gen_planet(size_t recursionLevel,size_t iterations,size_t smoothing_passes) {
+terrain_t* terrain_t::gen_planet(size_t recursionLevel,size_t iterations,size_t smoothing_passes,
+	generator_t generator,unsigned seed) {
 	if(_terrain) panic("terrain already exists");
 	if(RUNNING_ON_VALGRIND)
-		_terrain = new planet_t(3,3,2); // speed it up a bit
+		_terrain = new planet_t(3,3,2,generator,seed); // speed it up a bit
 	else
-		_terrain = new planet_t(recursionLevel,iterations,smoothing_passes);
+		_terrain = new planet_t(recursionLevel,iterations,smoothing_passes,generator,seed);
 	return _terrain;
 }
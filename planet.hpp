@@ -0,0 +1,201 @@
+/*
+ planet.hpp is part of the GlestNG RTS game engine.
+ Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE version 3
+ See LICENSE for details
+ (c) William Edwards, 2011; all rights reserved
+*/
+
+#ifndef __PLANET_HPP__
+#define __PLANET_HPP__
+
+#include <vector>
+#include <map>
+#include <set>
+#include <inttypes.h>
+
+#include "terrain.hpp"
+#include "graphics.hpp"
+#include "world.hpp"
+#include "utils.hpp"
+
+enum {
+	DIVIDE_THRESHOLD = 4,
+	LOD_DISTANCE = 20, // how many radii away a mesh must be before it drops a level of detail
+	LOD_MIN_SEGMENTS = 4, // the coarsest level must have an interior inside its full-detail border
+	OUT_OF_CORE_LEVEL = 7, // planets this detailed are simulated a level coarser, and meshes generate the rest when close
+	MAX_DETAIL_LEVELS = 4, // a mesh of 16 segments an edge is then 256, which is 33153 vertices
+	DETAIL_DISTANCE = 4, // how many radii away a mesh must be before it drops its generated detail
+	MAX_DETAIL_LOADS = 8, // generating at once, and uploads from RAM per frame; the others stay coarse meanwhile
+	DETAIL_CPU_BUDGET = 64<<20, // bytes of generated detail kept in RAM, so going back needs no regenerating
+	DETAIL_GPU_BUDGET = 128<<20, // bytes of generated detail on the GPU
+};
+
+struct rgb_t {
+	rgb_t() {}
+	rgb_t(GLubyte r_,GLubyte g_,GLubyte b_): r(r_), g(g_), b(b_) {}
+	GLubyte r,g,b;
+};
+
+struct vertex_t { // the interleaved, quantised form that the GPU gets
+	GLshort pos[3]; // snorm; the planet is inside the unit sphere
+	GLshort unused;
+	GLbyte normal[4]; // snorm; [3] is unused
+	rgb_t colour;
+	GLubyte type;
+	enum { POS_SCALE = 32767, NORMAL_SCALE = 127 };
+};
+
+struct planet_t;
+struct detail_t;
+class noise_t;
+struct pathfinder_t;
+struct placement_t;
+struct sight_t;
+
+struct grid_t { // the points of a mesh_t as a triangular lattice; (0,0) is tri.a, (N,0) tri.b and (0,N) tri.c
+	grid_t(planet_t& planet,const face_t& tri,int N);
+	GLuint& operator()(int i,int j) { return idx[index(N,i,j)]; }
+	static int index(int N,int i,int j) { return j*(N+1)-(j*(j-1))/2+i; }
+	static int winding(int ai,int aj,int bi,int bj,int ci,int cj) { return (bi-ai)*(cj-aj)-(bj-aj)*(ci-ai); }
+	planet_t& planet;
+	const int N;
+	std::vector<GLuint> idx;
+private:
+	void fill(int pi,int pj,int qi,int qj,int ri,int rj);
+};
+
+struct mesh_t: public object_t {
+	mesh_t(planet_t& planet,face_t tri,size_t recursionLevel);
+	void calc_bounds();
+	void draw(float d);
+	bool refine_intersection(const ray_t& r,vec_t& I);
+	planet_t& planet;
+	GLuint mn_point, mx_point;
+	size_t start, stop;
+	int N; // segments along each edge
+	std::vector<GLuint> lattice; // the points, laid out as in grid_t
+	GLuint lattice_at(int i,int j) const { return lattice[grid_t::index(N,i,j)]; }
+	/* reduced levels of detail; each has the same full-detail border so that
+	neighbouring meshes drawn at different levels never crack */
+	typedef std::vector<face_t> lod_faces_t;
+	std::vector<lod_faces_t> lod_faces; // [0] is one level coarser than faces
+	void init_lod(grid_t& grid,int step,lod_faces_t& out);
+#ifdef USE_GL
+	struct lod_t {
+		GLuint faces;
+		GLsizei count;
+	};
+	std::vector<lod_t> lods; // [0] is full detail
+	void init_gl();
+	detail_t* detail; // generated beyond the simulated level; NULL until first drawn close enough
+	unsigned drawn; // the frame its detail was last wanted
+	void draw_detail();
+#endif
+};
+
+class loader_t;
+
+struct planet_t: public terrain_t {
+	planet_t	(size_t recursionLevel,size_t iterations,size_t smoothing_passes,generator_t generator=FAULT_LINES,unsigned seed=0);
+	~planet_t();
+	void intersection(const ray_t& r,test_hits_t& hits) const;
+	bool surface_at(const vec_t& normal,vec_t& pt) const; // on the generated detail where there is any, as it is drawn close up
+	bool simulated_surface_at(const vec_t& normal,vec_t& pt) const; // on the simulated faces
+	bool surface_by_intersection(const vec_t& normal,vec_t& pt) const;
+	void benchmark();
+	void set_height(const vec_t& centre,float radius,float height);
+	void flatten(const vec_t& centre,float radius);
+	void points_within(const vec_t& centre,float radius,std::vector<GLuint>& out) const;
+	void moved(const std::vector<GLuint>& changed);
+	vec_t normal_at(GLuint p) const;
+	GLuint nearest_point(const vec_t& dir) const;
+	bool find_path(const vec_t& from,const vec_t& to,std::vector<vec_t>& path);
+	static size_t num_points(size_t recursionLevel);
+	static size_t num_faces(size_t recursionLevel);
+	GLuint midpoint(GLuint a,GLuint b);
+	GLuint find_face(GLuint a,GLuint b,GLuint c);
+	void draw_init();
+	void draw_done();
+	void draw();
+	void divide(const face_t& tri,size_t recursionLevel,size_t depth);
+	void gen(generator_t generator,size_t iterations,size_t smoothing_passes,unsigned seed);
+	void gen_faults(size_t iterations,fixed_array_t<float>& adj) const;
+	void gen_noise(size_t octaves,unsigned seed,fixed_array_t<float>& adj) const;
+	bool intersection(int x,int y,vec_t& pt);
+	typedef std::map<uint64_t,GLuint> midpoints_t;
+	midpoints_t midpoints;
+	typedef std::vector<mesh_t*> meshes_t;
+	meshes_t meshes;
+	size_t faces_per_mesh; // each mesh's faces are contiguous, in the order of meshes
+	size_t mesh_of(GLuint face) const { return face/faces_per_mesh; }
+	static size_t simulated_level(size_t recursionLevel) { return std::min<size_t>(recursionLevel,OUT_OF_CORE_LEVEL-1); }
+	const size_t detail_levels; // how many levels finer than simulated the meshes are drawn close up
+	fixed_array_t<vec_t> points;
+	fixed_array_t<face_t> faces;
+	struct adjacent_t {
+		adjacent_t();
+		size_t size() const;
+		GLuint adj[6];
+		void add(GLuint neighbour);
+		adjacent_t& operator-=(adjacent_t a);
+		static const GLuint EMPTY = ~0; 
+	};
+	fixed_array_t<adjacent_t> adjacent_faces;
+	fixed_array_t<adjacent_t> adjacent_points;
+	static const float
+		WATER_LEVEL = 0.85f,
+		MOUNTAIN_LEVEL = 0.95f;
+	enum type_t {
+		WATER,
+		ICE,
+		LAND,
+		MOUNTAIN,
+		ICE_FLOW,
+	};
+	fixed_array_t<type_t> types;
+	static type_t classify(const vec_t& dir,float height);
+	static rgb_t colour(type_t type);
+	vertex_t pack(GLuint p,const vec_t& normal) const;
+	static vertex_t pack(const vec_t& pt,const vec_t& normal,type_t type);
+	void memory_report() const;
+	struct lookup_t { // a face in the subdivision hierarchy, for descending from direction to face
+		lookup_t(const face_t& t): tri(t), child(0) {}
+		face_t tri;
+		GLuint child; // index of the first of its 4 children
+	};
+	std::vector<lookup_t> lookup; // the 20 icosahedron faces are the first entries
+	size_t lookup_levels;
+	void init_lookup(GLuint node,size_t levels);
+	GLuint find_lookup(const vec_t& dir,size_t levels=~0) const; // the leaf, or the node that many levels down
+	GLuint base_lookup(const vec_t& dir) const; // the icosahedron face it is in
+	int child_lookup(GLuint node,const vec_t& dir) const; // which of the node's 4 children it is in
+	const mesh_t& find_facet(const vec_t& dir,int corner[3][2]) const; // the mesh, and the corners of the simulated face in its lattice
+	vec_t sun;
+	unsigned seed; // of the landscape, and of the detail generated on top of it
+	const noise_t* detail_noise; // raises the generated detail; NULL if there is none
+	float detail_relief; // the furthest the generated detail strays from the simulated faces
+	std::set<GLuint> dirty; // points whose vertex needs uploading again
+	pathfinder_t* pathfinder; // made when first needed
+	placement_t* placement; // made when first needed
+	placement_t& get_placement();
+	sight_t* sight; // made when first needed
+	sight_t& get_sight();
+#ifdef USE_GL
+	struct {
+		GLuint vertices; 
+		GLuint detail; // the faces of a mesh's generated lattice, which every mesh shares
+	} vbo;
+	GLsizei detail_faces;
+	void init_gl(); // when first drawn, so that planets can be made without a display
+	void upload_dirty();
+	loader_t* loader; // generates detail off the main thread; made when first needed
+	std::vector<mesh_t*> resident; // meshes with detail, whether generating, in RAM or on the GPU
+	unsigned frame;
+	size_t loads; // detail uploaded from RAM this frame
+	bool want_detail(mesh_t& mesh); // true if it can be drawn now; else it is on its way
+	void evict_detail(size_t cpu_budget,size_t gpu_budget); // least recently wanted first
+	void drop_detail(mesh_t& mesh);
+#endif
+};
+
+#endif //__PLANET_HPP__
@@ -0,0 +1,399 @@
+/*
+ roads.cpp is part of the GlestNG RTS game engine.
+ Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE version 3
+ See LICENSE for details
+ (c) William Edwards, 2011; all rights reserved
+*/
+
+#include <vector>
+#include <set>
+#include <algorithm>
+#include <iostream>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stddef.h>
+
+#include "roads.hpp"
+#include "graphics.hpp"
+#include "utils.hpp"
+#include "error.hpp"
+
+enum {
+	SEGMENTS = 10, // along each span, as the prototype's SEG
+	SPAN_VERTICES = (SEGMENTS+1)*2, // left and right at each end of each segment
+	SPAN_INDICES = SEGMENTS*6,
+	SPANS_PER_BUFFER = 1024,
+};
+
+static const float
+	TENSION = 0.1f, BIAS = 0.0f, // as the prototype
+	LIFT = 0.0005f; // above the surface, so the ribbon does not fight the terrain for depth
+
+static void hermite(const vec_t& y0,const vec_t& y1,const vec_t& y2,const vec_t& y3,float mu,vec_t& pos,vec_t& tangent) {
+	// from http://paulbourke.net/miscellaneous/interpolation/ as in prototyping/roads.py, with its derivative
+	const float tension = (1.0f-TENSION)/2.0f, mu2 = mu*mu, mu3 = mu2*mu;
+	const vec_t
+		m0 = (y1-y0)*((1.0f+BIAS)*tension) + (y2-y1)*((1.0f-BIAS)*tension),
+		m1 = (y2-y1)*((1.0f+BIAS)*tension) + (y3-y2)*((1.0f-BIAS)*tension);
+	pos = y1*(2*mu3-3*mu2+1) + m0*(mu3-2*mu2+mu) + m1*(mu3-mu2) + y2*(-2*mu3+3*mu2);
+	tangent = y1*(6*mu2-6*mu) + m0*(3*mu2-4*mu+1) + m1*(3*mu2-2*mu) + y2*(-6*mu2+6*mu);
+}
+
+struct roads_t::pimpl_t {
+	pimpl_t(const terrain_t& t): terrain(t), slots(0), indices(0) {}
+	const terrain_t& terrain;
+	struct vertex_t {
+		GLfloat pos[3];
+		GLfloat tex[2]; // s runs along the road a tile per width, t across it
+	};
+	struct road_info_t {
+		bool live;
+		float width;
+		std::vector<vec_t> points;
+		std::vector<size_t> spans; // the slot of the span from each point to the next
+	};
+	std::vector<road_info_t> roads;
+	std::vector<road_t> unused_roads;
+	enum { FREE = ~0 };
+	struct owner_t { // of a slot
+		owner_t(): road(FREE), span(0) {}
+		road_t road;
+		size_t span;
+	};
+	std::vector<owner_t> owners;
+	std::vector<size_t> unused_slots;
+	size_t slots;
+	struct buffer_t {
+		GLuint vertices;
+		std::vector<vertex_t> data; // what is on the GPU, or will be at the next upload
+		size_t used; // slots up to the highest in use
+	};
+	std::vector<buffer_t> buffers;
+	GLuint indices; // the same pattern for every buffer
+	std::set<size_t> dirty; // slots to tessellate and upload
+	road_info_t& get(road_t road);
+	size_t alloc_slot(road_t road,size_t span);
+	void free_slot(size_t slot);
+	void renumber(road_t road,size_t from); // tell slots which span they are after an insert or erase
+	void touch(road_t road,size_t point); // the spans whose curve the point shapes
+	vec_t ground(const vec_t& pt) const;
+	void tessellate(size_t slot);
+	void upload();
+};
+
+roads_t::pimpl_t::road_info_t& roads_t::pimpl_t::get(road_t road) {
+	if((road >= roads.size()) || !roads[road].live)
+		panic("there is no road " << road);
+	return roads[road];
+}
+
+size_t roads_t::pimpl_t::alloc_slot(road_t road,size_t span) {
+	size_t slot;
+	if(unused_slots.size()) {
+		slot = unused_slots.back();
+		unused_slots.pop_back();
+	} else {
+		slot = slots++;
+		owners.resize(slots);
+		if(slot/SPANS_PER_BUFFER >= buffers.size()) {
+			buffers.push_back(buffer_t());
+			buffer_t& buffer = buffers.back();
+			vertex_t zero;
+			memset(&zero,0,sizeof(zero));
+			buffer.data.assign(SPANS_PER_BUFFER*SPAN_VERTICES,zero);
+			buffer.used = 0;
+			buffer.vertices = graphics()->alloc_vbo();
+			graphics()->load_vbo(buffer.vertices,
+				GL_ARRAY_BUFFER,
+				buffer.data.size()*sizeof(vertex_t),
+				&buffer.data[0],
+				GL_DYNAMIC_DRAW);
+		}
+	}
+	owners[slot].road = road;
+	owners[slot].span = span;
+	buffer_t& buffer = buffers[slot/SPANS_PER_BUFFER];
+	buffer.used = std::max(buffer.used,slot%SPANS_PER_BUFFER+1);
+	dirty.insert(slot);
+	return slot;
+}
+
+void roads_t::pimpl_t::free_slot(size_t slot) {
+	// zeroed, so it draws as degenerate triangles until it is used again
+	owners[slot] = owner_t();
+	unused_slots.push_back(slot);
+	dirty.insert(slot);
+}
+
+void roads_t::pimpl_t::renumber(road_t road,size_t from) {
+	const road_info_t& info = roads[road];
+	for(size_t s=from; s<info.spans.size(); s++)
+		owners[info.spans[s]].span = s;
+}
+
+void roads_t::pimpl_t::touch(road_t road,size_t point) {
+	// span s runs from point s to s+1 and its ends are steered by points s-1 and s+2
+	const road_info_t& info = roads[road];
+	const size_t first = (point >= 2)? point-2: 0;
+	for(size_t s=first; (s<=point+1) && (s<info.spans.size()); s++)
+		dirty.insert(info.spans[s]);
+}
+
+vec_t roads_t::pimpl_t::ground(const vec_t& pt) const {
+	const vec_t dir = vec_t::normalise(pt);
+	vec_t surface;
+	if(!terrain.surface_at(dir,surface))
+		surface = pt;
+	return surface+dir*LIFT;
+}
+
+void roads_t::pimpl_t::tessellate(size_t slot) {
+	vertex_t* out = &buffers[slot/SPANS_PER_BUFFER].data[(slot%SPANS_PER_BUFFER)*SPAN_VERTICES];
+	const owner_t& owner = owners[slot];
+	if(owner.road == (road_t)FREE) {
+		memset(out,0,sizeof(vertex_t)*SPAN_VERTICES);
+		return;
+	}
+	const road_info_t& road = roads[owner.road];
+	const std::vector<vec_t>& p = road.points;
+	const size_t s = owner.span, last = p.size()-1;
+	const vec_t &y0 = p[s? s-1: 0], &y1 = p[s], &y2 = p[s+1], &y3 = p[std::min(s+2,last)];
+	vec_t centre[SEGMENTS+1], tangent[SEGMENTS+1];
+	float along[SEGMENTS+1];
+	for(int i=0; i<=SEGMENTS; i++) {
+		hermite(y0,y1,y2,y3,(float)i/SEGMENTS,centre[i],tangent[i]);
+		along[i] = i? along[i-1]+centre[i].distance(centre[i-1]): 0;
+	}
+	// a whole number of tiles per span, so the texture meets itself where spans join
+	const float tiles = std::max(1.0f,floorf(along[SEGMENTS]/road.width+0.5f)),
+		scale = (along[SEGMENTS] > 0)? tiles/along[SEGMENTS]: 0;
+	for(int i=0; i<=SEGMENTS; i++) {
+		const vec_t up = vec_t::normalise(centre[i]);
+		vec_t side = tangent[i].cross(up);
+		if(side.magnitude_sqrd() <= 0)
+			side = (y2-y1).cross(up);
+		if(side.magnitude_sqrd() <= 0)
+			side = vec_t(up.y,up.z,up.x).cross(up); // the span has no length; any way across will do
+		side = vec_t::normalise(side)*(road.width/2);
+		const vec_t left = ground(centre[i]+side), right = ground(centre[i]-side);
+		vertex_t& l = out[i*2], &r = out[i*2+1];
+		l.pos[0] = left.x; l.pos[1] = left.y; l.pos[2] = left.z;
+		r.pos[0] = right.x; r.pos[1] = right.y; r.pos[2] = right.z;
+		l.tex[0] = r.tex[0] = along[i]*scale;
+		l.tex[1] = 0;
+		r.tex[1] = 1;
+	}
+}
+
+void roads_t::pimpl_t::upload() {
+	// the tessellation is independent per slot; the uploads coalesce neighbouring slots
+	const std::vector<size_t> todo(dirty.begin(),dirty.end());
+	#pragma omp parallel for schedule(dynamic)
+	for(int i=0; i<(int)todo.size(); i++)
+		tessellate(todo[i]);
+	if(!indices && buffers.size()) {
+		std::vector<GLushort> pattern;
+		for(int slot=0; slot<SPANS_PER_BUFFER; slot++)
+			for(int i=0; i<SEGMENTS; i++) {
+				const GLushort a = slot*SPAN_VERTICES+i*2, b = a+1, c = a+2, d = a+3;
+				pattern.push_back(a); pattern.push_back(b); pattern.push_back(c);
+				pattern.push_back(c); pattern.push_back(b); pattern.push_back(d);
+			}
+		indices = graphics()->alloc_vbo();
+		graphics()->load_vbo(indices,
+			GL_ELEMENT_ARRAY_BUFFER,
+			pattern.size()*sizeof(GLushort),
+			&pattern[0],
+			GL_STATIC_DRAW);
+	}
+	for(size_t i=0; i<todo.size(); ) {
+		const size_t start = todo[i], buffer = start/SPANS_PER_BUFFER;
+		size_t stop = start;
+		for(i++; (i<todo.size()) && (todo[i] == stop+1) && (todo[i]/SPANS_PER_BUFFER == buffer); i++)
+			stop = todo[i];
+		buffer_t& b = buffers[buffer];
+		graphics()->update_vbo(b.vertices,
+			GL_ARRAY_BUFFER,
+			(start%SPANS_PER_BUFFER)*SPAN_VERTICES*sizeof(vertex_t),
+			(stop-start+1)*SPAN_VERTICES*sizeof(vertex_t),
+			&b.data[(start%SPANS_PER_BUFFER)*SPAN_VERTICES]);
+	}
+	dirty.clear();
+}
+
+roads_t::roads_t(const terrain_t& terrain): pimpl(new pimpl_t(terrain)) {
+	typedef int CHECK[SPANS_PER_BUFFER*SPAN_VERTICES <= 65536] __attribute__((unused)); // indices are GLushort
+}
+
+roads_t::~roads_t() {
+	for(size_t i=0; i<pimpl->buffers.size(); i++)
+		graphics()->free_vbo(pimpl->buffers[i].vertices);
+	if(pimpl->indices)
+		graphics()->free_vbo(pimpl->indices);
+	delete pimpl;
+}
+
+roads_t::road_t roads_t::add(const std::vector<vec_t>& points,float width) {
+	if(points.size() < 2)
+		panic("a road needs at least 2 points, not " << points.size());
+	road_t road;
+	if(pimpl->unused_roads.size()) {
+		road = pimpl->unused_roads.back();
+		pimpl->unused_roads.pop_back();
+	} else {
+		road = pimpl->roads.size();
+		pimpl->roads.push_back(pimpl_t::road_info_t());
+	}
+	pimpl_t::road_info_t& info = pimpl->roads[road];
+	info.live = true;
+	info.width = width;
+	info.points = points;
+	info.spans.clear();
+	for(size_t s=0; s+1<points.size(); s++)
+		info.spans.push_back(pimpl->alloc_slot(road,s));
+	return road;
+}
+
+void roads_t::remove(road_t road) {
+	pimpl_t::road_info_t& info = pimpl->get(road);
+	for(size_t s=0; s<info.spans.size(); s++)
+		pimpl->free_slot(info.spans[s]);
+	info.live = false;
+	info.points.clear();
+	info.spans.clear();
+	pimpl->unused_roads.push_back(road);
+}
+
+const std::vector<vec_t>& roads_t::get_points(road_t road) const {
+	return pimpl->get(road).points;
+}
+
+void roads_t::move_point(road_t road,size_t i,const vec_t& pos) {
+	pimpl_t::road_info_t& info = pimpl->get(road);
+	if(i >= info.points.size())
+		panic("road " << road << " has no point " << i);
+	info.points[i] = pos;
+	pimpl->touch(road,i);
+}
+
+void roads_t::insert_point(road_t road,size_t i,const vec_t& pos) {
+	pimpl_t::road_info_t& info = pimpl->get(road);
+	if(i > info.points.size())
+		panic("road " << road << " has no point " << i);
+	info.points.insert(info.points.begin()+i,pos);
+	// a new span; the old ones keep their slots, although those around it change shape
+	const size_t span = std::min(i,info.spans.size());
+	info.spans.insert(info.spans.begin()+span,pimpl->alloc_slot(road,span));
+	pimpl->renumber(road,span);
+	pimpl->touch(road,i);
+}
+
+void roads_t::erase_point(road_t road,size_t i) {
+	pimpl_t::road_info_t& info = pimpl->get(road);
+	if(i >= info.points.size())
+		panic("road " << road << " has no point " << i);
+	if(info.points.size() <= 2)
+		panic("road " << road << " cannot have fewer than 2 points");
+	info.points.erase(info.points.begin()+i);
+	const size_t span = std::min(i,info.spans.size()-1);
+	pimpl->free_slot(info.spans[span]);
+	info.spans.erase(info.spans.begin()+span);
+	pimpl->renumber(road,span);
+	if(i)
+		pimpl->touch(road,i-1);
+	if(i < info.points.size())
+		pimpl->touch(road,i);
+}
+
+void roads_t::update() {
+	if(pimpl->dirty.size())
+		pimpl->upload();
+}
+
+void roads_t::draw() {
+	update();
+	if(pimpl->buffers.empty())
+		return;
+	glDisable(GL_LIGHTING);
+	glColor3f(1,1,1);
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,pimpl->indices);
+	for(std::vector<pimpl_t::buffer_t>::const_iterator b=pimpl->buffers.begin(); b!=pimpl->buffers.end(); b++) {
+		if(!b->used)
+			continue;
+		glBindBuffer(GL_ARRAY_BUFFER,b->vertices);
+		glVertexPointer(3,GL_FLOAT,sizeof(pimpl_t::vertex_t),(GLvoid*)offsetof(pimpl_t::vertex_t,pos));
+		glTexCoordPointer(2,GL_FLOAT,sizeof(pimpl_t::vertex_t),(GLvoid*)offsetof(pimpl_t::vertex_t,tex));
+		glDrawRangeElements(GL_TRIANGLES,0,b->used*SPAN_VERTICES-1,b->used*SPAN_INDICES,GL_UNSIGNED_SHORT,NULL);
+	}
+	glBindBuffer(GL_ARRAY_BUFFER,0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,0);
+	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+	glDisableClientState(GL_VERTEX_ARRAY);
+	glEnable(GL_LIGHTING);
+}
+
+void roads_t::benchmark() {
+	enum { ROADS = 1000, POINTS = 8, EDITS = 100 };
+	const float WIDTH = 0.01f, STEP = 0.03f;
+	std::vector<road_t> laid;
+	uint64_t start = high_precision_time();
+	for(int r=0; r<ROADS; r++) {
+		// a wander from a random start
+		std::vector<vec_t> points;
+		vec_t dir, pt;
+		do {
+			dir = vec_t(randf()-0.5f,randf()-0.5f,randf()-0.5f);
+		} while(dir.magnitude_sqrd() <= 0.0f);
+		while(points.size() < POINTS) {
+			dir = vec_t::normalise(dir);
+			if(pimpl->terrain.surface_at(dir,pt))
+				points.push_back(pt);
+			dir += vec_t(randf()-0.5f,randf()-0.5f,randf()-0.5f)*STEP;
+		}
+		laid.push_back(add(points,WIDTH));
+	}
+	const size_t spans = pimpl->dirty.size();
+	update();
+	const uint64_t lay = high_precision_time()-start;
+	// drag a point in the middle of some of them
+	start = high_precision_time();
+	for(int e=0; e<EDITS; e++) {
+		const road_t road = laid[rand()%laid.size()];
+		const vec_t pt = get_points(road)[POINTS/2];
+		move_point(road,POINTS/2,pt+vec_t(randf()-0.5f,randf()-0.5f,randf()-0.5f)*STEP/4);
+	}
+	const size_t edited = pimpl->dirty.size();
+	update();
+	const uint64_t edit = high_precision_time()-start;
+	// everything again, as rebuilding whole roads would
+	start = high_precision_time();
+	for(size_t slot=0; slot<pimpl->slots; slot++)
+		pimpl->dirty.insert(slot);
+	update();
+	const uint64_t all = high_precision_time()-start;
+	// inserting and erasing must leave every road's spans in order
+	for(int e=0; e<EDITS; e++) {
+		const road_t road = laid[rand()%laid.size()];
+		const vec_t a = get_points(road)[1], b = get_points(road)[2];
+		insert_point(road,2,(a+b)/2);
+		erase_point(road,1+rand()%3);
+	}
+	bool ordered = true;
+	for(size_t r=0; r<laid.size(); r++) {
+		const pimpl_t::road_info_t& info = pimpl->roads[laid[r]];
+		ordered = ordered && (info.spans.size()+1 == info.points.size());
+		for(size_t s=0; s<info.spans.size(); s++)
+			ordered = ordered && (pimpl->owners[info.spans[s]].road == laid[r]) && (pimpl->owners[info.spans[s]].span == s);
+	}
+	update();
+	for(size_t r=0; r<laid.size(); r++)
+		remove(laid[r]);
+	update();
+	std::cout << "roads: " << ROADS << " roads of " << spans << " spans in " << pimpl->buffers.size() <<
+		" buffers laid in " << lay << " ns; " << EDITS << " points moved, " << edited << " spans redone in " <<
+		edit << " ns, all of them " << all << " ns; spans " << (ordered? "ordered": "DISORDERED") <<
+		" after inserts and erases" << std::endl;
+}
@@ -0,0 +1,38 @@
+/*
+ roads.hpp is part of the GlestNG RTS game engine.
+ Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE version 3
+ See LICENSE for details
+ (c) William Edwards, 2011; all rights reserved
+*/
+
+#ifndef __ROADS_HPP__
+#define __ROADS_HPP__
+
+#include <vector>
+
+#include "terrain.hpp"
+
+/* roads laid over the terrain, after prototyping/roads.py; each road is a Hermite spline
+through its points, tessellated into a ribbon whose edges are projected onto the surface with
+surface_at.  Every span between two points gets the same number of vertices, so spans are
+slots in a few big vertex buffers, and editing a point only tessellates and uploads again the
+spans whose curve it shapes */
+struct roads_t {
+	roads_t(const terrain_t& terrain);
+	~roads_t();
+	typedef size_t road_t;
+	road_t add(const std::vector<vec_t>& points,float width); // points are on the surface
+	void remove(road_t road);
+	const std::vector<vec_t>& get_points(road_t road) const;
+	void move_point(road_t road,size_t i,const vec_t& pos);
+	void insert_point(road_t road,size_t i,const vec_t& pos); // before point i
+	void erase_point(road_t road,size_t i);
+	void update(); // tessellates the spans edited since the last update in parallel, and uploads them
+	void draw(); // updates if need be; the caller binds the road texture, which repeats every width along a road
+	void benchmark(); // prints timings to stdout
+private:
+	struct pimpl_t;
+	pimpl_t* pimpl;
+};
+
+#endif //__ROADS_HPP__
@@ -0,0 +1,413 @@
+/*
+ settlement.cpp is part of the GlestNG RTS game engine.
+ Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE version 3
+ See LICENSE for details
+ (c) William Edwards, 2011; all rights reserved
+*/
+
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <set>
+#include <iostream>
+#include <stdlib.h>
+#include <math.h>
+#include <stddef.h>
+#include <inttypes.h>
+
+#include "settlement.hpp"
+#include "placement.hpp"
+#include "planet.hpp"
+#include "utils.hpp"
+#include "error.hpp"
+
+enum {
+	MARGIN = 1, // free cells kept on the far sides of each footprint, so houses do not touch
+	FLOORS = 3, // the prototype's 0.6 tall at its lowest floor height
+};
+
+static const float
+	FOUNDATION = 0.5f, // walls go this far below the footprint's centre, so a house on a slope never floats
+	SLOPE = 1.0f/2.5f, // of the steep lower part of gambrel and mansard roofs, as the prototype
+	CHIMNEY_POS = 0.2f, CHIMNEY_W = 0.4f, CHIMNEY_D = 0.8f; // in floor heights, as the prototype
+
+static const GLubyte
+	WALL[4] = {225,210,170,255},
+	ROOF[4] = {140,60,45,255},
+	CHIMNEY[4] = {110,100,90,255};
+
+struct settlements_t::pimpl_t {
+	pimpl_t(planet_t& p): planet(p), vbo(0), uploaded(0), dirty(false) {}
+	planet_t& planet;
+	enum roof_t { GAMBREL, PITCH, MANSARD };
+	struct key_t { // everything that decides the shape of a house; lengths are in floor heights
+		roof_t roof;
+		bool hip; // the top of the roof
+		int floors, depth;
+		int width() const { return depth*2; }
+		bool operator<(const key_t& o) const {
+			if(roof != o.roof) return roof < o.roof;
+			if(hip != o.hip) return hip < o.hip;
+			if(floors != o.floors) return floors < o.floors;
+			return depth < o.depth;
+		}
+	};
+	struct vertex_t {
+		GLfloat pos[3];
+		GLfloat normal[3];
+		GLubyte colour[4];
+	};
+	struct type_t {
+		key_t key;
+		GLint first; // in vertices
+		GLsizei count;
+	};
+	std::vector<type_t> types;
+	std::map<key_t,size_t> type_of;
+	std::vector<vertex_t> vertices; // of every type, one after another
+	GLuint vbo;
+	size_t uploaded; // vertices on the GPU
+	struct house_t {
+		size_t type;
+		placement_t::site_t site;
+		GLfloat transform[16];
+	};
+	std::vector<house_t> houses;
+	bool dirty;
+	std::vector<GLfloat> transforms;
+	batches_t batches;
+	static float next(uint32_t& state) {
+		state = state*1664525u+1013904223u;
+		return (state>>8)/16777216.0f;
+	}
+	key_t pick(uint32_t& state) const;
+	size_t type(const key_t& key);
+	void make(const key_t& key);
+	void tri(vec_t a,vec_t b,vec_t c,const vec_t& inside,const GLubyte* colour);
+	void quad(const vec_t& a,const vec_t& b,const vec_t& c,const vec_t& d,const vec_t& inside,const GLubyte* colour);
+	struct ring_t { float x0, x1, z0, z1, y; };
+	void roof(const ring_t& from,const ring_t& to,const vec_t& inside);
+	void box(float x0,float x1,float y0,float y1,float z0,float z1,bool top,const GLubyte* colour);
+	static uint64_t cellmap(int width,int depth) { // a row per depth
+		uint64_t cellmap = 0;
+		for(int y=0; y<depth; y++)
+			cellmap |= uint64_t((1 << width)-1) << (y*8);
+		return cellmap;
+	}
+	void place(house_t& house,const key_t& key);
+	void group();
+};
+
+settlements_t::pimpl_t::key_t settlements_t::pimpl_t::pick(uint32_t& state) const {
+	// the prototype's roulettes
+	key_t key;
+	const float floor_height = 0.2f+0.1f*next(state);
+	const int most = (int)floor(0.6f/floor_height);
+	key.floors = 1+(int)(next(state)*most);
+	if(key.floors > most) key.floors = most;
+	const float roof = next(state)*2.4f;
+	key.roof = roof < 1.0f? GAMBREL: roof < 1.4f? PITCH: MANSARD;
+	const bool hip = next(state) < 0.5f, deep = next(state) < 0.5f;
+	if(key.roof == PITCH) {
+		key.hip = false;
+		key.depth = deep? 3: 2;
+	} else {
+		key.hip = hip;
+		key.depth = key.floors > 2? 3: 2;
+	}
+	return key;
+}
+
+size_t settlements_t::pimpl_t::type(const key_t& key) {
+	std::map<key_t,size_t>::const_iterator t = type_of.find(key);
+	if(t != type_of.end())
+		return t->second;
+	const size_t id = types.size();
+	types.push_back(type_t());
+	types.back().key = key;
+	types.back().first = vertices.size();
+	make(key);
+	types.back().count = vertices.size()-types.back().first;
+	type_of[key] = id;
+	return id;
+}
+
+void settlements_t::pimpl_t::tri(vec_t a,vec_t b,vec_t c,const vec_t& inside,const GLubyte* colour) {
+	vec_t n = (b-a).cross(c-a);
+	if(n.magnitude_sqrd() < 0.000001f) // where a roof's edges meet at a point
+		return;
+	if(n.dot((a+b+c)/3-inside) < 0) {
+		std::swap(b,c);
+		n = -n;
+	}
+	n = vec_t::normalise(n);
+	const vec_t* v[3] = {&a,&b,&c};
+	for(int i=0; i<3; i++) {
+		vertices.push_back(vertex_t());
+		vertex_t& out = vertices.back();
+		out.pos[0] = v[i]->x; out.pos[1] = v[i]->y; out.pos[2] = v[i]->z;
+		out.normal[0] = n.x; out.normal[1] = n.y; out.normal[2] = n.z;
+		for(int j=0; j<4; j++)
+			out.colour[j] = colour[j];
+	}
+}
+
+void settlements_t::pimpl_t::quad(const vec_t& a,const vec_t& b,const vec_t& c,const vec_t& d,const vec_t& inside,const GLubyte* colour) {
+	tri(a,b,c,inside,colour);
+	tri(a,c,d,inside,colour);
+}
+
+void settlements_t::pimpl_t::roof(const ring_t& from,const ring_t& to,const vec_t& inside) {
+	// the four sides from one outline of the roof up to the next
+	const vec_t
+		a(from.x0,from.y,from.z0), b(from.x1,from.y,from.z0), c(from.x1,from.y,from.z1), d(from.x0,from.y,from.z1),
+		e(to.x0,to.y,to.z0), f(to.x1,to.y,to.z0), g(to.x1,to.y,to.z1), h(to.x0,to.y,to.z1);
+	quad(a,b,f,e,inside,ROOF); // front
+	quad(d,c,g,h,inside,ROOF); // back
+	quad(a,d,h,e,inside,ROOF); // left
+	quad(b,c,g,f,inside,ROOF); // right
+}
+
+void settlements_t::pimpl_t::box(float x0,float x1,float y0,float y1,float z0,float z1,bool top,const GLubyte* colour) {
+	const vec_t inside((x0+x1)/2,(y0+y1)/2,(z0+z1)/2),
+		a(x0,y0,z0), b(x1,y0,z0), c(x1,y0,z1), d(x0,y0,z1),
+		e(x0,y1,z0), f(x1,y1,z0), g(x1,y1,z1), h(x0,y1,z1);
+	quad(a,b,f,e,inside,colour);
+	quad(d,c,g,h,inside,colour);
+	quad(a,d,h,e,inside,colour);
+	quad(b,c,g,f,inside,colour);
+	if(top)
+		quad(e,f,g,h,inside,colour);
+}
+
+void settlements_t::pimpl_t::make(const key_t& key) {
+	// the house's footprint is [0,width]x[0,depth], and it stands on y=0
+	const float w = key.width(), d = key.depth, h = key.floors;
+	box(0,w,-FOUNDATION,h,0,d,false,WALL);
+	const vec_t inside(w/2,h,d/2);
+	ring_t ring = {0,w,0,d,h};
+	if(key.roof != PITCH) {
+		// a steep lower part a floor high, then a shallow top
+		const float x = (key.roof == MANSARD)? SLOPE: 0;
+		const ring_t steep = {x,w-x,SLOPE,d-SLOPE,h+1};
+		roof(ring,steep,inside);
+		ring = steep;
+	}
+	const float pitch = (key.roof == PITCH)? 2: 4,
+		height = (ring.z1-ring.z0)/pitch, x = key.hip? height: 0;
+	const ring_t ridge = {ring.x0+x,ring.x1-x,(ring.z0+ring.z1)/2,(ring.z0+ring.z1)/2,ring.y+height};
+	roof(ring,ridge,inside);
+	const float cx = w*CHIMNEY_POS, cz = d*CHIMNEY_POS;
+	box(cx-CHIMNEY_W/2,cx+CHIMNEY_W/2,h,h+(ridge.y-h)*1.2f,cz-CHIMNEY_D/2,cz+CHIMNEY_D/2,true,CHIMNEY);
+}
+
+void settlements_t::pimpl_t::place(house_t& house,const key_t& key) {
+	// the footprint's first lattice row is along the house's width, and up is away from the centre
+	const mesh_t& mesh = *planet.meshes[house.site.mesh];
+	const vec_t centre = planet.get_placement().centre(house.site,cellmap(key.width(),key.depth),key.width()+MARGIN),
+		up = vec_t::normalise(centre),
+		along = planet.points[mesh.lattice_at(house.site.i+1,house.site.j)]-planet.points[mesh.lattice_at(house.site.i,house.site.j)];
+	const float scale = sqrt(along.magnitude_sqrd());
+	const vec_t x = vec_t::normalise(along-up*along.dot(up)), z = x.cross(up),
+		origin = centre-x*(scale*key.width()/2)-z*(scale*key.depth/2);
+	const vec_t* axes[4] = {&x,&up,&z,&origin};
+	for(int a=0; a<4; a++) {
+		const float s = (a<3)? scale: 1;
+		house.transform[a*4+0] = axes[a]->x*s;
+		house.transform[a*4+1] = axes[a]->y*s;
+		house.transform[a*4+2] = axes[a]->z*s;
+		house.transform[a*4+3] = (a<3)? 0: 1;
+	}
+}
+
+void settlements_t::pimpl_t::group() {
+	// a counting sort of the houses by type, so each type's transforms are contiguous
+	batches.clear();
+	std::vector<size_t> start(types.size()+1,0);
+	for(std::vector<house_t>::const_iterator h=houses.begin(); h!=houses.end(); h++)
+		start[h->type+1]++;
+	for(size_t t=0; t<types.size(); t++) {
+		if(start[t+1]) {
+			const batch_t batch = {t,start[t],start[t+1]};
+			batches.push_back(batch);
+		}
+		start[t+1] += start[t];
+	}
+	transforms.resize(houses.size()*16);
+	for(std::vector<house_t>::const_iterator h=houses.begin(); h!=houses.end(); h++) {
+		GLfloat* out = &transforms[start[h->type]++*16];
+		for(int i=0; i<16; i++)
+			out[i] = h->transform[i];
+	}
+	dirty = false;
+}
+
+settlements_t::settlements_t(planet_t& planet): pimpl(new pimpl_t(planet)) {
+	typedef int CHECK[FLOORS*2+MARGIN <= 8] __attribute__((unused)); // cellmaps are 8x8 at most
+}
+
+settlements_t::~settlements_t() {
+	if(pimpl->vbo)
+		graphics()->free_vbo(pimpl->vbo);
+	delete pimpl;
+}
+
+size_t settlements_t::found(const vec_t& near,size_t houses,unsigned seed) {
+	/* there are only as many footprints as depths, so each is searched for once, nearest
+	first, and houses take the first of its sites that is still free */
+	placement_t& placement = pimpl->planet.get_placement();
+	typedef std::map<int,std::pair<placement_t::query_t,size_t> > candidates_t; // by depth
+	candidates_t candidates;
+	uint32_t state = seed*2654435761u+1;
+	size_t built = 0;
+	for(size_t i=0; i<houses; i++) {
+		const pimpl_t::key_t key = pimpl->pick(state);
+		const int size = key.width()+MARGIN;
+		candidates_t::iterator c = candidates.find(key.depth);
+		if(c == candidates.end()) {
+			c = candidates.insert(candidates_t::value_type(key.depth,std::make_pair(
+				placement_t::query_t(near,pimpl_t::cellmap(size,key.depth+MARGIN),size,houses*size*(key.depth+MARGIN)),0))).first;
+			placement.find_sites(c->second.first);
+		}
+		const placement_t::query_t& query = c->second.first;
+		size_t& next = c->second.second;
+		while((next < query.sites.size()) && !placement.fits(query.sites[next],query.cellmap,size))
+			next++;
+		if(next == query.sites.size())
+			continue;
+		pimpl->houses.push_back(pimpl_t::house_t());
+		pimpl_t::house_t& house = pimpl->houses.back();
+		house.type = pimpl->type(key);
+		house.site = query.sites[next];
+		placement.occupy(house.site,query.cellmap,size);
+		pimpl->place(house,key);
+		built++;
+	}
+	if(built)
+		pimpl->dirty = true;
+	return built;
+}
+
+void settlements_t::clear() {
+	placement_t& placement = pimpl->planet.get_placement();
+	for(std::vector<pimpl_t::house_t>::const_iterator h=pimpl->houses.begin(); h!=pimpl->houses.end(); h++) {
+		const pimpl_t::key_t& key = pimpl->types[h->type].key;
+		const int size = key.width()+MARGIN;
+		placement.occupy(h->site,pimpl_t::cellmap(size,key.depth+MARGIN),size,false);
+	}
+	pimpl->houses.clear();
+	pimpl->dirty = true;
+}
+
+void settlements_t::update() {
+	if(pimpl->dirty)
+		pimpl->group();
+}
+
+const settlements_t::batches_t& settlements_t::get_batches() const {
+	return pimpl->batches;
+}
+
+const std::vector<GLfloat>& settlements_t::get_transforms() const {
+	return pimpl->transforms;
+}
+
+size_t settlements_t::types() const {
+	return pimpl->types.size();
+}
+
+size_t settlements_t::houses() const {
+	return pimpl->houses.size();
+}
+
+void settlements_t::draw() {
+	update();
+	if(pimpl->batches.empty())
+		return;
+	if(pimpl->uploaded != pimpl->vertices.size()) {
+		// new types are rare, so all of them go up again
+		if(!pimpl->vbo)
+			pimpl->vbo = graphics()->alloc_vbo();
+		graphics()->load_vbo(pimpl->vbo,
+			GL_ARRAY_BUFFER,
+			pimpl->vertices.size()*sizeof(pimpl_t::vertex_t),
+			&pimpl->vertices[0],
+			GL_STATIC_DRAW);
+		pimpl->uploaded = pimpl->vertices.size();
+	}
+	glBindBuffer(GL_ARRAY_BUFFER,pimpl->vbo);
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glVertexPointer(3,GL_FLOAT,sizeof(pimpl_t::vertex_t),(GLvoid*)offsetof(pimpl_t::vertex_t,pos));
+	glEnableClientState(GL_NORMAL_ARRAY);
+	glNormalPointer(GL_FLOAT,sizeof(pimpl_t::vertex_t),(GLvoid*)offsetof(pimpl_t::vertex_t,normal));
+	glEnableClientState(GL_COLOR_ARRAY);
+	glColorPointer(4,GL_UNSIGNED_BYTE,sizeof(pimpl_t::vertex_t),(GLvoid*)offsetof(pimpl_t::vertex_t,colour));
+	glBindBuffer(GL_ARRAY_BUFFER,0);
+	// the vertex arrays are set once for every house, then each type is one instanced draw where the GL can
+	glMatrixMode(GL_MODELVIEW);
+	const bool instanced = graphics()->can_instance();
+	for(batches_t::const_iterator b=pimpl->batches.begin(); b!=pimpl->batches.end(); b++) {
+		const pimpl_t::type_t& type = pimpl->types[b->type];
+		const GLfloat* transform = &pimpl->transforms[b->first*16];
+		if(instanced) {
+			graphics()->begin_instances(transform,b->count);
+			glDrawArraysInstancedARB(GL_TRIANGLES,type.first,type.count,b->count);
+			graphics()->end_instances();
+			continue;
+		}
+		for(size_t i=0; i<b->count; i++, transform+=16) {
+			glPushMatrix();
+			glMultMatrixf(transform);
+			glDrawArrays(GL_TRIANGLES,type.first,type.count);
+			glPopMatrix();
+		}
+	}
+	glDisableClientState(GL_COLOR_ARRAY);
+	glDisableClientState(GL_NORMAL_ARRAY);
+	glDisableClientState(GL_VERTEX_ARRAY);
+}
+
+void settlements_t::benchmark() {
+	enum { TOWNS = 50, HOUSES = 40 };
+	const planet_t& planet = pimpl->planet;
+	clear();
+	uint64_t start = high_precision_time();
+	size_t built = 0;
+	for(int t=0; t<TOWNS; t++) {
+		GLuint p;
+		do {
+			p = rand()%planet.points.size();
+		} while(planet.types[p] != planet_t::LAND);
+		built += found(planet.points[p],HOUSES,t);
+	}
+	const uint64_t founding = high_precision_time()-start;
+	start = high_precision_time();
+	update();
+	const uint64_t grouping = high_precision_time()-start;
+	// every house's own mesh, as the prototype would make them
+	size_t unshared = 0;
+	for(std::vector<pimpl_t::house_t>::const_iterator h=pimpl->houses.begin(); h!=pimpl->houses.end(); h++)
+		unshared += pimpl->types[h->type].count;
+	// no two footprints may cover the same point, and each batch must hold only its type
+	std::set<GLuint> covered;
+	size_t overlaps = 0, misgrouped = 0;
+	for(std::vector<pimpl_t::house_t>::const_iterator h=pimpl->houses.begin(); h!=pimpl->houses.end(); h++) {
+		const pimpl_t::key_t& key = pimpl->types[h->type].key;
+		const mesh_t& mesh = *planet.meshes[h->site.mesh];
+		for(int y=0; y<key.depth; y++)
+			for(int x=0; x<key.width(); x++)
+				if(h->site.i+x+h->site.j+y <= mesh.N)
+					overlaps += !covered.insert(mesh.lattice_at(h->site.i+x,h->site.j+y)).second;
+	}
+	size_t grouped = 0;
+	for(batches_t::const_iterator b=pimpl->batches.begin(); b!=pimpl->batches.end(); b++) {
+		grouped += b->count;
+		misgrouped += (b->first != grouped-b->count);
+	}
+	misgrouped += (grouped != pimpl->houses.size()) + (pimpl->transforms.size() != grouped*16);
+	std::cout << "settlements: " << TOWNS << " towns of " << HOUSES << " houses, " << built << " built in " <<
+		founding << " ns; " << types() << " house meshes of " << pimpl->vertices.size() << " vertices shared, " <<
+		unshared << " vertices unshared; " << pimpl->batches.size() << " batches grouped in " << grouping << " ns, " <<
+		misgrouped << " misgrouped; " << overlaps << " points overlap" << std::endl;
+	clear();
+}
@@ -0,0 +1,44 @@
+/*
+ settlement.hpp is part of the GlestNG RTS game engine.
+ Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE version 3
+ See LICENSE for details
+ (c) William Edwards, 2011; all rights reserved
+*/
+
+#ifndef __SETTLEMENT_HPP__
+#define __SETTLEMENT_HPP__
+
+#include <vector>
+
+#include "3d.hpp"
+#include "graphics.hpp"
+
+struct planet_t;
+
+/* villages of houses, after prototyping/houses.py; each house is drawn from the prototype's
+roulettes, but its shape depends only on a handful of discrete choices, so identical houses
+share one mesh.  Footprints are placed with the planet's placement_t, so they are only on
+flat enough land and never overlap each other or buildings; the instance transforms of every
+house are kept in one buffer, grouped by type */
+struct settlements_t {
+	settlements_t(planet_t& planet);
+	~settlements_t();
+	size_t found(const vec_t& near,size_t houses,unsigned seed); // returns how many houses it found room for
+	void clear(); // pulls every house down, freeing their sites
+	struct batch_t { // the instances of a house type are transforms [first,first+count)
+		size_t type, first, count;
+	};
+	typedef std::vector<batch_t> batches_t;
+	void update(); // regroups the transforms if houses were added
+	const batches_t& get_batches() const;
+	const std::vector<GLfloat>& get_transforms() const; // 16 per instance, column-major as glMultMatrixf
+	size_t types() const; // distinct house meshes made so far
+	size_t houses() const;
+	void draw(); // updates if need be
+	void benchmark(); // prints timings to stdout
+private:
+	struct pimpl_t;
+	pimpl_t* pimpl;
+};
+
+#endif //__SETTLEMENT_HPP__
@@ -0,0 +1,290 @@
+/*
+ sight.cpp is part of the GlestNG RTS game engine.
+ Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE version 3
+ See LICENSE for details
+ (c) William Edwards, 2011; all rights reserved
+*/
+
+#include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+#include <iostream>
+#include <math.h>
+
+#include "sight.hpp"
+#include "planet.hpp"
+#include "error.hpp"
+
+enum {
+	MARCH_STEPS = 32, // lines needing more samples than this descend the hierarchy instead
+};
+
+static bool same(const vec_t& a,const vec_t& b) {
+	return (a.x == b.x) && (a.y == b.y) && (a.z == b.z);
+}
+
+struct sight_t::pimpl_t {
+	pimpl_t(const planet_t& p);
+	const planet_t& planet;
+	float step; // between samples when marching; half a face's edge, or of the generated detail's
+	float ends; // how much of each end of a line is not tested
+	std::vector<sphere_t> bounds; // of each planet lookup node's faces, as they are now
+	void init(GLuint node);
+	bool ignored(float len,float& lo,float& hi) const; // the fraction of line to test
+	bool march(const vec_t& eye,const vec_t& target) const;
+	bool under(const ray_t& line,float lo,float hi,float from,float to) const; // any sample between from and to is below the surface
+	bool descend(const vec_t& eye,const vec_t& target) const;
+	bool blocked(GLuint node,const ray_t& line,float lo,float hi) const;
+	bool face_blocks(GLuint node,const ray_t& line,float lo,float hi) const; // node is a leaf
+	static bool crosses(const face_t& f,const fixed_array_t<vec_t>& points,const ray_t& line,float lo,float hi);
+	struct cached_t {
+		vec_t eye;
+		std::vector<vec_t> targets;
+		std::vector<bool> visible;
+	};
+	typedef std::map<const void*,cached_t> cache_t;
+	cache_t cache;
+};
+
+sight_t::pimpl_t::pimpl_t(const planet_t& p): planet(p), bounds(p.lookup.size(),sphere_t(vec_t(0,0,0),0)) {
+	const face_t& f = planet.faces[0];
+	step = vec_t::normalise(planet.points[f.a]).distance(vec_t::normalise(planet.points[f.b]))/2;
+	ends = step/5;
+	step /= 1 << planet.detail_levels;
+	for(GLuint i=0; i<20; i++)
+		init(i);
+}
+
+void sight_t::pimpl_t::init(GLuint node) {
+	const planet_t::lookup_t& l = planet.lookup[node];
+	sphere_t& s = bounds[node];
+	if(!l.child) { // a face
+		const vec_t &a = planet.points[l.tri.a], &b = planet.points[l.tri.b], &c = planet.points[l.tri.c];
+		s.centre = (a+b+c)/3;
+		s.radius = std::max(s.centre.distance(a),std::max(s.centre.distance(b),s.centre.distance(c)))+planet.detail_relief;
+		return;
+	}
+	s.centre = vec_t(0,0,0);
+	for(int i=0; i<4; i++) {
+		init(l.child+i);
+		s.centre += bounds[l.child+i].centre;
+	}
+	s.centre = s.centre/4;
+	s.radius = 0;
+	for(int i=0; i<4; i++) {
+		const sphere_t& child = bounds[l.child+i];
+		s.radius = std::max(s.radius,s.centre.distance(child.centre)+child.radius);
+	}
+}
+
+bool sight_t::pimpl_t::ignored(float len,float& lo,float& hi) const {
+	if(len <= ends*2)
+		return true;
+	lo = ends/len;
+	hi = 1.0f-lo;
+	return false;
+}
+
+bool sight_t::pimpl_t::march(const vec_t& eye,const vec_t& target) const {
+	const ray_t line(eye,target-eye);
+	const float len = sqrt(line.ddot);
+	float lo, hi;
+	if(ignored(len,lo,hi))
+		return true;
+	return !under(line,lo,hi,0,1);
+}
+
+bool sight_t::pimpl_t::under(const ray_t& line,float lo,float hi,float from,float to) const {
+	// at the same samples whatever the span, so that descending agrees with marching
+	const int steps = (int)ceil(sqrt(line.ddot)/step);
+	for(int i=std::max(1,(int)ceil(from*steps)), stop=std::min(steps-1,(int)floor(to*steps)); i<=stop; i++) {
+		const float t = (float)i/steps;
+		if((t < lo) || (t > hi))
+			continue;
+		const vec_t pt = line.o+line.d*t;
+		vec_t ground;
+		if(planet.surface_at(vec_t::normalise(pt),ground) && (pt.magnitude_sqrd() < ground.magnitude_sqrd()))
+			return true;
+	}
+	return false;
+}
+
+bool sight_t::pimpl_t::crosses(const face_t& f,const fixed_array_t<vec_t>& points,const ray_t& line,float lo,float hi) {
+	const triangle_t tri(points[f.a],points[f.b],points[f.c]);
+	vec_t I;
+	if(!tri.intersection(line,I))
+		return false;
+	const float t = (I-line.o).dot(line.d)/line.ddot;
+	return (t >= lo) && (t <= hi);
+}
+
+bool sight_t::pimpl_t::blocked(GLuint node,const ray_t& line,float lo,float hi) const {
+	const sphere_t& s = bounds[node];
+	if(line.nearest(s.centre).distance_sqrd(s.centre) > sqrd(s.radius))
+		return false;
+	const planet_t::lookup_t& l = planet.lookup[node];
+	if(!l.child)
+		return face_blocks(node,line,lo,hi);
+	for(int i=0; i<4; i++)
+		if(blocked(l.child+i,line,lo,hi))
+			return true;
+	return false;
+}
+
+bool sight_t::pimpl_t::face_blocks(GLuint node,const ray_t& line,float lo,float hi) const {
+	if(!planet.detail_levels)
+		return crosses(planet.lookup[node].tri,planet.points,line,lo,hi);
+	// the face is not what is drawn, so sample the generated detail where the line is within the face's bounds
+	const sphere_t& s = bounds[node];
+	const float miss = sqrd(s.radius)-line.nearest(s.centre).distance_sqrd(s.centre);
+	if(miss < 0)
+		return false;
+	const float mid = (s.centre-line.o).dot(line.d)/line.ddot, half = sqrt(miss/line.ddot);
+	return under(line,lo,hi,mid-half,mid+half);
+}
+
+bool sight_t::pimpl_t::descend(const vec_t& eye,const vec_t& target) const {
+	const ray_t line(eye,target-eye);
+	float lo, hi;
+	if(ignored(sqrt(line.ddot),lo,hi))
+		return true;
+	for(GLuint i=0; i<20; i++)
+		if(blocked(i,line,lo,hi))
+			return false;
+	return true;
+}
+
+sight_t::sight_t(const planet_t& planet): pimpl(new pimpl_t(planet)) {}
+
+sight_t::~sight_t() {
+	delete pimpl;
+}
+
+bool sight_t::visible(const vec_t& eye,const vec_t& target) const {
+	if(eye.distance_sqrd(target) > sqrd(pimpl->step*MARCH_STEPS))
+		return pimpl->descend(eye,target);
+	return pimpl->march(eye,target);
+}
+
+bool sight_t::visible_slow(const vec_t& eye,const vec_t& target) const {
+	const ray_t line(eye,target-eye);
+	float lo, hi;
+	if(pimpl->ignored(sqrt(line.ddot),lo,hi))
+		return true;
+	const planet_t& planet = pimpl->planet;
+	for(GLuint i=0; i<planet.lookup.size(); i++)
+		if(!planet.lookup[i].child && pimpl->face_blocks(i,line,lo,hi))
+			return false;
+	return true;
+}
+
+void sight_t::in_sight(const vec_t& eye,float radius,unsigned type,world_t::hits_t& hits) const {
+	world_t::hits_t near;
+	world()->intersection(sphere_t(eye,radius),type,near);
+	for(world_t::hits_t::const_iterator h=near.begin(); h!=near.end(); h++)
+		if(visible(eye,h->obj->centre))
+			hits.push_back(*h);
+}
+
+void sight_t::visible(queries_t& queries) {
+	// find each observer's cache entry first; an observer asking twice in a batch is not cached
+	std::vector<pimpl_t::cached_t*> cached(queries.size(),(pimpl_t::cached_t*)NULL);
+	std::set<const void*> seen;
+	for(size_t q=0; q<queries.size(); q++)
+		if(seen.insert(queries[q].observer).second)
+			cached[q] = &pimpl->cache[queries[q].observer];
+	#pragma omp parallel for schedule(dynamic)
+	for(int q=0; q<(int)queries.size(); q++) {
+		query_t& query = queries[q];
+		pimpl_t::cached_t* prev = cached[q];
+		const bool still = prev && same(prev->eye,query.eye);
+		query.visible.resize(query.targets.size());
+		for(size_t t=0; t<query.targets.size(); t++)
+			if(still && (t < prev->targets.size()) && same(prev->targets[t],query.targets[t]))
+				query.visible[t] = prev->visible[t];
+			else
+				query.visible[t] = visible(query.eye,query.targets[t]);
+		if(prev) {
+			prev->eye = query.eye;
+			prev->targets = query.targets;
+			prev->visible = query.visible;
+		}
+	}
+}
+
+void sight_t::forget(const void* observer) {
+	pimpl->cache.erase(observer);
+}
+
+void sight_t::moved(const std::set<size_t>& meshes) {
+	// terrain changes are rare, so every sphere is refitted rather than finding those over the meshes
+	if(meshes.empty())
+		return;
+	for(GLuint i=0; i<20; i++)
+		pimpl->init(i);
+	pimpl->cache.clear();
+}
+
+void sight_t::benchmark() {
+	enum { LINES = 2000, SLOW_LINES = 50, OBSERVERS = 256, TARGETS = 64 };
+	const float EYE = 0.004f, NEAR = 0.06f;
+	const planet_t& planet = pimpl->planet;
+	uint64_t start = high_precision_time();
+	for(GLuint i=0; i<20; i++)
+		pimpl->init(i);
+	uint64_t ns = high_precision_time()-start;
+	std::cout << "sight: " << pimpl->bounds.size() << " bounding spheres built in " << ns << " ns" << std::endl;
+	// eyes a little above the ground looking at the ground nearby, and across to the far side
+	std::vector<vec_t> eyes, near, far;
+	while(eyes.size() < LINES) {
+		const vec_t dir = vec_t::normalise(vec_t(randf()-0.5f,randf()-0.5f,randf()-0.5f)),
+			to = vec_t::normalise(dir+vec_t(randf()-0.5f,randf()-0.5f,randf()-0.5f)*NEAR),
+			away = vec_t::normalise(dir+vec_t(randf()-0.5f,randf()-0.5f,randf()-0.5f));
+		vec_t eye, target, distant;
+		if(!planet.surface_at(dir,eye) || !planet.surface_at(to,target) || !planet.surface_at(away,distant))
+			continue;
+		eyes.push_back(eye+dir*EYE);
+		near.push_back(target);
+		far.push_back(distant+away*EYE);
+	}
+	const std::vector<vec_t>* sets[2] = {&near,&far};
+	const char* names[2] = {"near","far"};
+	for(int s=0; s<2; s++) {
+		const std::vector<vec_t>& targets = *sets[s];
+		size_t seen = 0, disagree = 0, slow_disagree = 0;
+		start = high_precision_time();
+		for(size_t i=0; i<LINES; i++)
+			seen += pimpl->march(eyes[i],targets[i]);
+		const uint64_t march_ns = high_precision_time()-start;
+		start = high_precision_time();
+		for(size_t i=0; i<LINES; i++)
+			disagree += (pimpl->descend(eyes[i],targets[i]) != pimpl->march(eyes[i],targets[i]));
+		const uint64_t descend_ns = high_precision_time()-start-march_ns;
+		start = high_precision_time();
+		for(size_t i=0; i<SLOW_LINES; i++)
+			slow_disagree += (visible_slow(eyes[i],targets[i]) != pimpl->descend(eyes[i],targets[i]));
+		ns = high_precision_time()-start;
+		std::cout << "sight: " << LINES << " " << names[s] << " lines, " << seen << " clear; marching " <<
+			march_ns << " ns, descending " << descend_ns << " ns, " << disagree << " disagree; " <<
+			slow_disagree << " of " << SLOW_LINES << " disagree with testing every face (" << ns << " ns)" << std::endl;
+	}
+	queries_t queries;
+	for(int o=0; o<OBSERVERS; o++) {
+		queries.push_back(query_t(&eyes[o],eyes[o]));
+		for(int t=0; t<TARGETS; t++)
+			queries.back().targets.push_back(near[(o*TARGETS+t)%near.size()]);
+	}
+	start = high_precision_time();
+	visible(queries);
+	const uint64_t first = high_precision_time()-start;
+	for(int o=0; o<OBSERVERS; o+=2) // half the observers see one target move
+		queries[o].targets[0] = far[o];
+	start = high_precision_time();
+	visible(queries);
+	ns = high_precision_time()-start;
+	for(size_t q=0; q<queries.size(); q++)
+		forget(queries[q].observer);
+	std::cout << "sight: " << OBSERVERS << " observers of " << TARGETS << " targets in " << first <<
+		" ns, and again with some moved in " << ns << " ns" << std::endl;
+}
@@ -0,0 +1,47 @@
+/*
+ sight.hpp is part of the GlestNG RTS game engine.
+ Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE version 3
+ See LICENSE for details
+ (c) William Edwards, 2011; all rights reserved
+*/
+
+#ifndef __SIGHT_HPP__
+#define __SIGHT_HPP__
+
+#include <vector>
+#include <set>
+
+#include "world.hpp"
+
+struct planet_t;
+
+/* line of sight over the planet's relief; a sight line is the straight segment from an eye
+to a target.  Short lines march the great circle arc under them and compare against the height
+of the surface there; long lines descend a hierarchy of bounding spheres over the planet's
+subdivision to the faces they might cross.  Where the planet has generated detail, it is that
+surface which is marched, and faces are sampled rather than crossed, at the detail's spacing.
+The ends of a line are not tested, so that eyes and targets on the ground do not hide themselves */
+struct sight_t {
+	sight_t(const planet_t& planet);
+	~sight_t();
+	bool visible(const vec_t& eye,const vec_t& target) const;
+	bool visible_slow(const vec_t& eye,const vec_t& target) const; // against every face, for checking
+	void in_sight(const vec_t& eye,float radius,unsigned type,world_t::hits_t& hits) const; // those within radius it can see
+	struct query_t { // one observer looking at many targets
+		query_t(const void* o,const vec_t& e): observer(o), eye(e) {}
+		const void* observer; // results are kept against this until the eye, a target or the terrain moves
+		vec_t eye;
+		std::vector<vec_t> targets;
+		std::vector<bool> visible;
+	};
+	typedef std::vector<query_t> queries_t;
+	void visible(queries_t& queries); // in parallel
+	void forget(const void* observer);
+	void moved(const std::set<size_t>& meshes); // the terrain in these meshes has changed
+	void benchmark(); // prints timings to stdout
+private:
+	struct pimpl_t;
+	pimpl_t* pimpl;
+};
+
+#endif //__SIGHT_HPP__
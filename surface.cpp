@@ -0,0 +1,269 @@
+/*
+ surface.cpp is part of the GlestNG RTS game engine.
+ Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE version 3
+ See LICENSE for details
+ (c) William Edwards, 2011; all rights reserved
+*/
+
+#include <vector>
+#include <algorithm>
+#include <iostream>
+#include <limits.h>
+
+#include "surface.hpp"
+#include "planet.hpp"
+#include "error.hpp"
+
+struct surface_index_t::pimpl_t {
+	pimpl_t(const planet_t& p,size_t l);
+	const planet_t& planet;
+	const size_t levels;
+	struct node_t { // a face of the subdivision, with the cap on the unit sphere that covers it
+		vec_t centre;
+		float radius; // chord
+		vec_t edges[3]; // normals of the planes through the planet's centre and each edge, facing in
+		GLuint child; // the first of its 4 children in nodes, or 0 if it is a cell
+		size_t cell;
+		bool contains(const vec_t& dir) const {
+			return (dir.dot(edges[0]) >= 0) && (dir.dot(edges[1]) >= 0) && (dir.dot(edges[2]) >= 0);
+		}
+	};
+	std::vector<node_t> nodes; // the first 20 are the base faces
+	struct item_t {
+		item_t(type_t t,object_t* o): type(t), obj(o) {}
+		type_t type;
+		object_t* obj;
+	};
+	typedef std::vector<item_t> items_t;
+	std::vector<items_t> cells;
+	std::vector<GLuint> cell_nodes;
+	size_t count;
+	float max_radius; // of any object ever added, so queries can pad for them
+	void init(GLuint node,GLuint lookup,size_t depth);
+	size_t cell_at(const vec_t& pos) const;
+	void remove(size_t cell,object_t* obj);
+	void intersection(GLuint node,const vec_t& dir,float chord,const sphere_t& s,unsigned type,world_t::hits_t& hits) const;
+};
+
+surface_index_t::pimpl_t::pimpl_t(const planet_t& p,size_t l):
+	planet(p), levels(std::min(l,p.lookup_levels)), count(0), max_radius(0) {
+	nodes.resize(20);
+	for(GLuint i=0; i<20; i++)
+		init(i,i,0);
+}
+
+void surface_index_t::pimpl_t::init(GLuint node,GLuint lookup,size_t depth) {
+	const face_t& f = planet.lookup[lookup].tri;
+	const vec_t
+		a = vec_t::normalise(planet.points[f.a]),
+		b = vec_t::normalise(planet.points[f.b]),
+		c = vec_t::normalise(planet.points[f.c]),
+		centre = vec_t::normalise(a+b+c);
+	nodes[node].centre = centre;
+	nodes[node].radius = std::max(centre.distance(a),std::max(centre.distance(b),centre.distance(c)));
+	nodes[node].edges[0] = a.cross(b);
+	nodes[node].edges[1] = b.cross(c);
+	nodes[node].edges[2] = c.cross(a);
+	if(depth == levels) {
+		nodes[node].child = 0;
+		nodes[node].cell = cells.size();
+		cell_nodes.push_back(node);
+		cells.push_back(items_t());
+		return;
+	}
+	const GLuint child = nodes.size();
+	nodes[node].child = child;
+	nodes.resize(child+4);
+	for(int i=0; i<4; i++)
+		init(child+i,planet.lookup[lookup].child+i,depth+1);
+}
+
+size_t surface_index_t::pimpl_t::cell_at(const vec_t& d) const {
+	// as planet_t::find_lookup, but the nodes keep their edges to hand rather than looking up points
+	GLuint node = 0;
+	float best = -INT_MAX;
+	for(GLuint i=0; i<20; i++) {
+		const vec_t* edges = nodes[i].edges;
+		const float inside = std::min(d.dot(edges[0]),std::min(d.dot(edges[1]),d.dot(edges[2])));
+		if(inside > best) {
+			best = inside;
+			node = i;
+		}
+	}
+	while(const GLuint child = nodes[node].child) {
+		const node_t& m = nodes[child+3]; // the middle child
+		const float
+			to_a = d.dot(m.edges[2]),
+			to_b = d.dot(m.edges[0]),
+			to_c = d.dot(m.edges[1]);
+		if(to_a < 0 && to_a <= to_b && to_a <= to_c)
+			node = child;
+		else if(to_b < 0 && to_b <= to_c)
+			node = child+1;
+		else if(to_c < 0)
+			node = child+2;
+		else
+			node = child+3;
+	}
+	return nodes[node].cell;
+}
+
+void surface_index_t::pimpl_t::remove(size_t cell,object_t* obj) {
+	items_t& items = cells[cell];
+	for(items_t::iterator i=items.begin(); i!=items.end(); i++)
+		if(i->obj == obj) {
+			*i = items.back();
+			items.pop_back();
+			return;
+		}
+	panic(obj << " is not in cell " << cell);
+}
+
+void surface_index_t::pimpl_t::intersection(GLuint node,const vec_t& dir,float chord,const sphere_t& s,unsigned type,world_t::hits_t& hits) const {
+	const node_t& n = nodes[node];
+	if(n.centre.distance_sqrd(dir) > sqrd(n.radius+chord))
+		return;
+	if(n.child) {
+		for(int i=0; i<4; i++)
+			intersection(n.child+i,dir,chord,s,type,hits);
+		return;
+	}
+	const items_t& items = cells[n.cell];
+	for(items_t::const_iterator i=items.begin(); i!=items.end(); i++)
+		if((i->type&type) && i->obj->sphere_t::intersects(s))
+			hits.push_back(world_t::hit_t(s.centre.distance_sqrd(i->obj->centre),i->type,i->obj));
+}
+
+surface_index_t::surface_index_t(const planet_t& planet,size_t levels): pimpl(new pimpl_t(planet,levels)) {}
+
+surface_index_t::~surface_index_t() {
+	for(std::vector<pimpl_t::items_t>::iterator c=pimpl->cells.begin(); c!=pimpl->cells.end(); c++)
+		for(pimpl_t::items_t::iterator i=c->begin(); i!=c->end(); i++)
+			i->obj->surface_index = NULL;
+	delete pimpl;
+}
+
+void surface_index_t::add(object_t* obj) {
+	// the object keeps which cell it is in, as it keeps its octree node
+	if(obj->surface_index)
+		panic(obj << " is already in a surface index");
+	const size_t cell = pimpl->cell_at(obj->get_pos());
+	pimpl->cells[cell].push_back(pimpl_t::item_t(obj->type,obj));
+	obj->surface_index = this;
+	obj->surface_cell = cell;
+	pimpl->count++;
+	pimpl->max_radius = std::max(pimpl->max_radius,obj->radius);
+}
+
+void surface_index_t::remove(object_t* obj) {
+	if(obj->surface_index != this)
+		panic(obj << " is not in the surface index");
+	pimpl->remove(obj->surface_cell,obj);
+	obj->surface_index = NULL;
+	pimpl->count--;
+}
+
+void surface_index_t::moved(object_t* obj) {
+	if(obj->surface_index != this)
+		panic(obj << " is not in the surface index");
+	if(pimpl->nodes[pimpl->cell_nodes[obj->surface_cell]].contains(obj->get_pos()))
+		return; // most moves are small
+	const size_t cell = pimpl->cell_at(obj->get_pos());
+	pimpl->remove(obj->surface_cell,obj);
+	pimpl->cells[cell].push_back(pimpl_t::item_t(obj->type,obj));
+	obj->surface_cell = cell;
+	pimpl->max_radius = std::max(pimpl->max_radius,obj->radius);
+}
+
+size_t surface_index_t::size() const {
+	return pimpl->count;
+}
+
+void surface_index_t::intersection(const sphere_t& s,unsigned type,world_t::hits_t& hits) const {
+	/* an object p is hit if |p-s.centre| <= s.radius+p.radius; two points at least r from the
+	centre are at least r times as far apart as their directions, so compare directions padded
+	by that much.  Surface objects are never below the water */
+	const float height = s.centre.magnitude();
+	if(height <= 0) return;
+	const float below = (height < planet_t::WATER_LEVEL)? height: planet_t::WATER_LEVEL;
+	const float chord = (s.radius+pimpl->max_radius)/below;
+	const vec_t dir = s.centre/height;
+	for(GLuint i=0; i<20; i++)
+		pimpl->intersection(i,dir,chord,s,type,hits);
+}
+
+namespace {
+	struct probe_t: public object_t { // stands in for a unit
+		probe_t(const vec_t& pos,float r): object_t(UNIT) {
+			bounds_reset();
+			bounds_include(vec_t(-r,-r,-r));
+			bounds_include(vec_t(r,r,r));
+			set_pos(pos);
+		}
+		void draw(float) {}
+		bool refine_intersection(const ray_t&,vec_t&) { return false; }
+	};
+}
+
+void surface_index_t::benchmark() {
+	enum { UNITS = 10000, QUERIES = 10000 };
+	const float UNIT_RADIUS = 0.002f, SIGHT = 0.03f, STEP = 0.002f;
+	const planet_t& planet = pimpl->planet;
+	std::vector<probe_t*> units;
+	for(int i=0; i<UNITS; i++) {
+		vec_t dir, pt;
+		do {
+			dir = vec_t(randf()-0.5f,randf()-0.5f,randf()-0.5f);
+		} while((dir.magnitude_sqrd() <= 0.0f) || !planet.surface_at(dir.normalise(),pt));
+		units.push_back(new probe_t(pt,UNIT_RADIUS));
+	}
+	uint64_t start = high_precision_time();
+	for(size_t i=0; i<units.size(); i++)
+		world()->add(units[i]);
+	const uint64_t octree_add = high_precision_time()-start;
+	start = high_precision_time();
+	for(size_t i=0; i<units.size(); i++)
+		add(units[i]);
+	const uint64_t surface_add = high_precision_time()-start;
+	// each unit looks around itself
+	world_t::hits_t hits;
+	size_t octree_hits = 0, surface_hits = 0;
+	start = high_precision_time();
+	for(int i=0; i<QUERIES; i++) {
+		hits.clear();
+		world()->intersection(sphere_t(units[i%units.size()]->centre,SIGHT),UNIT,hits,world_t::DONT_SORT);
+		octree_hits += hits.size();
+	}
+	const uint64_t octree_query = high_precision_time()-start;
+	start = high_precision_time();
+	for(int i=0; i<QUERIES; i++) {
+		hits.clear();
+		intersection(sphere_t(units[i%units.size()]->centre,SIGHT),UNIT,hits);
+		surface_hits += hits.size();
+	}
+	const uint64_t surface_query = high_precision_time()-start;
+	// everyone takes a step; moving in the world moves it in the octree too, so time it alone first
+	std::vector<vec_t> to(units.size());
+	for(size_t i=0; i<units.size(); i++) {
+		vec_t pt;
+		const vec_t dir = units[i]->centre+vec_t(randf()-0.5f,randf()-0.5f,randf()-0.5f)*STEP;
+		to[i] = planet.surface_at(vec_t::normalise(dir),pt)? pt: units[i]->centre;
+	}
+	start = high_precision_time();
+	for(size_t i=0; i<units.size(); i++)
+		units[i]->set_pos(to[i]);
+	const uint64_t octree_move = high_precision_time()-start;
+	start = high_precision_time();
+	for(size_t i=0; i<units.size(); i++)
+		moved(units[i]);
+	const uint64_t surface_move = high_precision_time()-start;
+	for(size_t i=0; i<units.size(); i++) {
+		remove(units[i]);
+		delete units[i]; // takes it out of the world
+	}
+	std::cout << "surface index: " << pimpl->cells.size() << " cells, " << UNITS << " units; " <<
+		"add " << surface_add << " ns (octree " << octree_add << "), " <<
+		QUERIES << " queries " << surface_query << " ns (octree " << octree_query << "), " <<
+		"move " << surface_move << " ns (octree " << octree_move << "); " <<
+		surface_hits << " hits (octree " << octree_hits << ")" << std::endl;
+}
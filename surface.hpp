@@ -0,0 +1,36 @@
+/*
+ surface.hpp is part of the GlestNG RTS game engine.
+ Licensed under the GNU AFFERO GENERAL PUBLIC LICENSE version 3
+ See LICENSE for details
+ (c) William Edwards, 2011; all rights reserved
+*/
+
+#ifndef __SURFACE_HPP__
+#define __SURFACE_HPP__
+
+#include <vector>
+
+#include "world.hpp"
+
+struct planet_t;
+
+/* an index of objects on the surface of a planet, bucketed by the icosahedral cell
+they are over; a cell is a face of the planet's subdivision some levels down, so
+queries descend the subdivision from the 20 base faces rather than an octree that
+is mostly empty space.  Objects must stay near the surface */
+struct surface_index_t {
+	surface_index_t(const planet_t& planet,size_t levels=DEFAULT_LEVELS);
+	~surface_index_t();
+	enum { DEFAULT_LEVELS = 5 }; // below the base faces; 20*4^5 cells
+	void add(object_t* obj);
+	void remove(object_t* obj);
+	void moved(object_t* obj); // after it has been set_pos()ed
+	size_t size() const;
+	void intersection(const sphere_t& s,unsigned type,world_t::hits_t& hits) const;
+	void benchmark(); // prints timings to stdout
+private:
+	struct pimpl_t;
+	pimpl_t* pimpl;
+};
+
+#endif //__SURFACE_HPP__
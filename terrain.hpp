@@ -13,12 +13,27 @@
 #include <vector>
 
 struct terrain_t {
-	static terrain_t* gen_planet(size_t recursionLevel,size_t iterations,size_t smoothing_passes);
+	enum generator_t {
+		FAULT_LINES, // iterations is how many random planes raise one side and lower the other
+		NOISE, // iterations is how many octaves of gradient noise are summed
+	};
+	/* a seed of 0 is taken from the clock.  A recursionLevel from OUT_OF_CORE_LEVEL (planet.hpp)
+	up is only simulated at OUT_OF_CORE_LEVEL-1: paths, placement and editing work on those points.
+	The levels above, at most MAX_DETAIL_LEVELS of them, are generated from the seed as meshes come
+	close, and surface_at, and sight and roads through it, sample that generated surface */
+	static terrain_t* gen_planet(size_t recursionLevel,size_t iterations,size_t smoothing_passes,
+		generator_t generator=FAULT_LINES,unsigned seed=0);
 	static terrain_t* get_terrain();
 	virtual ~terrain_t() {}
 	virtual void draw_init() = 0;
 	virtual void draw_done() = 0;
 	virtual bool surface_at(const vec_t& normal,vec_t& pt) const = 0;
+	virtual void benchmark() = 0; // prints timings to stdout
+	// editing; centre is a direction from the centre of the planet, and radius is on the unit sphere
+	virtual void set_height(const vec_t& centre,float radius,float height) = 0;
+	virtual void flatten(const vec_t& centre,float radius) = 0; // to the height at the centre
+	// from and to are directions from the centre; the path is of points on the surface
+	virtual bool find_path(const vec_t& from,const vec_t& to,std::vector<vec_t>& path) = 0;
 	struct test_t {
 		test_t(const object_t* o,vec_t h): obj(o), hit(h) {}
 		const object_t* obj;
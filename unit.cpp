@@ -27,7 +27,7 @@ unit_type_t::~unit_type_t() { reset(); }
 bool unit_type_t::cellmap_at(int x,int y) const {
 	if(x<0 || x>=size || y<0 || y>=size)
 		panic(this<<" cellmap is "<<size<<", cannot get ("<<x<<','<<y<<')');
-	return cellmap & ((1<<x) << (y*8));
+	return cellmap & ((uint64_t(1)<<x) << (y*8));
 }
 
 void unit_type_t::reset() {
@@ -62,7 +62,7 @@ void unit_type_t::_load_xml(xml_parser_t::walker_t& xml) {
 				if((int)bits.size() != size) data_error("wrong number of bits in cellmap row");
 				for(int j=0; j<size; j++)
 					if(bits[j] == '1')
-						cellmap |= (1 << j) << (i*8);
+						cellmap |= (uint64_t(1) << j) << (i*8);
 					else if(bits[j] != '0')
 						data_error(bits[j]<<" is not binary digit");
 				xml.up();
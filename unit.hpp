@@ -28,6 +28,8 @@ public:
 	unit_type_t(faction_t& faction,const std::string& name);
 	~unit_type_t();
 	bool cellmap_at(int x,int y) const;
+	uint64_t get_cellmap() const { return cellmap; } // 8 bits per row, bit x of row y is cell (x,y)
+	int get_size() const { return size; }
 	const std::string path;
 	struct skill_t {
 		skill_t() {}
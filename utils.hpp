@@ -70,7 +70,7 @@ private:
 
 template<typename T> std::string fmtbin(T val,int digits = sizeof(T)*8) {
 	enum { BITS = sizeof(T)*8+1 };
-	typedef int CHECK[digits < BITS];
+	typedef int CHECK[digits < BITS] __attribute__((unused));
 	char out[BITS], *o = out;
 	for(int i=0; i<digits; i++,val>>=1)
 		*o++ = (val&1?'1':'0');
@@ -12,6 +12,7 @@
 
 
 #include "world.hpp"
+#include "surface.hpp"
 #include "error.hpp"
 #include "utils.hpp"
 
@@ -40,6 +41,7 @@ public:
 	void move(object_t* obj,const bounds_t& prev);
 	void intersection(const ray_t& r,unsigned type,world_t::hits_t& hits) const;
 	void intersection(const frustum_t& f,unsigned type,world_t::hits_t& hits,bool world_frustum) const;
+	void intersection(const sphere_t& s,unsigned type,world_t::hits_t& hits) const;
 	void dump(std::ostream& out) const;
 	void clear_frustum();
 	void check() const;
@@ -67,6 +69,7 @@ private:
 	void init_sub();
 	static void intersection(const items_t& items,const ray_t& r,unsigned type,world_t::hits_t& hits,uint8_t straddles=~0);
 	static void intersection(const items_t& items,const frustum_t& f,unsigned type,world_t::hits_t& hits,uint8_t straddles=~0);
+	static void intersection(const items_t& items,const sphere_t& s,unsigned type,world_t::hits_t& hits,uint8_t straddles=~0);
 	void add_all(const vec_t& origin,unsigned type,world_t::hits_t& hits,bool world_frustum) const;
 	static void add_all(const items_t& items,const vec_t& origin,unsigned type,world_t::hits_t& hits);
 };
@@ -364,6 +367,28 @@ void spatial_index_t::intersection(const frustum_t& f,unsigned type,world_t::hit
 	}
 }
 
+void spatial_index_t::intersection(const sphere_t& s,unsigned type,world_t::hits_t& hits) const {
+	uint8_t straddles = 0;
+	for(int i=0; i<8; i++)
+		if(((straddlers&(1<<i)) || sub[i].sub || sub[i].items.size()) && sub[i].bounds.sphere_t::intersects(s)) {
+			straddles |= (1 << i);
+			if(sub[i].sub)
+				sub[i].sub->intersection(s,type,hits);
+			else
+				intersection(sub[i].items,s,type,hits);
+		}
+	if(straddles&=straddlers)
+		intersection(items,s,type,hits,straddles);
+}
+
+void spatial_index_t::intersection(const items_t& items,const sphere_t& s,unsigned type,world_t::hits_t& hits,uint8_t straddles) {
+	for(items_t::const_iterator i=items.begin(); i!=items.end(); i++)
+		if((i->type&type) && (i->straddles&straddles)) {
+			if(i->obj->sphere_t::intersects(s))
+				hits.push_back(world_t::hit_t(s.centre.distance_sqrd(i->obj->centre),i->type,i->obj));
+		}
+}
+
 void spatial_index_t::add_all(const items_t& items,const vec_t& origin,unsigned type,world_t::hits_t& hits) {
 	for(items_t::const_iterator i=items.begin(); i!=items.end(); i++)
 		if(i->obj->type & type) {
@@ -505,6 +530,11 @@ void world_t::intersection(const frustum_t& f,unsigned type,hits_t& hits,sort_by
 	sort(hits,sort_by);
 }
 
+void world_t::intersection(const sphere_t& s,unsigned type,hits_t& hits,sort_by_t sort_by) {
+	pimpl->idx.intersection(s,type,hits);
+	sort(hits,sort_by);
+}
+
 void world_t::dump(std::ostream& out) const {
 	pimpl->idx.dump(out);
 }
@@ -579,16 +609,19 @@ intersection_t world_t::is_visible(const bounds_t& bounds) const {
 	return frustum().contains(bounds);
 }
 
-object_t::object_t(type_t t): type(t), spatial_index(NULL), pos(0,0,0),
-	straddles(0), visible(false) {}
+object_t::object_t(type_t t): type(t), spatial_index(NULL), surface_index(NULL), surface_cell(0),
+	pos(0,0,0), offset(0,0,0), straddles(0), visible(false) {}
 
 object_t::~object_t() {
 	if(spatial_index)
 		world()->remove(this);
+	if(surface_index)
+		surface_index->remove(this);
 }
 
 void object_t::bounds_reset() {
 	bounds.bounds_reset();
+	offset = vec_t(0,0,0);
 }
 
 void object_t::bounds_include(const vec_t& v) {
@@ -599,13 +632,22 @@ void object_t::bounds_fix() {
 	set_pos(get_pos());
 }
 
+void object_t::set_bounds(const aabb_t& box) {
+	bounds.bounds_reset();
+	bounds.bounds_include(box.a);
+	bounds.bounds_include(box.b);
+	bounds.bounds_fix();
+	offset = bounds.centre;
+	bounds_fix();
+}
+
 void object_t::set_pos(const vec_t& absolute) {
 	if(spatial_index) {
 		const bounds_t prev(*this);
 		const bool was_visible = visible;
 		bounds.bounds_fix();
 		pos = absolute;
-		static_cast<bounds_t&>(*this) = bounds.centred(pos);
+		static_cast<bounds_t&>(*this) = bounds.centred(pos+offset);
 		spatial_index->move(this,prev);
 		if(was_visible != spatial_index->is_visible(*this)) {
 			if(was_visible)
@@ -619,7 +661,7 @@ void object_t::set_pos(const vec_t& absolute) {
 			panic(this << " is visible but is not in world");
 		bounds.bounds_fix();
 		pos = absolute;
-		static_cast<bounds_t&>(*this) = bounds.centred(pos);
+		static_cast<bounds_t&>(*this) = bounds.centred(pos+offset);
 	}
 }
 
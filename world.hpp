@@ -28,6 +28,7 @@ enum type_t {
 
 class world_t;
 class spatial_index_t;
+struct surface_index_t;
 
 class object_t: public bounds_t {
 public:
@@ -36,6 +37,7 @@ public:
 	void bounds_reset();
 	void bounds_include(const vec_t& v);
 	void bounds_fix();
+	void set_bounds(const aabb_t& box); // replaces what was included, e.g. with an animated model's current pose; box is relative to pos
 	virtual void draw(float d) = 0; // distance from camera
 	virtual bool refine_intersection(const ray_t& r,vec_t& I) = 0;
 	void move(const vec_t& relative) { set_pos(pos+relative); }
@@ -48,9 +50,13 @@ protected:
 private:
 	friend class spatial_index_t;
 	friend class world_t;
+	friend struct surface_index_t;
 	spatial_index_t* spatial_index;
+	surface_index_t* surface_index; // if it is in one, as well as the world
+	size_t surface_cell;
 	vec_t pos;
 	bounds_t bounds;
+	vec_t offset; // of the centre of a set_bounds box from pos; included points are centred on pos
 	uint8_t straddles;
 	bool visible;
 	void _do_set_pos(const vec_t& pos);
@@ -78,6 +84,7 @@ public:
 	void sort(hits_t& hits,sort_by_t sort_by) const;
 	void intersection(const ray_t& r,unsigned type,hits_t& hits,sort_by_t sort_by = SORT_BY_DISTANCE);
 	void intersection(const frustum_t& f,unsigned type,hits_t& hits,sort_by_t sort_by = SORT_BY_TYPE_THEN_DISTANCE);
+	void intersection(const sphere_t& s,unsigned type,hits_t& hits,sort_by_t sort_by = SORT_BY_DISTANCE);
 	void dump(std::ostream& out) const;
 	void set_frustum(const matrix_t& projection,const matrix_t& modelview);
 	intersection_t is_visible(const bounds_t& bounds) const;